@@ -0,0 +1,129 @@
+/**************************************************************************
+ * 
+ * AVI (MJPEG) writer kernels of the clip recorder: the header in front of
+ * the frames, frame chunks and the idx1 index (see CLIP_Open/CLIP_WriteFrame/
+ * CLIP_Close in main.cpp). Plain C++, so the file layout is also tested on
+ * the host by test/avi_writer_test.cpp.
+ * 
+ **************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define AVI_HEADER_SIZE 224                         // RIFF, hdrl list (avih, strl: strh, strf) and movi list header
+#define AVI_MOVI_ID (AVI_HEADER_SIZE - 4)           // File offset of the 'movi' id, idx1 offsets count from there
+
+struct AviStream {                                  // What the headers describe
+  uint16_t width;
+  uint16_t height;
+  uint32_t frames;
+  uint32_t durationMs;                              // First to last frame
+  uint32_t maxFrame;                                // Largest frame (bytes)
+};
+
+/**************************************************************************
+ * AVI_Put32 / AVI_Put16 / AVI_PutId
+ * - Little endian AVI header fields.
+ **************************************************************************/
+static inline uint8_t * AVI_Put32(uint8_t * p, uint32_t value) {
+  p[0] = value; p[1] = value >> 8; p[2] = value >> 16; p[3] = value >> 24;
+  return p + 4;
+}
+
+static inline uint8_t * AVI_Put16(uint8_t * p, uint16_t value) {
+  p[0] = value; p[1] = value >> 8;
+  return p + 2;
+}
+
+static inline uint8_t * AVI_PutId(uint8_t * p, const char * id) {
+  memcpy(p, id, 4);
+  return p + 4;
+}
+
+/**************************************************************************
+ * AVI_Header
+ * - The AVI_HEADER_SIZE bytes in front of the frames: RIFF header, main and
+ *   stream (MJPEG) headers, and the start of the movi list.
+ * - The frame rate is the measured one (first to last frame), fps until
+ *   there are two frames.
+ * - Returns the bytes written (AVI_HEADER_SIZE).
+ **************************************************************************/
+static inline size_t AVI_Header(uint8_t * h, const AviStream& info, int fps, uint32_t moviSize, uint32_t indexSize) {
+  uint32_t usPerFrame = (info.frames > 1) ? (uint64_t)info.durationMs * 1000 / (info.frames - 1) : 1000000 / fps;
+  uint8_t * p = h;
+
+  if (usPerFrame == 0) usPerFrame = 1000000 / fps;
+  p = AVI_PutId(p, "RIFF"); p = AVI_Put32(p, AVI_HEADER_SIZE - 8 + moviSize + indexSize); p = AVI_PutId(p, "AVI ");
+  p = AVI_PutId(p, "LIST"); p = AVI_Put32(p, 192); p = AVI_PutId(p, "hdrl");
+  // Main header (avih)
+  p = AVI_PutId(p, "avih"); p = AVI_Put32(p, 56);
+  p = AVI_Put32(p, usPerFrame);
+  p = AVI_Put32(p, (uint64_t)info.maxFrame * 1000000 / usPerFrame);   // max bytes per second
+  p = AVI_Put32(p, 0);                                                // padding granularity
+  p = AVI_Put32(p, 0x10);                                             // AVIF_HASINDEX
+  p = AVI_Put32(p, info.frames);
+  p = AVI_Put32(p, 0);                                                // initial frames
+  p = AVI_Put32(p, 1);                                                // streams
+  p = AVI_Put32(p, info.maxFrame);                                    // suggested buffer size
+  p = AVI_Put32(p, info.width);
+  p = AVI_Put32(p, info.height);
+  memset(p, 0, 16); p += 16;                                          // reserved
+  // Stream list: stream header (strh) and format (strf, BITMAPINFOHEADER)
+  p = AVI_PutId(p, "LIST"); p = AVI_Put32(p, 116); p = AVI_PutId(p, "strl");
+  p = AVI_PutId(p, "strh"); p = AVI_Put32(p, 56);
+  p = AVI_PutId(p, "vids"); p = AVI_PutId(p, "MJPG");
+  p = AVI_Put32(p, 0);                                                // flags
+  p = AVI_Put32(p, 0);                                                // priority, language
+  p = AVI_Put32(p, 0);                                                // initial frames
+  p = AVI_Put32(p, usPerFrame); p = AVI_Put32(p, 1000000);            // scale, rate: rate/scale = frames per second
+  p = AVI_Put32(p, 0);                                                // start
+  p = AVI_Put32(p, info.frames);                                      // length
+  p = AVI_Put32(p, info.maxFrame);                                    // suggested buffer size
+  p = AVI_Put32(p, 0xFFFFFFFF);                                       // quality (default)
+  p = AVI_Put32(p, 0);                                                // sample size (varies)
+  p = AVI_Put16(p, 0); p = AVI_Put16(p, 0); p = AVI_Put16(p, info.width); p = AVI_Put16(p, info.height);
+  p = AVI_PutId(p, "strf"); p = AVI_Put32(p, 40);
+  p = AVI_Put32(p, 40);
+  p = AVI_Put32(p, info.width);
+  p = AVI_Put32(p, info.height);
+  p = AVI_Put16(p, 1);                                                // planes
+  p = AVI_Put16(p, 24);                                               // bits per pixel
+  p = AVI_PutId(p, "MJPG");
+  p = AVI_Put32(p, (uint32_t)info.width * info.height * 3);           // image size
+  memset(p, 0, 16); p += 16;                                          // resolution, colors
+  // Frames
+  p = AVI_PutId(p, "LIST"); p = AVI_Put32(p, 4 + moviSize); p = AVI_PutId(p, "movi");
+  return p - h;
+}
+
+/**************************************************************************
+ * AVI_AddFrame
+ * - Account a frame chunk ('00dc' header, JPEG, padded to an even size)
+ *   appended to the movi list: its idx1 entry (offset from the 'movi' id,
+ *   size) goes to index[2 * frame], the movi list grows.
+ **************************************************************************/
+static inline void AVI_AddFrame(AviStream * info, uint32_t * index, uint32_t * moviSize, uint32_t len) {
+  index[2 * info->frames] = 4 + *moviSize;
+  index[2 * info->frames + 1] = len;
+  *moviSize += 8 + len + (len & 1);
+  info->frames++;
+  if (len > info->maxFrame) info->maxFrame = len;
+}
+
+/**************************************************************************
+ * AVI_IndexSize / AVI_IndexEntry
+ * - Size of the idx1 chunk (header and 16 bytes per frame).
+ * - One idx1 entry, every JPEG is a key frame.
+ **************************************************************************/
+static inline uint32_t AVI_IndexSize(uint32_t frames) {
+  return 8 + 16 * frames;
+}
+
+static inline uint8_t * AVI_IndexEntry(uint8_t * p, uint32_t offset, uint32_t size) {
+  p = AVI_PutId(p, "00dc");
+  p = AVI_Put32(p, 0x10);                                             // AVIIF_KEYFRAME
+  p = AVI_Put32(p, offset);
+  return AVI_Put32(p, size);
+}
@@ -0,0 +1,84 @@
+/**************************************************************************
+ * 
+ * Lock-free event rings (ISR/MQTT -> loop), see EVT_Next in main.cpp.
+ * Plain C++ apart from IRAM_ATTR, so the ring is also built on the host
+ * by test/event_ring_test.cpp.
+ * 
+ **************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+#ifndef EVT_RING_SIZE
+#define EVT_RING_SIZE            32                         // Events per ring (power of 2)
+#endif
+
+enum EventType : uint8_t {
+  EVT_PIR_RISE,                                     // PIR output went high (ISR)
+  EVT_PIR_FALL,                                     // PIR output went low (ISR)
+  EVT_PHOTO                                         // Photo requested (MQTT)
+};
+
+struct AppEvent {
+  int64_t time;                                     // esp_timer time of the event (us)
+  EventType type;
+};
+
+// Lock-free single-producer/single-consumer ring. head is only written by
+// the producer, tail only by the consumer, so no locks are needed.
+struct EventRing {
+  AppEvent slot[EVT_RING_SIZE];
+  volatile uint32_t head;                           // Next slot to write (producer)
+  volatile uint32_t tail;                           // Next slot to read (consumer)
+  volatile uint32_t overflows;                      // Events dropped because the ring was full (producer)
+  uint32_t highWater;                               // Most events waiting at once (consumer)
+};
+
+/**************************************************************************
+ * EVT_Push
+ * - Add an event to a ring (producer side). Safe to call from an ISR.
+ * - If the ring is full the event is dropped and counted, never overwritten.
+ **************************************************************************/
+static bool IRAM_ATTR EVT_Push(EventRing * ring, EventType type, int64_t time) {
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail >= EVT_RING_SIZE) {
+    ring->overflows++;
+    return false;
+  }
+  ring->slot[head % EVT_RING_SIZE].time = time;
+  ring->slot[head % EVT_RING_SIZE].type = type;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);   // Publish the slot after it is written
+  return true;
+}
+
+/**************************************************************************
+ * EVT_Peek
+ * - Get the oldest event of a ring without removing it (consumer side).
+ **************************************************************************/
+static bool EVT_Peek(EventRing * ring, AppEvent * event) {
+  uint32_t tail = ring->tail;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  if (head == tail) {
+    return false;
+  }
+  if (head - tail > ring->highWater) {
+    ring->highWater = head - tail;
+  }
+  *event = ring->slot[tail % EVT_RING_SIZE];
+  return true;
+}
+
+/**************************************************************************
+ * EVT_Pop
+ * - Remove the event returned by EVT_Peek (consumer side).
+ **************************************************************************/
+static void EVT_Pop(EventRing * ring) {
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);   // Release the slot after it is read
+}
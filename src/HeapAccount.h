@@ -0,0 +1,73 @@
+/**************************************************************************
+ * 
+ * Heap accounting per subsystem: tagged bytes allocated now and at peak,
+ * and the block header that carries the tag from an allocation to its
+ * free (see HEAP_Alloc/HEAP_Free in main.cpp). Safe to update from any
+ * task. Plain C++, so the accounting is also tested on the host by
+ * test/heap_account_test.cpp.
+ * 
+ **************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum HeapTag { HEAP_MQTT, HEAP_JSON, HEAP_HTTP, HEAP_STREAM, HEAP_CAMERA, HEAP_TAGS };
+struct HeapAccount {
+  const char * name;
+  int32_t current;                                  // Tagged bytes allocated now
+  int32_t peak;                                     // Most tagged bytes allocated at once
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t failed;                                  // Allocations that failed (out of memory)
+  int32_t retained;                                 // Free heap lost over all scopes
+  uint32_t scopes;
+};
+
+struct HeapBlock {                                  // Header in front of each HEAP_Alloc block
+  uint32_t size;
+  uint32_t tag;
+};
+
+/**************************************************************************
+ * HEAP_Allocated / HEAP_Freed
+ * - Account bytes allocated or freed. The peak is raised with a
+ *   compare-and-swap loop, so concurrent allocations never lower it.
+ **************************************************************************/
+static inline void HEAP_Allocated(HeapAccount * account, uint32_t bytes) {
+  int32_t current = __atomic_add_fetch(&account->current, (int32_t)bytes, __ATOMIC_RELAXED);
+  int32_t peak = __atomic_load_n(&account->peak, __ATOMIC_RELAXED);
+
+  __atomic_add_fetch(&account->allocs, 1, __ATOMIC_RELAXED);
+  while (current > peak && !__atomic_compare_exchange_n(&account->peak, &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static inline void HEAP_Freed(HeapAccount * account, uint32_t bytes) {
+  __atomic_sub_fetch(&account->current, (int32_t)bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&account->frees, 1, __ATOMIC_RELAXED);
+}
+
+/**************************************************************************
+ * HEAP_Tag / HEAP_Untag
+ * - HEAP_Tag: write the header of a new block (sizeof(HeapBlock) + size
+ *   bytes), account it and return the memory after the header.
+ * - HEAP_Untag: account the free of that memory and return the block to
+ *   release.
+ **************************************************************************/
+static inline void * HEAP_Tag(HeapAccount * accounts, void * raw, HeapTag tag, size_t size) {
+  HeapBlock * block = (HeapBlock *)raw;
+
+  block->size = size;
+  block->tag = tag;
+  HEAP_Allocated(&accounts[tag], size);
+  return block + 1;
+}
+
+static inline void * HEAP_Untag(HeapAccount * accounts, void * ptr) {
+  HeapBlock * block = (HeapBlock *)ptr - 1;
+
+  HEAP_Freed(&accounts[block->tag], block->size);
+  return block;
+}
@@ -0,0 +1,99 @@
+/**************************************************************************
+ * 
+ * Scene signature and average hash kernels: an 8x8 grid of cell
+ * luminances over a 1/8-scale decoded frame, its 64-bit average hash and
+ * the Hamming distance used for dedup (see img_Cells/img_Hash in main.cpp).
+ * Plain C++, so the kernels are also tested and benchmarked on the host by
+ * test/image_hash_test.cpp.
+ * 
+ **************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+struct ImgCellGrid {
+  uint32_t sum[64];                                 // Luminance sum per cell of the 8x8 grid
+  uint16_t count[64];                               // Pixels per cell
+};
+
+/**************************************************************************
+ * IMG_GridAdd
+ * - Add a block of decoded pixels (BGR888, w x h at x,y, as the JPEG
+ *   decoder hands them out) to the grid. Only the pixels in the window
+ *   (winX, winY, winW x winH) count, the window is split into 8x8 cells.
+ **************************************************************************/
+static inline void IMG_GridAdd(ImgCellGrid * grid, int winX, int winY, int winW, int winH,
+                               int x, int y, int w, int h, const uint8_t * data) {
+  for (int row = y; row < y + h; row++) {
+    if (row < winY || row >= winY + winH) {
+      data += w * 3;
+      continue;
+    }
+    int cellRow = (row - winY) * 8 / winH * 8;
+    for (int col = x; col < x + w; col++, data += 3) {
+      if (col < winX || col >= winX + winW) continue;
+      int cell = cellRow + (col - winX) * 8 / winW;
+      grid->sum[cell] += (data[2] * 77 + data[1] * 150 + data[0] * 29) >> 8;       // BGR -> luminance
+      grid->count[cell]++;
+    }
+  }
+}
+
+/**************************************************************************
+ * IMG_GridCells
+ * - Average luminance (0-255) of each cell.
+ **************************************************************************/
+static inline void IMG_GridCells(const ImgCellGrid * grid, uint8_t cells[64]) {
+  for (int i = 0; i < 64; i++) {
+    cells[i] = grid->count[i] ? grid->sum[i] / grid->count[i] : 0;
+  }
+}
+
+/**************************************************************************
+ * IMG_HashCells
+ * - Average hash (aHash): one bit per cell, set when the cell is brighter
+ *   than the whole image.
+ **************************************************************************/
+static inline uint64_t IMG_HashCells(const uint8_t cells[64]) {
+  uint32_t total = 0;
+  uint64_t hash = 0;
+
+  for (int i = 0; i < 64; i++) {
+    total += cells[i];
+  }
+  for (int i = 0; i < 64; i++) {
+    if (cells[i] * 64 > total) {
+      hash |= (uint64_t)1 << i;
+    }
+  }
+  return hash;
+}
+
+/**************************************************************************
+ * IMG_HashDistance / IMG_Duplicate
+ * - Hamming distance of two hashes (bits that differ, 0-64).
+ * - A photo is a near duplicate when its distance to the last upload is
+ *   below the threshold (DedupThreshold, 0 = dedup disabled).
+ **************************************************************************/
+static inline int IMG_HashDistance(uint64_t a, uint64_t b) {
+  return __builtin_popcountll(a ^ b);
+}
+
+static inline bool IMG_Duplicate(int distance, int threshold) {
+  return threshold > 0 && distance < threshold;
+}
+
+/**************************************************************************
+ * IMG_CellsChanged
+ * - Did any cell luminance change by more than delta? (idle stream check)
+ **************************************************************************/
+static inline bool IMG_CellsChanged(const uint8_t cells[64], const uint8_t ref[64], int delta) {
+  for (int i = 0; i < 64; i++) {
+    int diff = cells[i] - ref[i];
+    if (diff > delta || diff < -delta) {
+      return true;
+    }
+  }
+  return false;
+}
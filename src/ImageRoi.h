@@ -0,0 +1,87 @@
+/**************************************************************************
+ * 
+ * Region of interest kernels: the ROI rectangle in decoded pixels, the
+ * OV2640 sensor window for roi_mode 2 and the per-block crop copy used
+ * while decoding a photo (see img_CropRoi/cam_ApplyRoi in main.cpp).
+ * Plain C++, so the kernels are also tested and benchmarked on the host by
+ * test/image_roi_test.cpp.
+ * 
+ **************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+struct ImgRect {
+  uint16_t x, y, w, h;                              // Region in decoded (scaled) pixels
+};
+
+struct ImgWindow {
+  int offsetX, offsetY;                             // Window position in UXGA sensor pixels
+  int totalX, totalY;                               // Window size in UXGA sensor pixels
+  int outputX, outputY;                             // Scaled frame size
+};
+
+/**************************************************************************
+ * IMG_RoiRect
+ * - ROI (x, y, w, h in % of the frame) to pixels of a frameW x frameH
+ *   frame, clipped to the frame.
+ * - Returns false when the region is too small to decode (< 8 pixels).
+ **************************************************************************/
+static inline bool IMG_RoiRect(int frameW, int frameH, int roiX, int roiY, int roiW, int roiH, ImgRect * rect) {
+  int x = frameW * roiX / 100;
+  int y = frameH * roiY / 100;
+  int w = frameW * roiW / 100;
+  int h = frameH * roiH / 100;
+
+  rect->x = x;
+  rect->y = y;
+  rect->w = w < frameW - x ? w : frameW - x;
+  rect->h = h < frameH - y ? h : frameH - y;
+  return rect->w >= 8 && rect->h >= 8;
+}
+
+/**************************************************************************
+ * IMG_RoiWindow
+ * - OV2640 sensor window for the ROI, in UXGA (1600x1200) sensor pixels.
+ * - Position/size are multiples of 8 for the DSP scaler, the window is at
+ *   least 64x64 and inside the sensor; the output is the window >> scale.
+ **************************************************************************/
+static inline void IMG_RoiWindow(int roiX, int roiY, int roiW, int roiH, int scale, ImgWindow * win) {
+  win->offsetX = (1600 * roiX / 100) & ~7;
+  win->offsetY = (1200 * roiY / 100) & ~7;
+  win->totalX = (1600 * roiW / 100) & ~7;
+  win->totalY = (1200 * roiH / 100) & ~7;
+  if (win->totalX < 64) win->totalX = 64;
+  if (win->totalY < 64) win->totalY = 64;
+  if (win->totalX > 1600 - win->offsetX) win->totalX = 1600 - win->offsetX;
+  if (win->totalY > 1200 - win->offsetY) win->totalY = 1200 - win->offsetY;
+  win->outputX = (win->totalX >> scale) & ~7;
+  win->outputY = (win->totalY >> scale) & ~7;
+}
+
+/**************************************************************************
+ * IMG_RoiCopy
+ * - Copy the part of a decoded block (BGR888, w x h at x,y, as the JPEG
+ *   decoder hands them out) that lies inside the ROI into the ROI buffer
+ *   (RGB888, rect->w * rect->h * 3, the layout fmt2rgb888() produces).
+ **************************************************************************/
+static inline void IMG_RoiCopy(const ImgRect * rect, uint8_t * rgb, int x, int y, int w, int h, const uint8_t * data) {
+  int x0 = x > rect->x ? x : rect->x, x1 = x + w < rect->x + rect->w ? x + w : rect->x + rect->w;
+  int y0 = y > rect->y ? y : rect->y, y1 = y + h < rect->y + rect->h ? y + h : rect->y + rect->h;
+
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  for (int row = y0; row < y1; row++) {
+    const uint8_t * src = data + ((row - y) * w + (x0 - x)) * 3;
+    uint8_t * dst = rgb + ((row - rect->y) * rect->w + (x0 - rect->x)) * 3;
+    for (int col = x0; col < x1; col++) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      src += 3;
+      dst += 3;
+    }
+  }
+}
@@ -11,4 +11,7 @@ const char* MQTT_server = "<MQTT Broker Server IP>";                        // M
 const char* MQTT_user = "<MQTT User>";                                      // MQTT Broker user (optional, if required)
 const char* MQTT_pwd = "<MQTT Password>";                                   // MQTT Broker password (optional, if required)
 
+const char* ntp_server = "pool.ntp.org";                                    // NTP server, used to timestamp uploaded photos
+const char* ntp_timezone = "UTC0";                                          // POSIX TZ string (timestamps are sent in UTC)
+
 const char* upload_url = "http://<Web Server IP>:2020/saveimage.php";       // Location where images are POSTED
@@ -0,0 +1,82 @@
+/**************************************************************************
+ * 
+ * Wire format of the state, config and camera settings reports: JSON, or
+ * MessagePack with short keys (the index of each key in wireKeys), see
+ * mqttPublishReport/WIRE_Benchmark in main.cpp. Needs ArduinoJson only, so
+ * the payloads are also tested and benchmarked on the host by
+ * test/wire_format_test.cpp.
+ * 
+ **************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <ArduinoJson.h>
+
+// Wire format of the state, config and camera settings reports (config.WireFormat).
+// MessagePack uses short keys: the index of the key in wireKeys. APPEND ONLY, receivers decode with this table ("wirekeys").
+enum WireFormat { WIRE_JSON, WIRE_MSGPACK };
+static const char * const wireKeys[] = {
+  // reportState
+  "IP Address", "RSSI (dBm)", "wifi", "Core Temperature (°C)", "Uptime", "Start Reason", "Free Heap Memory", "Min Free Heap",
+  "WiFi Reconnects", "MQTT Reconnects", "Last Downtime (s)", "Total Downtime (s)", "MQTT Publish Failures", "MQTT Oversize",
+  "Motion Sessions", "PIR Pulses", "PIR Pulse Rate (/min)", "PIR Pulse Width (ms)", "PIR Retriggers Suppressed",
+  "Events Dropped", "Events Max Queued", "Rate Limit Dropped", "Rate Limit Deferred", "Photos Pending", "Boots", "PIR Wakeups",
+  "Awake (%)", "Est Current (mA)", "Wake To Photo Last (ms)", "Wake To Photo Avg (ms)", "Wake To Photo Max (ms)",
+  "Time-lapse Frames", "Time-lapse Uploads", "Time-lapse Deferred", "Time-lapse Skipped", "Time-lapse Failed",
+  "Trigger To Exposure Last (ms)", "Trigger To Exposure Avg (ms)", "Trigger To Exposure Max (ms)", "Stale Frames Drained",
+  "Frame Period (ms)", "Pipeline", "JPEG Quality", "Last Photo (bytes)", "Duplicates Skipped", "Hash Distance",
+  "Hash Last (us)", "Hash Max (us)", "ROI Photos", "ROI Failures", "ROI Last (ms)", "ROI Max (ms)", "ROI Last In/Out (bytes)",
+  // Nested in the state: rate limit classes, pipeline stages and their statistics
+  "motion", "pirphoto", "photo", "telemetry", "capture", "upload", "stream",
+  "busy %", "per min", "avg ms", "max ms", "queued", "queue max", "dropped",
+  // reportConfig
+  "CAM_enabled", "PIR_enabled", "PIR_delay", "ReportState", "ReportWiFi", "TempInterval", "StateInterval", "DedupThreshold",
+  "PowerMode", "SleepIdle", "LapseInterval", "LapseStart", "LapseEnd", "LapseBatch", "TopicPrefix", "ClientId", "WireFormat",
+  // cam_ReportSettings
+  "sensor", "framesize", "quality", "aec", "aec2", "ae_level", "agc", "gainceiling", "awb", "awb_gain", "wb_mode",
+  "aec_value", "agc_gain", "brightness", "contrast", "saturation", "sharpness", "denoise",
+  "special_effect", "bpc", "wpc", "raw_gma", "lenc", "hmirror", "vflip", "dcw", "colorbar",
+  "target_size", "target_time", "roi_mode", "roi_x", "roi_y", "roi_w", "roi_h", "roi_scale", "profile",
+  "grab_mode", "fb_location", "fresh",
+  // Added later
+  "ClipSeconds", "ClipFps", "StreamIdle", "Stream Idle", "Stream Frames Saved", "Stream Saved (kB/h)", "Stream Check (us)",
+  "night", "Night Photos", "Night Scene Luma", "Night Photo Luma", "Night Exposure", "Night Gain", "Night Frames Per Photo",
+  "Trigger To Usable Last (ms)", "Trigger To Usable Avg (ms)", "Trigger To Usable Max (ms)", "Night To Usable Avg (ms)",
+  "StallThreshold", "Offline Photos Spooled", "Offline Photos Dropped", "Offline Photos Waiting"
+};
+static const int WIRE_KEYS = sizeof(wireKeys) / sizeof(wireKeys[0]);
+static char wireKeyIds[WIRE_KEYS][4];               // "0", "1", .. (static, so not copied into the documents)
+
+/**************************************************************************
+ * WIRE_Key
+ * - Short key for a report key: its index in wireKeys. Keys that are not
+ *   in the table are kept.
+ **************************************************************************/
+static inline const char * WIRE_Key(const char * key) {
+  for (int i = 0; i < WIRE_KEYS; i++) {
+    if (strcmp(key, wireKeys[i]) == 0) {
+      if (!wireKeyIds[i][0]) {
+        snprintf(wireKeyIds[i], sizeof(wireKeyIds[i]), "%d", i);
+      }
+      return wireKeyIds[i];
+    }
+  }
+  return key;
+}
+
+/**************************************************************************
+ * WIRE_Compact
+ * - Copy a report object with short keys (nested objects included).
+ **************************************************************************/
+static inline void WIRE_Compact(JsonObjectConst src, JsonObject dst) {
+  for (JsonPairConst member : src) {
+    const char * key = WIRE_Key(member.key().c_str());
+    if (member.value().is<JsonObjectConst>()) {
+      WIRE_Compact(member.value().as<JsonObjectConst>(), dst.createNestedObject(key));
+    } else {
+      dst[key] = member.value();
+    }
+  }
+}
@@ -28,21 +28,155 @@
 #define pinPIR            13                                // GPIO pin used for PIR data connection
 #define pinOneWire         2                                // GPIO pin for One Wire bus    (possible: 2, 14, 15, 13, 12, 16)
 
-// MQTT Topics
-#define MQTT_PUB_TEMP           "gate/temperature/state"    // PUBLISH: current temperate value                 (value)
-#define MQTT_PUB_MOTION         "gate/motion/state"         // PUBLISH: motion detected / motion stopped        (on/off)
-#define MQTT_PUB_CAMERA         "gate/camera/state"         // PUBLISH: camera related events                   (photo/video/settings)
-#define MQTT_PUB_CONFIG         "gate/monitor/config"       // PUBLISH: general settings                        (JSON settings)
-#define MQTT_PUB_STATE          "gate/monitor/state"        // PUBLISH: telemetry metrics                       (JSON parameters)
-#define MQTT_PUB_WIFI           "gate/monitor/wifi"         // PUBLISH: current WiFi (%) value                  (value)
-#define MQTT_SUB_CAMCOMMAND     "gate/camera/cmnd"          // SUBSCRIBE: actions related to camera             (photo/video/enable/disable/report)
-#define MQTT_SUB_CAMSETTING     "gate/camera/setsetting"    // SUBSCRIBE: set new camera setting                (<setting>:<value>)
-#define MQTT_SUB_MOTION         "gate/motion/cmnd"          // SUBSCRIBE: PIR sensor behaviour                  (enable/disable/delay-<value>)
-#define MQTT_SUB_TEMP           "gate/temperature/cmnd"     // SUBSCRIBE: actions related to Temperature        (update/interval)
-#define MQTT_SUB_MONITOR        "gate/monitor/cmnd"         // SUBSCRIBE: actions related to Monitor (ESP32)    (update/interval)
+// MQTT Topics: "<prefix>/<suffix>", e.g. "gate/camera/cmnd". The prefix is set per device ("prefix" command).
+#define MQTT_TOPIC_PREFIX       "gate"                      // Default topic prefix ("" = "cam-<last 6 MAC digits>")
+#define MQTT_CLIENT_ID          "ESP32Cam"                  // Client ID, "-<last 6 MAC digits>" is added (unique per device)
+#define MQTT_TOPIC_SIZE         64                          // Longest topic, including the prefix
+#define MQTT_PUB_TEMP           "temperature/state"         // PUBLISH: current temperate value                 (value)
+#define MQTT_PUB_MOTION         "motion/state"              // PUBLISH: motion detected / motion stopped        (on/off)
+#define MQTT_PUB_MOTIONSESSION  "motion/session"            // PUBLISH: motion session start / stop             (JSON duration, pulses)
+#define MQTT_PUB_CAMERA         "camera/state"              // PUBLISH: camera related events                   (photo/video/settings)
+#define MQTT_PUB_CONFIG         "monitor/config"            // PUBLISH: general settings                        (JSON settings)
+#define MQTT_PUB_STATE          "monitor/state"             // PUBLISH: telemetry metrics                       (JSON parameters)
+#define MQTT_PUB_WIFI           "monitor/wifi"              // PUBLISH: current WiFi (%) value                  (value)
+#define MQTT_PUB_HEAP           "monitor/heap"              // PUBLISH: heap use per subsystem, fragmentation   (JSON parameters)
+#define MQTT_PUB_WIRE           "monitor/wire"              // PUBLISH: wire format benchmark, short key table  (JSON)
+#define MQTT_PUB_CONFIGERROR    "monitor/config/error"      // PUBLISH: rejected "setconfig" document           (reason)
+#define MQTT_PUB_CLIP           "camera/clip"               // PUBLISH: clip recorded, clip recorder report     (JSON)
+#define MQTT_PUB_PROFILE        "monitor/profile"           // PUBLISH: task CPU/stacks, loop section times, stalls (JSON)
+#define MQTT_SUB_CAMCOMMAND     "camera/cmnd"               // SUBSCRIBE: actions related to camera             (photo/video/enable/disable/report)
+#define MQTT_SUB_CAMSETTING     "camera/setsetting"         // SUBSCRIBE: set new camera setting                (<setting>:<value>)
+#define MQTT_SUB_MOTION         "motion/cmnd"               // SUBSCRIBE: PIR sensor behaviour                  (enable/disable/delay-<value>)
+#define MQTT_SUB_TEMP           "temperature/cmnd"          // SUBSCRIBE: actions related to Temperature        (update/interval)
+#define MQTT_SUB_TIMELAPSE      "timelapse/cmnd"            // SUBSCRIBE: time-lapse schedule                   (interval/window/batch)
+#define MQTT_SUB_MONITOR        "monitor/cmnd"              // SUBSCRIBE: actions related to Monitor (ESP32)    (update/interval)
+#define MQTT_SUB_SETCONFIG      "monitor/setconfig"         // SUBSCRIBE: set several configuration values      (JSON, any subset of the config)
+
+// WiFi/MQTT connection management
+#define NET_WIFI_TIMEOUT      15000                         // Give up on a WiFi connect attempt after (ms)
+#define NET_MQTT_TIMEOUT          3                         // MQTT socket timeout (s)
+#define NET_BACKOFF_MIN        1000                         // First retry delay after a failed attempt (ms)
+#define NET_BACKOFF_MAX       60000                         // Maximum retry delay (ms)
+#define MQTT_MAX_PAYLOAD       4096                         // Largest JSON payload that will be published (bytes)
+#define MQTT_CHUNK_SIZE          64                         // Write-combining chunk when streaming JSON to MQTT (bytes)
+
+// Automatic JPEG quality (camera settings "target_size" / "target_time")
+#define CAM_QUALITY_MIN           8                         // Best quality the auto quality may select
+#define CAM_QUALITY_MAX          50                         // Worst quality the auto quality may select
+#define CAM_QUALITY_DEADBAND     10                         // Photo size within this % of the target: no change
+#define CAM_QUALITY_SMOOTHING  0.5f                         // Weight of the latest photo in the running estimates
+#define CAM_QUALITY_SAVE_INTERVAL 600000                    // Minimum time between saving the learned quality (ms)
+
+// Photo pipeline (capture task -> upload task). The loop task runs on core 1, WiFi on core 0.
+#define PIPE_CAPTURE_CORE         1                         // Core of the capture task
+#define PIPE_UPLOAD_CORE          0                         // Core of the upload task and the video stream
+#define PIPE_CAPTURE_QUEUE        4                         // Photo requests waiting for the camera
+#define PIPE_UPLOAD_QUEUE         1                         // Frames waiting for upload (frame buffers are scarce)
+#define PIPE_WAIT              3000                         // Longest wait for room in the upload queue before a frame is dropped (ms)
+#define PIPE_SPOOL_PHOTOS         4                         // Photos kept (PSRAM copies) while offline, uploaded when back online
+#define PIPE_CAPTURE_STACK     4096
+#define PIPE_UPLOAD_STACK      8192
+#define STATE_JSON_SIZE        2048                         // JSON document size for the state report
+#define WIRE_BENCH_RUNS          20                         // Serializations per format in "wirebench"
+
+// Profiler ("profile" command) and stall detector (configuration "StallThreshold")
+#define PROFILE_STALL_MS       2000                         // Default stall threshold: a loop section or photo job taking longer (ms)
+#define PROFILE_MAX_TASKS        24                         // Most tasks with CPU use in the profile (all tasks are listed)
+#define PROFILE_JSON_SIZE      3072                         // JSON document size for the profile report
+
+// Fresh frame capture (camera setting "fresh")
+#define CAM_FRAME_PERIOD     125000                         // Initial frame period estimate (us), measured while running
+#define CAM_FRESH_MAX_DRAIN       4                         // Most stale frames discarded for one photo
+#define CAM_REINIT_WAIT        2000                         // "grab_mode"/"fb_location": longest wait for the streams to return their frames (ms)
+
+// Night capture (camera setting "night"): flash photos with a preloaded exposure
+#define NIGHT_LUMA_DARK          40                         // Scene darker than this (average luminance 0-255, running exposure): night capture
+#define NIGHT_LUMA_TARGET       110                         // Photo luminance the learned night exposure aims for
+#define NIGHT_AEC_VALUE         300                         // Initial night exposure (aec_value, 0-1200), learned from the night photos
+#define NIGHT_AGC_GAIN            4                         // Initial night gain (agc_gain, 0-30), learned from the night photos
+#define NIGHT_AEC_MAX          1200
+#define NIGHT_AGC_MAX            30
+
+// Region of interest (camera settings "roi_...")
+#define CAM_ROI_JPEG_QUALITY     80                         // JPEG quality (1-100, higher = better) when re-encoding a cropped photo
+
+// Duplicate photo detection (camera command "dedup:<bits>")
+#define IMG_DEDUP_REFRESH    600000                         // Upload a new reference photo at least this often (ms)
+
+// Photo upload (multipart/form-data: "meta" JSON part + "image" JPEG part)
+#define UPLOAD_BOUNDARY "GateMonitorUpload7d4a1e9c"
+#define UPLOAD_HEAD_SIZE        640                         // Buffer for the multipart framing and metadata (bytes)
+
+// Event rings (PIR ISR / MQTT -> loop)
+#define EVT_RING_SIZE            32                         // Events per ring (power of 2)
+
+// PIR motion sessions
+#define MOTION_END_DELAY       5000                         // Motion stopped when the PIR stays low this long (ms)
+#define MOTION_NOISY_RATE        12                         // PIR pulses/minute above which retriggers are suppressed more
+#define MOTION_MAX_SUPPRESS       4                         // Noisy PIR: at most this many times PIR_delay between photos
+#define MOTION_SMOOTHING       0.2f                         // Weight of the latest pulse in the pulse rate/width averages
+
+// Rate limits (token buckets: burst, refill per minute). Change at runtime with "ratelimit:<class>:<burst>:<per minute>".
+#define RL_MOTION_BURST          10                         // Motion start/stop publishes
+#define RL_MOTION_PER_MIN        30
+#define RL_PIRPHOTO_BURST         5                         // PIR triggered photo uploads
+#define RL_PIRPHOTO_PER_MIN       6
+#define RL_PHOTO_BURST            3                         // MQTT requested photo uploads (deferred when limited)
+#define RL_PHOTO_PER_MIN          4
+#define RL_TELEMETRY_BURST        5                         // State, WiFi and temperature reports
+#define RL_TELEMETRY_PER_MIN     10
+#define RL_UPLINK_BURST          15                         // Shared by all of the above
+#define RL_UPLINK_PER_MIN        30
+#define RL_PRIORITY_RESERVE       2                         // Uplink tokens each class leaves for every higher priority class
+#define RL_MAX_DEFERRED           5                         // Most deferred MQTT photo requests
+
+// Time-lapse (see "gate/timelapse/cmnd")
+#define LAPSE_MAX_BATCH           8                         // Most frames uploaded in one request
+#define LAPSE_BUFFER_SIZE    786432                         // Batch buffer in PSRAM (bytes), sent early when full
+
+// Low-power mode. Board currents are estimates for an AI Thinker ESP32-CAM, calibrate with a meter.
+#define POWER_SLEEP_IDLE      30000                         // Default idle time (ms) before sleeping
+#define POWER_MA_AWAKE        160.0f                        // Awake: WiFi, camera and PSRAM on (mA)
+#define POWER_MA_LIGHT         15.0f                        // Light sleep: camera and PSRAM still powered (mA)
+#define POWER_MA_DEEP           6.0f                        // Deep sleep: camera powered down, regulator and PSRAM (mA)
+#define RTC_MAGIC       0x47415445                          // Marks valid data in RTC memory
+
+// Clip recorder: motion clips as AVI (MJPEG) files on the SD card, "/clips" on the web server.
+// The SD card is used in 1-bit mode (GPIO 2, 14 and 15): GPIO 2 is the default One Wire pin,
+// move the DS18B20 (pinOneWire) before enabling. Enable with build flag -DCLIP_RECORDER=1.
+#ifndef CLIP_RECORDER
+#define CLIP_RECORDER             0
+#endif
+#define CLIP_DIR            "/clips"                        // Clip folder on the SD card ("clip0001.avi", ..)
+#define CLIP_MAX_SECONDS         60                         // Longest "ClipSeconds" setting
+#define CLIP_MAX_FRAMES        1500                         // Longest clip (frames), the index is preallocated for it
+#define CLIP_POST_ROLL         3000                         // Keep recording while motion continues, and this long after (ms)
+#define CLIP_MIN_FREE      (64ULL << 20)                    // Delete the oldest clips to keep this much free on the card (bytes)
+#define CLIP_STACK             4096
+#define CLIP_SEND_CHUNK        4096                         // Read/send size when a clip is downloaded (bytes)
+
+// Idle-scene suppression for the video streams (configuration "StreamIdle")
+#define STREAM_IDLE_SIZE_DELTA    3                         // JPEG size change (%) that counts as a scene change, without decoding
+#define STREAM_IDLE_LUMA_DELTA   10                         // Cell luminance change (0-255, 8x8 grid) that counts as a scene change
+#define STREAM_IDLE_AFTER      2000                         // Scene unchanged this long: stream goes idle (ms)
+#define STREAM_KEEPALIVE       1000                         // Idle stream: one frame per this time (ms)
+#define STREAM_IDLE_CHECK       100                         // Idle stream: time between checks for a change (ms)
+
+// WebSocket video stream ("ws://<camera>/ws", needs CONFIG_HTTPD_WS_SUPPORT)
+#define WS_MAX_CLIENTS            2                         // WebSocket stream clients at once
+#define WS_INITIAL_CREDITS        1                         // Frames a new client may receive before its first ack
+#define WS_MAX_CREDITS            4                         // Most frames in flight per client (bounds the latency)
+#define WS_DEFAULT_FPS           10                         // Frame rate until the client sets one ("fps:<n>")
+#define WS_STACK               4096
+
+// Prometheus metrics ("http://<camera>:81/metrics"), own web server: answered while a video stream runs
+#define METRICS_PORT             81
+#define METRICS_BUFFER_SIZE    4096                         // Static text buffer for a scrape (bytes)
+#define METRICS_UPLOAD_BUCKETS 100, 250, 500, 1000, 2500, 5000, 10000   // Upload latency histogram bucket bounds (ms)
 
 #define CONFIGFILE "/config.json"                           // SPIFFS file with general app settings
-#define SETTINGSFILE "/settings.json"                       // SPIFFS file with some camera settings
+#define SETTINGSFILE "/settings.json"                       // SPIFFS file with the camera settings
+#define CAM_PARAM_UNSET -32768                              // Sensor parameter not set: keep the sensor default
 
 #define PART_BOUNDARY "123456789000000000000987654321"
 static const char* _STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
@@ -5,15 +5,25 @@
  * . Camera takes photo and uploads to server when triggered (either PIR or via MQTT)
  * - Temperature sensor (DS18B20) reports (outside) temperature via MQTT
  * - Runs web server to allow client to stream video
+ *   - "ws://<ip>/ws"             : WebSocket video stream (binary JPEG messages). The client sends "ack" for each frame
+ *                                  (or "credit:<n>"), and can send "fps:<n>" and "quality:<n>".
+ *   - "http://<ip>:81/metrics"   : device health in the Prometheus text format (frames, uploads and latency, MQTT,
+ *                                  reconnects, heap, RSSI). Own web server (METRICS_PORT), so also while a video stream runs.
  * 
  * 
  * MQTT Messages
+ * - Topics below use the default prefix "gate" (MQTT_TOPIC_PREFIX), see "prefix:<name>".
  * - Subscribed:
  *   - "gate/camera/cmnd" 
  *      -> "photo"                : Take and upload a photo
  *      -> "enable"               : Enable camera and allow PIR to trigger taking photos  (MQTT trigger still possible when disabled)
  *      -> "disable"              : Disable camera actions (PIR still enabled)
- *      -> "settings"             : Report current cam settings and status                           << NOT IMPLEMENTED
+ *      -> "settings"             : Report current cam settings and status (JSON)
+ *      -> "profile:<name>"       : Apply a named sensor profile (built-in: day, night)
+ *      -> "saveprofile:<name>"   : Save the current sensor parameters as a named profile
+ *      -> "dedup:<bits>"         : Skip photos within <bits> hash distance of the last upload (0=disabled)
+ *      -> "record[:<seconds>]"   : Record a clip to the SD card (default: ClipSeconds) (CLIP_RECORDER)
+ *      -> "clips"                : Report the clip recorder and the SD card write rate per frame size (CLIP_RECORDER)
  *   - "gate/camera/setsetting" 
  *      -> "<setting>:<value>"    : Update the camera settings with the provided value
  *   - "gate/motion/cmnd" 
@@ -23,28 +33,51 @@
  *   - "gate/temperature/cmnd" 
  *      -> "reading"              : Report the current temperature value
  *      -> "interval:<seconds>"   : Set the interval between temperature updates (default=30s) (0=disabled)
+ *   - "gate/timelapse/cmnd" 
+ *      -> "interval:<seconds>"   : Set the time-lapse capture interval (0=disabled)
+ *      -> "window:<HH:MM>-<HH:MM>" : Only capture within this local time window ("window:always" = all day)
+ *      -> "batch:<frames>"       : Number of time-lapse frames uploaded together
  *   - "gate/monitor/cmnd" 
  *      -> "restart"              : Trigger restart of ESP32
  *      -> "getstate"             : Report the current state and telemetry values (RSSI, Memory, ..)
  *      -> "getconfig"            : Report the current configuration
+ *      -> "getheap"              : Report the heap: free, largest block, fragmentation, allocations per subsystem
+ *      -> "profile"              : Report the tasks (stack, CPU use) and the time spent per loop section
  *      -> "interval:<seconds>"   : Set the interval between state updates (default=60s) (0=disabled)
  *      -> "ReportState:<value>"  : Enable/disable reporting full device state    (true/false)
  *      -> "Reportwifi:<value>"   : Enable/disable reporting wifi strength        (true/false)
+ *      -> "<Field>:<value>"      : Set any configuration field by its config name and unit, e.g. "DedupThreshold:6"
+ *      -> "ratelimit:<class>:<burst>:<per minute>" : Set a rate limit (motion/pirphoto/photo/telemetry/uplink)
+ *      -> "power:<mode>"         : Low-power mode: on (never sleep), light or deep (sleep when idle, wake on PIR)
+ *      -> "sleepidle:<seconds>"  : Idle time before sleeping in low-power mode (default=30s)
+ *      -> "format:<json|msgpack>" : Wire format of the state, config and camera settings reports (msgpack: short keys)
+ *      -> "wirebench"            : Compare JSON and MessagePack sizes and serialization times
+ *      -> "wirekeys"             : Report the MessagePack short key table
+ *      -> "prefix:<name>"        : Set the topic prefix of this device ("mac" = "cam-<MAC>"), all topics move
+ * 
+ *   - "gate/monitor/setconfig" 
+ *      -> "<JSON>"               : Set any subset of the configuration at once (as reported on gate/monitor/config), all or nothing
  * 
  * - Published:
- *   - "gate/motion/state"        -> "yes/no"                   : movement detected at gate
+ *   - "gate/motion/state"        -> "on/off"                   : movement detected at gate / movement stopped
+ *   - "gate/motion/session"      -> "<JSON>"                   : motion session start/stop (with duration and PIR pulses)
  *   - "gate/temperature/state"   -> "<value>"                  : current temperature value
- *   - "gate/camera/state"        -> "<photo/video settings>"   : photo/video uploaded, list of camera settings
+ *   - "gate/camera/state"        -> "<photo/video settings>"   : photo/video uploaded, camera settings and sensor status (JSON)
+ *                                -> "skipped:<distance>"       : photo not uploaded, near duplicate of the last upload
+ *   - "gate/camera/clip"         -> "<JSON>"                   : clip recorded, clip recorder report (CLIP_RECORDER)
  *   - "gate/monitor/config"      -> "<settings>"               : list of general settings
  *   - "gate/monitor/state"       -> "<parameters>"             : list of telemetry parameters
  *   - "gate/monitor/wifi"        -> "<value>"                  : current WiFi RSSI value           (DISABLED)
+ *   - "gate/monitor/heap"        -> "<JSON>"                   : heap regions and allocations per subsystem
+ *   - "gate/monitor/wire"        -> "<JSON>"                   : wire format benchmark, short key table
+ *   - "gate/monitor/profile"     -> "<JSON>"                   : tasks, loop section times, stall reports
+ *   - "gate/monitor/config/error" -> "<reason>"                : rejected "setconfig" document
  * 
  * Pins:
  * - PIR        -> GPIO 13     : Data wire
  * - DS18B20    -> GPIO 2      : Data wire
  * 
  * ToDo: 
- * - return camera settings as JSON in MQTT msg
  * - OTA (??)
  * 
  * Revision:     
@@ -53,6 +86,40 @@
  *    - MQTT_callback() : also save config to SPIFFS for PIR and Temperature setting changes.
  *    - MQTT_init()     : disconnect MQTT session before each reconnect, set clean session to false on connect.
  *    - reportState()   : changed WiFi % calculation to not exceed 100 
+ *   20261018.1
+ *    - NET_loop()      : non-blocking WiFi/MQTT connection state machine (WiFi events, jittered exponential backoff).
+ *    - reportState()   : report reconnect counts and downtime.
+ *    - mqttPublishJson() : stream JSON documents into the MQTT packet (no intermediate buffer, no truncation).
+ *    - cam_AutoQuality() : adjust JPEG quality towards a target photo size or upload time.
+ *    - img_CropRoi()     : upload only a region of interest (sensor window or decode/crop/encode).
+ *      The region and crop kernels are in ImageRoi.h, with a host test and benchmark in test/image_roi_test.cpp.
+ *    - img_Hash()        : skip uploading photos that are near duplicates of the last upload (average hash).
+ *      The hash kernels are in ImageHash.h, with a host test and benchmark in test/image_hash_test.cpp.
+ *    - http_UploadPhoto(): streamed multipart upload, JSON capture metadata + JPEG from the frame buffer.
+ *    - EVT_Push/EVT_Next : lock-free event rings (ISR/MQTT -> loop) replace the motion/photo flags, debounce moved to loop().
+ *      The ring is in EventRing.h, with a host test in test/event_ring_test.cpp.
+ *    - MOTION_Rise/Fall(): both PIR edges tracked, motion sessions reported "on"/"off", noisy PIR retriggers suppressed.
+ *    - RL_Take()         : token bucket rate limits per action class, motion events first.
+ *    - LAPSE_Check()     : scheduled time-lapse captures (interval, active window), batched uploads.
+ *    - cam_RestoreSensor(): all sensor parameters saved and restored, reported as JSON, day/night profiles.
+ *    - cam_init()        : fixed brightness being set to the contrast value.
+ *    - cam_GetFrame()    : fresh frame mode (photos exposed after the trigger), configurable grab mode and frame buffer location.
+ *    - PROFILE_Check()   : profiler (task stacks/CPU, loop sections timed by cycle counter probes), stall reports.
+ *    - NIGHT_GetFrame()  : night capture, scene luminance estimate, learned exposure/gain preloaded, flash synced with the photo frame.
+ *    - STREAM_Skip()     : idle-scene suppression, static scenes streamed at a keep-alive rate, bytes saved reported.
+ *    - WS_Handler()      : "/ws" WebSocket video stream, a binary message per frame, client credits (acks), fps and quality.
+ *    - CLIP_Task()       : motion clips as AVI (MJPEG) on the SD card (CLIP_RECORDER), "/clips" download, SD write rates.
+ *      The AVI writer is in AviWriter.h, with a host test in test/avi_writer_test.cpp.
+ *    - METRICS_Handler() : "/metrics" on its own web server (Prometheus text format), lock-free counters, no heap use.
+ *    - CONFIG_FIELDS     : one registry for the configuration and camera settings (defaults, ranges, load/save/report/set generated).
+ *    - CONFIG_Apply()    : "gate/monitor/setconfig", JSON with any subset of the configuration, validated, applied and saved as a whole.
+ *    - WIRE_Compact()    : MessagePack wire format with short keys for the state, config and camera settings reports, benchmark.
+ *      The key table is in WireFormat.h, with a host test and benchmark in test/wire_format_test.cpp.
+ *    - MQTT_BuildTopics(): per-device topic prefix and client ID (MAC), topic table, one wildcard subscription for the commands.
+ *    - HEAP_Report()     : heap accounting per subsystem (MQTT, JSON, HTTP, stream, camera), largest free block and fragmentation.
+ *      The accounting is in HeapAccount.h, with a host test in test/heap_account_test.cpp.
+ *    - PIPE_Start()      : photo pipeline, capture and upload tasks on separate cores with bounded queues, per stage telemetry.
+ *    - POWER_Check()     : low-power mode, light/deep sleep when idle, PIR (ext0) wakeup, fast resume from RTC memory.
  * 
  **************************************************************************/
 
@@ -63,50 +130,706 @@
 #include <OneWire.h>
 #include <DallasTemperature.h>
 #include <soc/rtc_cntl_reg.h>     // disable brownout problems
+#include <soc/gpio_reg.h>         // read PIR level in ISR
 #include <SPIFFS.h>
 #include <ArduinoJson.h>
 #include <rom/rtc.h>
 #include <esp_http_server.h>
 #include <esp_http_client.h>
 #include <fb_gfx.h>
+#include <img_converters.h>
+#include <esp_jpg_decode.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <esp_sleep.h>
+#include <driver/rtc_io.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <atomic>
 #include "configuration.h"
 #include "NetworkSettings.h"
+#include "EventRing.h"
+#include "ImageHash.h"
+#include "ImageRoi.h"
+#include "HeapAccount.h"
+#include "WireFormat.h"
+#include "AviWriter.h"
+#if CLIP_RECORDER
+#include <SD_MMC.h>
+#if pinOneWire == 2
+#error "The SD card uses GPIO 2 in 1-bit mode: move the One Wire bus (pinOneWire) to another pin"
+#endif
+#endif
 
 httpd_handle_t stream_httpd = NULL;
+httpd_handle_t metrics_httpd = NULL;                // "/metrics" (METRICS_PORT), not blocked by the video stream
 WiFiClient wifiClient;
 PubSubClient mqttClient(wifiClient);
+
+// MQTT topics, "<prefix>/<suffix>", built once at boot and after a prefix change (MQTT_BuildTopics).
+enum TopicId {
+  PUB_TEMP, PUB_MOTION, PUB_MOTIONSESSION, PUB_CAMERA, PUB_CONFIG, PUB_STATE, PUB_WIFI, PUB_HEAP, PUB_WIRE,
+  PUB_CONFIGERROR, PUB_CLIP, PUB_PROFILE,
+  SUB_CAMCOMMAND, SUB_CAMSETTING, SUB_MOTION, SUB_TEMP, SUB_TIMELAPSE, SUB_MONITOR, SUB_SETCONFIG,
+  TOPIC_COUNT
+};
+static const char * const topicSuffixes[TOPIC_COUNT] = {
+  MQTT_PUB_TEMP, MQTT_PUB_MOTION, MQTT_PUB_MOTIONSESSION, MQTT_PUB_CAMERA, MQTT_PUB_CONFIG, MQTT_PUB_STATE, MQTT_PUB_WIFI, MQTT_PUB_HEAP, MQTT_PUB_WIRE,
+  MQTT_PUB_CONFIGERROR, MQTT_PUB_CLIP, MQTT_PUB_PROFILE,
+  MQTT_SUB_CAMCOMMAND, MQTT_SUB_CAMSETTING, MQTT_SUB_MOTION, MQTT_SUB_TEMP, MQTT_SUB_TIMELAPSE, MQTT_SUB_MONITOR, MQTT_SUB_SETCONFIG
+};
+char topics[TOPIC_COUNT][MQTT_TOPIC_SIZE];
+char topicWildcard[MQTT_TOPIC_SIZE];                // "<prefix>/+/cmnd": all command topics, one subscription
+char mqttClientId[24];                              // MQTT_CLIENT_ID + "-<MAC>", unique per device
+// Report wire format (config.WireFormat) and the short key table (wireKeys) are in WireFormat.h.
+
 OneWire wireBus(pinOneWire);
 DallasTemperature sensorTemp(&wireBus);
 
-volatile long lastMovementDetected = 0;             // Used to debounce PIR
-volatile bool motionDetected = false;               // Set in ISR when PIR detected movement
-bool actionTakePhoto = false;                       // Set by MQTT when photo must be taken
+EventRing isrEvents = {};                           // Produced by the PIR ISR
+EventRing taskEvents = {};                          // Produced by the loop task (MQTT callback)
+int64_t motionEnabledAt = 0;                        // Ignore motion events from before the PIR was (re)enabled
+
+struct MotionTracker {
+  bool active;                                      // Motion session in progress (published "on", not yet "off")
+  bool published;                                   // Start of the current session was published (not rate limited)
+  bool pirHigh;                                     // PIR output level after the last edge
+  int64_t sessionStart;                             // esp_timer time the session started (us)
+  int64_t lastRise;                                 // Last PIR rising edge (us)
+  int64_t lastFall;                                 // Last PIR falling edge (us)
+  int64_t lastPhoto;                                // Last PIR triggered photo (us)
+  unsigned long sessionPulses;                      // PIR pulses in the current session
+  unsigned long sessions;                           // Motion sessions since boot
+  unsigned long pulses;                             // PIR pulses since boot
+  unsigned long suppressed;                         // PIR retriggers that did not take a photo (PIR_delay/noise)
+  float pulseRate;                                  // Running average of the PIR pulse rate (pulses/minute)
+  float pulseWidth;                                 // Running average of the PIR pulse width (ms)
+};
+MotionTracker motion = {};
+
+enum RateClass {                                    // In priority order (highest first)
+  RL_MOTION,                                        // Motion start/stop publishes
+  RL_PIR_PHOTO,                                     // PIR triggered photo uploads
+  RL_MANUAL_PHOTO,                                  // MQTT requested photo uploads
+  RL_TELEMETRY,                                     // State, WiFi and temperature reports
+  RL_CLASSES
+};
+
+struct TokenBucket {
+  const char* name;
+  float burst;                                      // Bucket size (most actions at once)
+  float perMinute;                                  // Refill rate (sustained actions per minute)
+  float tokens;
+  unsigned long refilled;                           // millis() of the last refill
+  unsigned long allowed;
+  unsigned long dropped;
+  unsigned long deferred;
+};
+TokenBucket buckets[RL_CLASSES] = {
+  { "motion",    RL_MOTION_BURST,    RL_MOTION_PER_MIN,    RL_MOTION_BURST,    0, 0, 0, 0 },
+  { "pirphoto",  RL_PIRPHOTO_BURST,  RL_PIRPHOTO_PER_MIN,  RL_PIRPHOTO_BURST,  0, 0, 0, 0 },
+  { "photo",     RL_PHOTO_BURST,     RL_PHOTO_PER_MIN,     RL_PHOTO_BURST,     0, 0, 0, 0 },
+  { "telemetry", RL_TELEMETRY_BURST, RL_TELEMETRY_PER_MIN, RL_TELEMETRY_BURST, 0, 0, 0, 0 }
+};
+TokenBucket uplink = { "uplink", RL_UPLINK_BURST, RL_UPLINK_PER_MIN, RL_UPLINK_BURST, 0, 0, 0, 0 };   // Shared by all classes
+int pendingPhotos = 0;                              // Rate limited MQTT photo requests, taken when tokens are available
+float lastTemperature = NAN;                        // Last valid temperature reading, sent with the upload
 bool reportStatus = false;                          // Report settings via MQTT
 bool requestTemperature = false;                    // Report temperature (once) when set (default: false)
+bool requestState = false;                          // Report state (once) when set, e.g. after a timer wakeup
+volatile int streamClients = 0;                     // Video stream connections (web server)
+std::atomic<bool> camPaused(false);                 // Camera being re-initialized: the streams take no frames (cam_Reinit)
+std::atomic<int> camStreamFrames(0);                // Stream frames taken and not yet returned (CAM_Enter/CAM_Leave)
 bool runWebServer = false;
+volatile bool wifiUp = false;                       // Set/cleared in WiFi event handler
+
+enum NetState {
+  NET_WIFI_DOWN,                                    // WiFi not connected, waiting for next attempt
+  NET_WIFI_CONNECTING,                              // WiFi.begin() issued, waiting for an IP address
+  NET_MQTT_DOWN,                                    // WiFi connected, waiting for next MQTT attempt
+  NET_ONLINE                                        // WiFi and MQTT connected
+};
 
+struct NetStatus {
+  NetState state;
+  unsigned long retryAt;                            // millis() of the next connection attempt
+  unsigned long attemptStart;                       // millis() when the current WiFi attempt started
+  int wifiFailures;                                 // consecutive failed WiFi attempts (backoff)
+  int mqttFailures;                                 // consecutive failed MQTT attempts (backoff)
+  bool everOnline;                                  // MQTT connected at least once since boot
+  unsigned long wifiReconnects;                     // WiFi reconnects since boot
+  unsigned long mqttReconnects;                     // MQTT reconnects since boot
+  unsigned long downSince;                          // millis() when connectivity was lost (0 = not down)
+  unsigned long lastDowntime;                       // duration of the last outage (ms)
+  unsigned long totalDowntime;                      // total outage time since boot (ms)
+};
+NetStatus net = { NET_WIFI_DOWN, 0, 0, 0, 0, false, 0, 0, 0, 0, 0 };
+unsigned long mqttPublishFailed = 0;                // Publishes that failed (not connected, write error)
+unsigned long mqttPublishOversize = 0;              // JSON payloads dropped/truncated for size (doc overflow, > MQTT_MAX_PAYLOAD)
+
+// Configuration registry: every Config field once, as X(type, name, default, min, max, flags).
+// The struct, defaults, load/save (CONFIGFILE), report (gate/monitor/config), "setconfig" and
+// "<name>:<value>" commands, and the JSON document capacity are all generated from it.
+// - type: BOOL, INT, or STR (char array, max = longest string)
+// - flags: CFG_PERSIST (saved), CFG_REPORT (reported), CFG_SET (settable over MQTT)
+#define CFG_PERSIST   0x01
+#define CFG_REPORT    0x02
+#define CFG_SET       0x04
+#define CFG_ALL       (CFG_PERSIST | CFG_REPORT | CFG_SET)
+
+#define CONFIG_FIELDS(X) \
+  X(BOOL, PIR_enabled,    true,              0, 1,              CFG_ALL)  /* Enable/disable motion detection */ \
+  X(INT,  PIR_delay,      20000,             0, 3600000,        CFG_ALL)  /* Time to ignore PIR retriggers (ms) */ \
+  X(INT,  TempInterval,   60000,             0, 86400000,       CFG_ALL)  /* Interval between Temperature feedback (ms) (0 = disabled) */ \
+  X(BOOL, CAM_enabled,    true,              0, 1,              CFG_ALL)  /* Enable/disable photo capture remotely */ \
+  X(BOOL, ReportState,    true,              0, 1,              CFG_ALL)  /* Enable/disable report device state (MQTT) */ \
+  X(BOOL, ReportWiFi,     false,             0, 1,              CFG_ALL)  /* Enable/disable report WiFi (MQTT) */ \
+  X(INT,  StateInterval,  60000,             0, 86400000,       CFG_ALL)  /* Interval between State feedback (ms) (0 = disabled) */ \
+  X(INT,  DedupThreshold, 0,                 0, 64,             CFG_ALL)  /* Skip photo upload if hash distance to last upload is below this (0 = disabled) */ \
+  X(INT,  PowerMode,      POWER_ON,          POWER_ON, POWER_DEEP, CFG_ALL)  /* POWER_ON, POWER_LIGHT or POWER_DEEP (sleep when idle) */ \
+  X(INT,  SleepIdle,      POWER_SLEEP_IDLE,  5000, 86400000,    CFG_ALL)  /* Idle time (ms) before sleeping in low-power mode */ \
+  X(INT,  LapseInterval,  0,                 0, 86400,          CFG_ALL)  /* Time-lapse capture interval (s) (0 = disabled) */ \
+  X(INT,  LapseStart,     0,                 0, 1439,           CFG_ALL)  /* Time-lapse active window start, minutes after midnight (local time) */ \
+  X(INT,  LapseEnd,       0,                 0, 1439,           CFG_ALL)  /* Time-lapse active window end (start = end: always active) */ \
+  X(INT,  LapseBatch,     1,                 1, LAPSE_MAX_BATCH, CFG_ALL) /* Time-lapse frames per upload */ \
+  X(STR,  TopicPrefix,    MQTT_TOPIC_PREFIX, 0, 23,             CFG_ALL)  /* MQTT topic prefix ("" = "cam-<MAC>") */ \
+  X(INT,  WireFormat,     WIRE_JSON,         WIRE_JSON, WIRE_MSGPACK, CFG_ALL)  /* WIRE_JSON or WIRE_MSGPACK (state, config and camera settings reports) */ \
+  X(INT,  ClipSeconds,    10,                0, CLIP_MAX_SECONDS, CFG_ALL) /* Clip length after a PIR trigger (s) (0 = no clips, CLIP_RECORDER) */ \
+  X(INT,  ClipFps,        10,                1, 25,             CFG_ALL)  /* Clip frame rate (CLIP_RECORDER) */ \
+  X(BOOL, StreamIdle,     true,              0, 1,              CFG_ALL)  /* Static scene: stream at keep-alive rate (STREAM_KEEPALIVE) */ \
+  X(INT,  StallThreshold, PROFILE_STALL_MS,  0, 600000,         CFG_ALL)  /* Stall report when a loop section or photo job takes longer (ms) (0 = disabled) */
+
+#define CFG_FIELD_BOOL(name, max)   bool name;
+#define CFG_FIELD_INT(name, max)    int name;
+#define CFG_FIELD_STR(name, max)    char name[(max) + 1];
+#define CFG_FIELD(type, name, def, min, max, flags)     CFG_FIELD_##type(name, max)
 struct Config {
-  bool PIR_enabled;                                 // Enable/disable photo capture remotely (default: true)
-  int PIR_delay;                                    // time to ignore PIR movement interrupts (MQTT)
-  int TempInterval;                                 // Interval between Temperature feedback (0 = disabled)
-  bool CAM_enabled;                                 // Enable/disable photo capture remotely (default: true)
-  bool ReportState;                                 // Enable/disable report device state (MQTT)
-  bool ReportWiFi;                                  // Enable/disable report WiFi (MQTT)
-  int StateInterval;                                // Interval between State feedback (0 = disabled) 
+  CONFIG_FIELDS(CFG_FIELD)
 };
 Config config;
 
+// Sensor parameters kept in the settings (sensor_t status), in the order they are restored:
+// automatic modes before the manual values they override. X(id, setting name as used in "gate/camera/setsetting")
+#define CAM_PARAMS(X) \
+  X(CP_AEC, "aec") X(CP_AEC2, "aec2") X(CP_AE_LEVEL, "ae_level") X(CP_AGC, "agc") X(CP_GAINCEILING, "gainceiling") \
+  X(CP_AWB, "awb") X(CP_AWB_GAIN, "awb_gain") X(CP_WB_MODE, "wb_mode") X(CP_AEC_VALUE, "aec_value") \
+  X(CP_AGC_GAIN, "agc_gain") X(CP_BRIGHTNESS, "brightness") X(CP_CONTRAST, "contrast") X(CP_SATURATION, "saturation") \
+  X(CP_SHARPNESS, "sharpness") X(CP_DENOISE, "denoise") X(CP_SPECIAL_EFFECT, "special_effect") X(CP_BPC, "bpc") \
+  X(CP_WPC, "wpc") X(CP_RAW_GMA, "raw_gma") X(CP_LENC, "lenc") X(CP_HMIRROR, "hmirror") X(CP_VFLIP, "vflip") \
+  X(CP_DCW, "dcw") X(CP_COLORBAR, "colorbar")
+
+#define CP_ENUM(id, name)   id,
+#define CP_NAME(id, name)   name,
+enum CamParam {
+  CAM_PARAMS(CP_ENUM)
+  CP_COUNT
+};
+static const char * const camParamNames[CP_COUNT] = { CAM_PARAMS(CP_NAME) };
+
+// Camera settings registry: the int settings besides the sensor parameters, as X(field, name, default, min, max).
+// The names are the keys in SETTINGSFILE, the camera settings report and the "setsetting" commands.
+#define SETTINGS_FIELDS(X) \
+  X(framesize,  "framesize",   FRAMESIZE_VGA, 0, FRAMESIZE_INVALID - 1)  /* frame size (default: VGA(640x480)) */ \
+  X(quality,    "quality",     10,   0, 63)           /* JPEG quality (10 > 63, lower is better) */ \
+  X(grabMode,   "grab_mode",   0,    0, 1)            /* Driver grab mode: 0 = when empty (buffered frames), 1 = latest */ \
+  X(fbLocation, "fb_location", 0,    0, 1)            /* Frame buffers in: 0 = PSRAM, 1 = DRAM (1 buffer, max SVGA) */ \
+  X(freshFrame, "fresh",       1,    0, 1)            /* Photos only use frames exposed after the trigger (0/1) */ \
+  X(targetSize, "target_size", 0,    0, 1000000)      /* Auto quality: target photo size in bytes (0 = disabled) */ \
+  X(targetTime, "target_time", 0,    0, 60000)        /* Auto quality: target upload time in ms, used when targetSize is 0 (0 = disabled) */ \
+  X(roiMode,    "roi_mode",    0,    0, 2)            /* Region of interest: 0 = off, 1 = crop photos (decode/crop/encode), 2 = sensor window */ \
+  X(roiX,       "roi_x",       0,    0, 99)           /* ROI left edge, % of frame width */ \
+  X(roiY,       "roi_y",       0,    0, 99)           /* ROI top edge, % of frame height */ \
+  X(roiW,       "roi_w",       100,  1, 100)          /* ROI width, % of frame width */ \
+  X(roiH,       "roi_h",       100,  1, 100)          /* ROI height, % of frame height */ \
+  X(roiScale,   "roi_scale",   0,    0, 3)            /* ROI downscale: 0 = none, 1 = 1/2, 2 = 1/4, 3 = 1/8 */ \
+  X(night,      "night",       0,    0, 2)            /* Night capture (flash, preloaded exposure): 0 = off, 1 = dark scenes, 2 = always */
+
+#define SET_FIELD(field, name, def, min, max)   int field;
 struct Settings {
   bool isValid;                                     // Only use camera settings if flag is set, during successful SPIFFS read
-  int framesize;
-  int quality;
-  int brightness;
-  int contrast;
-  int hmirror;
-  int vflip;
+  int16_t sensor[CP_COUNT];                         // Sensor parameters (CAM_PARAM_UNSET = sensor default)
+  char profile[16];                                 // Last applied profile (e.g. "day", "night")
+  SETTINGS_FIELDS(SET_FIELD)
 };
 Settings camSettings;
 
+// JSON document capacities, from the registries. Keys and strings count as well: they are copied when
+// a document is read from a file or MQTT.
+#define CFG_COUNT(type, name, def, min, max, flags)     + 1
+#define CFG_STRINGS_BOOL(max)   0
+#define CFG_STRINGS_INT(max)    0
+#define CFG_STRINGS_STR(max)    ((max) + 1)
+#define CFG_STRINGS(type, name, def, min, max, flags)   + sizeof(#name) + CFG_STRINGS_##type(max)
+#define SET_COUNT(field, name, def, min, max)           + 1
+#define SET_STRINGS(field, name, def, min, max)         + sizeof(name)
+#define CP_STRINGS(id, name)                            + sizeof(name)
+static constexpr size_t CONFIG_JSON_CAPACITY =
+  JSON_OBJECT_SIZE(0 CONFIG_FIELDS(CFG_COUNT) + 1) + 0 CONFIG_FIELDS(CFG_STRINGS) + sizeof("ClientId") + sizeof(mqttClientId);
+static constexpr size_t CAM_PROFILE_JSON_CAPACITY =
+  JSON_OBJECT_SIZE(CP_COUNT) + 0 CAM_PARAMS(CP_STRINGS);
+static constexpr size_t CAM_PROFILE_PATH_LEN = 32;   // SPIFFS object name limit (CONFIG_SPIFFS_OBJ_NAME_LEN), incl. the 0
+static constexpr size_t SETTINGS_JSON_CAPACITY =
+  JSON_OBJECT_SIZE(0 SETTINGS_FIELDS(SET_COUNT) + CP_COUNT + 2) + 0 SETTINGS_FIELDS(SET_STRINGS) + 0 CAM_PARAMS(CP_STRINGS) +
+  sizeof("profile") + sizeof(camSettings.profile) + sizeof("sensor");
+
+enum PowerMode {
+  POWER_ON,                                         // Always on (default)
+  POWER_LIGHT,                                      // Light sleep when idle, wake on PIR or timer
+  POWER_DEEP                                        // Deep sleep when idle, wake on PIR or timer (restarts at setup)
+};
+
+// Kept in RTC memory: survives deep sleep (not a reset or power loss), so a
+// wakeup can reconnect and take a photo without reading SPIFFS or scanning WiFi.
+struct RtcState {
+  uint32_t magic;                                   // RTC_MAGIC when config/camSettings below are valid
+  Config config;
+  Settings camSettings;
+  uint8_t bssid[6];                                 // Last access point, for fast WiFi reconnect (no scan)
+  int32_t channel;                                  // WiFi channel of bssid (0 = unknown)
+  uint32_t boots;                                   // Starts since power on, including deep sleep wakeups
+  uint32_t wakeups;                                 // PIR wakeups
+  unsigned long sessions;                           // Motion counters (see MotionTracker)
+  unsigned long pulses;
+  uint64_t lastHash;                                // Dedup reference hash (see PhotoHash)
+  bool hashValid;
+  int64_t sleepStart;                               // gettimeofday() (us) when deep sleep started
+  time_t lapseNext;                                 // Next time-lapse capture (time(NULL), see LAPSE_Check)
+  uint64_t awakeUs;                                 // Time spent awake, in light sleep and in deep sleep
+  uint64_t lightUs;
+  uint64_t deepUs;
+  uint32_t wakePhotos;                              // Photos taken after a PIR wakeup
+  uint32_t wakePhotoLast;                           // Wake-to-photo latency (ms): PIR wakeup until the photo is uploaded
+  uint32_t wakePhotoMax;
+  uint64_t wakePhotoSum;
+  int16_t nightAec;                                 // Learned night exposure and gain (see NightCapture)
+  int16_t nightGain;
+};
+RTC_DATA_ATTR RtcState rtcState;
+
+struct PowerControl {
+  int64_t awakeSince;                               // esp_timer time the current awake period started
+  int64_t wakeAt;                                   // esp_timer time of the last PIR wakeup (-1 = no wakeup photo pending)
+  unsigned long lastActivity;                       // millis() of the last event, MQTT message or wakeup
+};
+PowerControl power = { 0, -1, 0 };
+
+struct LapseBatch {
+  uint8_t * buffer;                                 // Frames waiting for upload (PSRAM), allocated on first use
+  size_t used;                                      // Bytes of the buffer in use
+  int count;                                        // Frames in the batch
+  size_t offset[LAPSE_MAX_BATCH];                   // Position of each frame in the buffer
+  size_t len[LAPSE_MAX_BATCH];
+  time_t taken[LAPSE_MAX_BATCH];                    // Capture time of each frame
+  bool uploading;                                   // Handed to the upload stage, back in photo_Results
+};
+
+struct TimeLapse {
+  LapseBatch batches[2];                            // Filled in turn: one can upload while the next fills
+  int filling;                                      // Batch the captures go to
+  bool deferred;                                    // Capture due, but the camera is busy (motion/stream)
+  unsigned long captured;                           // Frames captured
+  unsigned long uploads;                            // Batches uploaded
+  unsigned long deferrals;                          // Captures deferred (camera busy)
+  unsigned long skipped;                            // Captures skipped (busy for too long)
+  unsigned long failed;                             // Frames lost (capture or upload failure)
+};
+TimeLapse lapse = {};
+
+struct FreshFrames {
+  int64_t framePeriod;                              // Measured time between frames (us), upper bound of the exposure time
+  unsigned long frames;                             // Photos taken in fresh frame mode
+  unsigned long drained;                            // Stale frames (exposed before the trigger) discarded
+  long lastUs;                                      // Trigger to exposure start of the last photo (us)
+  long maxUs;
+  int64_t sumUs;
+};
+FreshFrames freshStats = { CAM_FRAME_PERIOD, 0, 0, 0, 0, 0 };
+
+// Trigger to usable frame: trigger until the photo is out of the camera (all photos / night photos).
+struct UsableLatency {
+  unsigned long photos;
+  long lastUs;
+  long maxUs;
+  int64_t sumUs;
+};
+UsableLatency usableStats = {};
+
+// Night capture (camera setting "night"): the exposure and gain of flash photos are learned from
+// the photo luminance, so the first frame exposed with the flash is usable.
+struct NightCapture {
+  int aecValue;                                     // Preloaded exposure (aec_value) and gain (agc_gain)
+  int agcGain;
+  uint8_t sceneLuma;                                // Estimated scene luminance at the last trigger (running exposure)
+  uint8_t photoLuma;                                // Luminance of the last night photo
+  unsigned long photos;                             // Night (flash) photos
+  unsigned long frames;                             // Frames taken for night photos, including the estimate
+  UsableLatency usable;
+};
+NightCapture night = { NIGHT_AEC_VALUE, NIGHT_AGC_GAIN, 0, 0, 0, 0, {} };
+
+struct QualityControl {
+  float sizeQ;                                      // Running estimate of (photo size * quality), i.e. size ~ sizeQ/quality
+  int64_t changedAt;                                // esp_timer time of the last quality change (older frames used the old quality)
+  unsigned long lastSave;                           // millis() when the learned quality was last saved
+  bool unsaved;                                     // Learned quality not yet saved to SPIFFS
+  float uploadRate;                                 // Running estimate of upload throughput (bytes/s)
+  size_t lastSize;                                  // Size of the last photo (bytes)
+};
+QualityControl qualityCtl = { 0, 0, 0, false, 0, 0 };
+
+struct RoiStats {
+  unsigned long photos;                             // Photos cropped in software
+  unsigned long failures;                           // Crops that failed (full frame uploaded instead)
+  unsigned long lastMs;                             // Decode/crop/encode time of the last photo (ms)
+  unsigned long maxMs;                              // Slowest decode/crop/encode (ms)
+  size_t lastIn;                                    // Size of the last full frame (bytes)
+  size_t lastOut;                                   // Size of the last cropped photo (bytes)
+};
+RoiStats roiStats = { 0, 0, 0, 0, 0, 0 };
+
+struct ImgDecode {
+  const camera_fb_t * fb;                           // JPEG frame being decoded
+  ImgRect roi;                                      // Region of interest in decoded (scaled) pixels
+  uint8_t * rgb;                                    // ROI pixels (RGB888, w*h*3)
+  ImgCellGrid grid;                                 // Hash: luminance per cell of the 8x8 grid
+};
+
+struct PhotoHash {
+  uint64_t lastUploaded;                            // Average hash of the last uploaded photo
+  bool valid;                                       // lastUploaded is set
+  unsigned long uploadedAt;                         // millis() of the last uploaded photo
+  int lastDistance;                                 // Hamming distance of the last photo to the last upload
+  unsigned long skipped;                            // Photos not uploaded (near duplicates)
+  unsigned long lastUs;                             // Time to hash the last photo (us)
+  unsigned long maxUs;                              // Slowest hash (us)
+};
+PhotoHash photoHash = { 0, false, 0, -1, 0, 0, 0 };
+static const esp_err_t PHOTO_DUPLICATE = 0x7001;    // photo_Send(): not uploaded, (nearly) same as the previous upload
+static const esp_err_t PHOTO_SPOOLED = 0x7002;      // Capture stage: taken offline, copied for the spool (photoSpool)
+
+// Photo pipeline: loop -> capture task -> upload task -> loop, connected by bounded queues.
+// Upload stage in/out: the dedup reference it compares with (set by the loop), and what the
+// stage measured. photo_Results applies the results to photoHash, qualityCtl and roiStats,
+// so those are only written by the loop.
+struct PhotoUpload {
+  uint64_t reference;                               // Average hash of the last upload, when referenceValid
+  bool referenceValid;
+  bool hashed;                                      // hash is set (dedup enabled and the photo decoded)
+  uint64_t hash;
+  unsigned long hashUs;                             // Time to hash the photo (us)
+  float rate;                                       // Upload throughput (bytes/s), 0 = not uploaded
+  int8_t roi;                                       // Software crop: 0 = not done, 1 = cropped, -1 = failed
+  unsigned long roiMs;                              // Decode/crop/encode time (ms)
+  size_t roiIn, roiOut;                             // Full frame and cropped photo size (bytes)
+};
+
+struct PhotoJob {
+  const char * trigger;                             // "pir" / "mqtt" (string literal)
+  int64_t triggerTime;                              // esp_timer time of the trigger (us)
+  camera_fb_t * fb;                                 // Frame, from the capture to the upload stage
+  esp_err_t result;                                 // Outcome, reported back to the loop
+  int distance;                                     // Hash distance to the last upload (dedup)
+  size_t photoLen;                                  // Photo size and capture time, for the auto quality (0 = no photo)
+  int64_t frameTime;
+  bool spooled;                                     // Taken offline: fb is a copy (SPOOL_Copy), not a driver frame
+  LapseBatch * batch;                               // Time-lapse batch to upload instead of a photo (fb NULL)
+  PhotoUpload upload;
+};
+
+// Offline spool: photos taken while the network is down wait here (loop only) and are
+// uploaded when it is back (SPOOL_Drain). The copies are in PSRAM, frame buffers are scarce.
+struct PhotoSpool {
+  PhotoJob jobs[PIPE_SPOOL_PHOTOS];                 // Oldest first
+  int count;
+  unsigned long spooled;                            // Photos taken offline and kept
+  unsigned long dropped;                            // Photos lost offline: spool full, no PSRAM or failed again
+};
+PhotoSpool photoSpool = {};
+
+// The stage counters are updated by the stage's task(s) and read by the loop: atomic (PIPE_Done, PIPE_Send).
+struct PipeStage {
+  const char * name;
+  QueueHandle_t queue;                              // Jobs waiting for this stage (NULL: no queue)
+  unsigned long jobs;                               // Jobs done
+  unsigned long dropped;                            // Jobs dropped, next stage full for too long
+  int64_t busyUs;                                   // Time spent working on jobs
+  long maxUs;                                       // Slowest job
+  UBaseType_t queueMax;                             // Most jobs waiting at once
+  unsigned long reportJobs;                         // jobs and busyUs at the last report, for rates over the report interval
+  int64_t reportBusyUs;
+  int64_t busySince;                                // esp_timer time the current job started (0 = idle), capture/upload only
+  TaskHandle_t task;
+};
+PipeStage pipeCapture = { "capture" };              // Camera frames for photos (PIPE_CAPTURE_CORE)
+PipeStage pipeUpload = { "upload" };                // Dedup, ROI crop/encode and upload (PIPE_UPLOAD_CORE)
+PipeStage pipeStream = { "stream" };                // Video stream frames (web server task, PIPE_UPLOAD_CORE)
+QueueHandle_t pipeResults = NULL;                   // Finished jobs, back to the loop (for MQTT)
+int pipeInFlight = 0;                               // Photos requested and not yet reported back (loop only)
+int64_t pipeReportedAt = 0;                         // esp_timer time of the last pipeline report
+
+// Profiler: time per loop() section from the CPU cycle counter (PROF_End), reported with "profile"
+// together with the task stacks (and CPU use, if the FreeRTOS run time stats are enabled).
+enum ProfSection { PS_EVENTS, PS_PHOTOS, PS_TEMPERATURE, PS_STATE, PS_LAPSE, PS_POWER, PS_NET, PS_MQTT, PS_COUNT };
+struct ProfStats {
+  const char * name;
+  bool stallCheck;                                  // false: the section may sleep (light sleep in POWER_Check)
+  unsigned long count;
+  uint32_t lastUs;
+  uint32_t maxUs;
+  uint64_t sumUs;
+  unsigned long stalls;                             // Times over the stall threshold
+};
+ProfStats profSections[PS_COUNT] = {
+  { "events", true }, { "photos", true }, { "temperature", true }, { "state", true },
+  { "timelapse", true }, { "power", false }, { "net", true }, { "mqtt", true }
+};
+struct Profiler {
+  uint32_t startCycles;                             // Cycle counter at the start of the current section
+  unsigned long startMs;                            // millis() at the start (the cycle counter wraps after ~18s at 240MHz)
+  int stalled;                                      // Section over the stall threshold, reported by PROFILE_Check (-1 = none)
+  uint32_t stallUs;
+  int64_t pipeStalled[2];                           // busySince of the capture/upload job last reported as stalled
+  unsigned long stallReports;
+  int64_t reportedAt;                               // esp_timer time of the last profile, for the task CPU use
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+  uint32_t runTimeTotal;                            // Run time counters at the last profile
+  UBaseType_t taskNumber[PROFILE_MAX_TASKS];
+  uint32_t runTime[PROFILE_MAX_TASKS];
+  int tasks;
+#endif
+};
+Profiler profiler = { 0, 0, -1 };
+
+// Heap accounting per subsystem, reported with "getheap".
+// - Tagged allocations (HEAP_Alloc/HEAP_Free, JSON documents) are counted exactly.
+// - Allocations inside libraries (Strings, esp_http_client, ..) are measured as the free heap
+//   lost over a scope (HEAP_Begin/HEAP_End). Other tasks add noise, but a total that keeps
+//   growing points at the leaking subsystem.
+// - Tags, counters and the block header are in HeapAccount.h.
+HeapAccount heapAccounts[HEAP_TAGS] = { {"mqtt"}, {"json"}, {"http"}, {"stream"}, {"camera"} };
+// HEAP_Report: internal and PSRAM region (5 values each), and the 7 values per subsystem. Keys are not copied.
+static constexpr size_t HEAP_JSON_CAPACITY =
+  JSON_OBJECT_SIZE(3) + 2 * JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(HEAP_TAGS) + HEAP_TAGS * JSON_OBJECT_SIZE(7);
+
+// Counters for "/metrics" (Prometheus text format on the web server). Updated lock-free
+// (METRIC_Add) from any task; read by the web server task when scraped.
+enum FrameSource { FRAME_PHOTO, FRAME_STREAM, FRAME_LAPSE, FRAME_CLIP, FRAME_SOURCES };
+const char * frameSourceNames[FRAME_SOURCES] = { "photo", "stream", "timelapse", "clip" };
+const uint32_t uploadBucketsMs[] = { METRICS_UPLOAD_BUCKETS };
+#define UPLOAD_BUCKETS (sizeof(uploadBucketsMs) / sizeof(uploadBucketsMs[0]))
+struct Metrics {
+  uint32_t frames[FRAME_SOURCES];                   // Frames captured (and used) per source
+  uint32_t streamFrames;                            // Frames sent to stream clients
+  uint64_t streamBytes;                             // Bytes sent to stream clients
+  uint32_t streamSavedFrames;                       // Frames not sent, scene unchanged (StreamIdle)
+  uint64_t streamSavedBytes;
+  uint64_t uploadBytes;                             // Bytes uploaded (successful POSTs)
+  uint32_t uploads;                                 // Successful uploads
+  uint32_t uploadFailures;                          // Failed uploads (connect, write or HTTP status)
+  uint32_t uploadBuckets[UPLOAD_BUCKETS + 1];       // Successful uploads per latency bucket (last: +Inf)
+  uint64_t uploadMsSum;                             // Total latency of the successful uploads (ms)
+  uint32_t mqttIn;                                  // MQTT messages received
+  uint32_t mqttOut;                                 // MQTT messages published
+  uint32_t scrapes;                                 // "/metrics" requests served
+};
+Metrics metrics = {};
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+// WebSocket video stream ("/ws"): frames only go to clients with credits (acks), see WS_Handler.
+// Clients are changed by the web server task only (handler and WS_SendWork), WS_Task only reads them.
+struct WsClient {
+  int fd;                                           // Socket (-1: free slot)
+  int credits;                                      // Frames the client may still receive
+  int fps;                                          // Frame rate asked by the client
+  int64_t nextFrame;                                // esp_timer time the next frame is due
+  int inFlight;                                     // Frames sent and not acked yet (credits + inFlight <= WS_MAX_CREDITS)
+  int64_t sentAt[WS_MAX_CREDITS];                   // Send times of the frames in flight (ring, oldest at sentHead)
+  int sentHead;
+  uint32_t frames;
+  uint32_t acks;
+  int64_t ackUsLast;                                // Send to ack time of the frames (us)
+  int64_t ackUsMax;
+  int64_t ackUsSum;
+};
+WsClient wsClients[WS_MAX_CLIENTS];
+volatile int wsClientCount = 0;
+volatile int wsQuality = -1;                        // JPEG quality set by a client (-1: photo quality, see cam_SetQuality)
+camera_fb_t * wsFrame = NULL;                       // Frame being sent (WS_Task -> WS_SendWork)
+QueueHandle_t wsDone = NULL;                        // WS_SendWork finished with wsFrame
+TaskHandle_t wsTask = NULL;
+#endif
+
+// Idle-scene suppression: one per stream (multipart and WebSocket), see STREAM_Skip.
+struct StreamIdle {
+  bool idle;                                        // Scene static: keep-alive frames only
+  bool valid;                                       // Reference set
+  bool cellsValid;                                  // refCells set (not decoded when the size already showed a change)
+  size_t refLen;                                    // JPEG size of the last frame sent
+  uint8_t refCells[64];                             // Luminance signature of the last frame sent (img_Cells)
+  int64_t changedAt;                                // esp_timer time of the last scene change
+  int64_t sentAt;                                   // esp_timer time of the last frame sent
+};
+std::atomic<int> streamsIdle(0);                    // Streams at the keep-alive rate now (one per stream task)
+unsigned long streamCheckUs = 0;                    // Time of the last scene check (us)
+uint64_t streamSavedReported = 0;                   // metrics.streamSavedBytes at the last state report
+
+// Sensor JPEG quality (cam_SetQuality): one sensor for photos, clips and streams.
+SemaphoreHandle_t qualityLock = NULL;               // Sensor quality writes, from the loop, capture, clip and web server tasks
+int qualityHolds = 0;                               // Photos/clips being captured: photo quality, whatever a stream asked for
+int sensorQuality = -1;                             // Quality the sensor is set to (-1: unknown, after cam_init)
+
+// Clip recorder (CLIP_RECORDER): AVI clips of motion on the SD card.
+// - Frames are appended as they come (never a seek back), the index is kept in a preallocated
+//   array and appended at the end. The clip is recorded as "clipNNNN.tmp": after it is closed
+//   the header is patched once and the file renamed to "clipNNNN.avi".
+volatile bool clipRecording = false;                // Recording (or about to), keeps the device awake
+#if CLIP_RECORDER
+struct ClipInfo : AviStream {                       // Size, frames, duration (AviWriter.h)
+  char name[16];                                    // "clip0001.avi"
+  framesize_t framesize;
+  uint32_t bytes;                                   // File size
+};
+struct ClipWriteStats {                             // SD card write rate, per frame size
+  uint16_t width;
+  uint16_t height;
+  uint32_t frames;
+  uint64_t bytes;
+  uint64_t writeUs;                                 // Time spent writing frames (excludes the camera)
+  uint32_t slowestUs;
+};
+struct ClipRecorder {
+  bool mounted;                                     // SD card mounted, recorder task running
+  TaskHandle_t task;
+  QueueHandle_t results;                            // Finished clips, back to the loop (for MQTT)
+  volatile uint32_t until;                          // millis() when recording stops (extended while motion continues)
+  int oldest;                                       // Clip numbers on the card (oldest > newest: none)
+  int newest;
+  File file;
+  ClipInfo current;
+  uint32_t * index;                                 // idx1 entries (offset, size) of the current clip, CLIP_MAX_FRAMES
+  uint32_t moviSize;                                // Bytes in the movi list after its 'movi' id
+  unsigned long recorded;
+  unsigned long failed;
+};
+ClipRecorder clip = {};
+ClipWriteStats clipStats[FRAMESIZE_INVALID] = {};
+#endif
+
+/**************************************************************************
+ * HEAP_Track
+ * - Account bytes allocated (>0) or freed (<0) by a subsystem. Safe to
+ *   call from any task.
+ **************************************************************************/
+void HEAP_Track(HeapTag tag, int32_t bytes) {
+  if (bytes >= 0) {
+    HEAP_Allocated(&heapAccounts[tag], bytes);
+  } else {
+    HEAP_Freed(&heapAccounts[tag], -bytes);
+  }
+}
+
+/**************************************************************************
+ * HEAP_Alloc
+ * - Allocate memory (heap_caps_malloc caps) accounted to a subsystem.
+ *   Free with HEAP_Free.
+ **************************************************************************/
+void * HEAP_Alloc(HeapTag tag, size_t size, uint32_t caps) {
+  void * block = heap_caps_malloc(sizeof(HeapBlock) + size, caps);
+
+  if (!block) {
+    __atomic_add_fetch(&heapAccounts[tag].failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return HEAP_Tag(heapAccounts, block, tag, size);
+}
+
+/**************************************************************************
+ * HEAP_Free
+ * - Free memory allocated with HEAP_Alloc.
+ **************************************************************************/
+void HEAP_Free(void * ptr) {
+  if (!ptr) {
+    return;
+  }
+  heap_caps_free(HEAP_Untag(heapAccounts, ptr));
+}
+
+/**************************************************************************
+ * HEAP_Realloc
+ * - Resize memory allocated with HEAP_Alloc (default caps).
+ **************************************************************************/
+void * HEAP_Realloc(HeapTag tag, void * ptr, size_t size) {
+  void * resized = HEAP_Alloc(tag, size, MALLOC_CAP_DEFAULT);
+
+  if (resized && ptr) {
+    memcpy(resized, ptr, min((size_t)((HeapBlock *)ptr - 1)->size, size));
+    HEAP_Free(ptr);
+  }
+  return resized;
+}
+
+/**************************************************************************
+ * HEAP_Begin / HEAP_End
+ * - Measure the internal heap lost by a subsystem over a scope, for
+ *   allocations that can't be tagged.
+ **************************************************************************/
+size_t HEAP_Begin() {
+  return heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+}
+
+void HEAP_End(HeapTag tag, size_t before) {
+  int32_t lost = (int32_t)(before - heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+
+  __atomic_add_fetch(&heapAccounts[tag].retained, lost, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&heapAccounts[tag].scopes, 1, __ATOMIC_RELAXED);
+}
+
+// Dynamic JSON documents, allocated through the heap accounting.
+struct HeapJsonAllocator {
+  void * allocate(size_t size) { return HEAP_Alloc(HEAP_JSON, size, MALLOC_CAP_DEFAULT); }
+  void deallocate(void * ptr) { HEAP_Free(ptr); }
+  void * reallocate(void * ptr, size_t size) { return HEAP_Realloc(HEAP_JSON, ptr, size); }
+};
+typedef BasicJsonDocument<HeapJsonAllocator> HeapJsonDocument;
+
+/**************************************************************************
+ * METRIC_Add / METRIC_Get
+ * - Lock-free metrics counters, safe to use from any task.
+ **************************************************************************/
+inline void METRIC_Add(uint32_t& counter, uint32_t value = 1) {
+  __atomic_add_fetch(&counter, value, __ATOMIC_RELAXED);
+}
+
+inline void METRIC_Add(uint64_t& counter, uint64_t value) {
+  __atomic_add_fetch(&counter, value, __ATOMIC_RELAXED);
+}
+
+template<class T> inline T METRIC_Get(const T& counter) {
+  return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+/**************************************************************************
+ * METRIC_Upload
+ * - Count an upload: failure, or success with its size and latency.
+ **************************************************************************/
+void METRIC_Upload(bool ok, size_t bytes, uint32_t ms) {
+  if (!ok) {
+    METRIC_Add(metrics.uploadFailures);
+    return;
+  }
+  int bucket = 0;
+  while (bucket < UPLOAD_BUCKETS && ms > uploadBucketsMs[bucket]) {
+    bucket++;
+  }
+  METRIC_Add(metrics.uploadBuckets[bucket]);
+  METRIC_Add(metrics.uploadMsSum, ms);
+  METRIC_Add(metrics.uploadBytes, bytes);
+  METRIC_Add(metrics.uploads);
+}
+
 /**************************************************************************
  * BlinkLED
  * - blink the onboard LED.
@@ -123,6 +846,182 @@ void BlinkLED (int LoopCnt) {
   }
 }
 
+/**************************************************************************
+ * EVT_Next
+ * - Get and remove the next event, the oldest of both rings (consumer side).
+ **************************************************************************/
+static bool EVT_Next(AppEvent * event) {
+  AppEvent isrEvent, taskEvent;
+  bool fromIsr = EVT_Peek(&isrEvents, &isrEvent);
+  bool fromTask = EVT_Peek(&taskEvents, &taskEvent);
+
+  if (fromIsr && fromTask) {
+    fromIsr = (isrEvent.time <= taskEvent.time);
+  }
+  if (!fromIsr && !fromTask) {
+    return false;
+  }
+  EventRing * ring = fromIsr ? &isrEvents : &taskEvents;
+  *event = fromIsr ? isrEvent : taskEvent;
+  EVT_Pop(ring);
+  return true;
+}
+
+/**************************************************************************
+ * RL_Refill
+ * - Add the tokens earned since the last refill.
+ **************************************************************************/
+void RL_Refill(TokenBucket * bucket) {
+  unsigned long now = millis();
+
+  bucket->tokens = min(bucket->burst, bucket->tokens + (now - bucket->refilled) * bucket->perMinute / 60000.0f);
+  bucket->refilled = now;
+}
+
+/**************************************************************************
+ * RL_Take
+ * - Rate limiting: take a token for an action of the given class.
+ * - Each class has its own bucket, and all classes share the uplink bucket.
+ *   Lower priority classes must leave RL_PRIORITY_RESERVE uplink tokens per
+ *   higher priority class, so motion events always get through first.
+ * - Returns false if the action must be dropped or deferred (caller decides).
+ **************************************************************************/
+bool RL_Take(RateClass cls) {
+  TokenBucket * bucket = &buckets[cls];
+
+  RL_Refill(bucket);
+  RL_Refill(&uplink);
+  if (bucket->tokens < 1 || uplink.tokens < 1 + cls * RL_PRIORITY_RESERVE) {
+    return false;
+  }
+  bucket->tokens -= 1;
+  uplink.tokens -= 1;
+  bucket->allowed++;
+  uplink.allowed++;
+  return true;
+}
+
+/**************************************************************************
+ * RL_Drop
+ * - Count an action that was not allowed and is dropped.
+ **************************************************************************/
+void RL_Drop(RateClass cls) {
+  buckets[cls].dropped++;
+  Serial.print("\t- Rate limit: dropped "); Serial.println(buckets[cls].name);
+}
+
+/**************************************************************************
+ * RL_Configure
+ * - Set a bucket from a MQTT command (format: <class>:<burst>:<perMinute>).
+ **************************************************************************/
+bool RL_Configure(const String& value) {
+  int split1 = value.indexOf(':');
+  int split2 = value.indexOf(':', split1 + 1);
+  if (split1 <= 0 || split2 <= split1) {
+    return false;
+  }
+  String name = value.substring(0, split1);
+  float burst = value.substring(split1 + 1, split2).toFloat();
+  float perMinute = value.substring(split2 + 1).toFloat();
+  if (burst < 1 || perMinute <= 0) {
+    return false;
+  }
+
+  TokenBucket * bucket = (name == uplink.name) ? &uplink : NULL;
+  for (int i = 0; i < RL_CLASSES && !bucket; i++) {
+    if (name == buckets[i].name) bucket = &buckets[i];
+  }
+  if (!bucket) {
+    return false;
+  }
+  RL_Refill(bucket);
+  bucket->burst = burst;
+  bucket->perMinute = perMinute;
+  bucket->tokens = min(bucket->tokens, burst);
+  return true;
+}
+
+/**************************************************************************
+ * POWER_RtcNow
+ * - System time in us, kept by the RTC during deep sleep.
+ **************************************************************************/
+int64_t POWER_RtcNow() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**************************************************************************
+ * POWER_AvgCurrent
+ * - Estimated average current (mA) since power on, from the time spent in
+ *   each power state and the (estimated) board current of that state.
+ **************************************************************************/
+float POWER_AvgCurrent() {
+  double awakeUs = rtcState.awakeUs + (esp_timer_get_time() - power.awakeSince);
+  double totalUs = awakeUs + rtcState.lightUs + rtcState.deepUs;
+
+  return (awakeUs * POWER_MA_AWAKE + rtcState.lightUs * POWER_MA_LIGHT + rtcState.deepUs * POWER_MA_DEEP) / totalUs;
+}
+
+/**************************************************************************
+ * POWER_AwakePercent
+ * - Share of the time (since power on) spent awake.
+ **************************************************************************/
+float POWER_AwakePercent() {
+  double awakeUs = rtcState.awakeUs + (esp_timer_get_time() - power.awakeSince);
+
+  return 100.0 * awakeUs / (awakeUs + rtcState.lightUs + rtcState.deepUs);
+}
+
+/**************************************************************************
+ * MOTION_PulseRate
+ * - Current PIR pulse rate (pulses/minute).
+ * - The running average only updates on pulses, so let it decay while the
+ *   PIR is quiet.
+ **************************************************************************/
+float MOTION_PulseRate(int64_t now) {
+  if (motion.lastRise != 0 && now > motion.lastRise) {
+    return min(motion.pulseRate, 60000000.0f / (now - motion.lastRise));
+  }
+  return motion.pulseRate;
+}
+
+/**************************************************************************
+ * SETTINGS_Defaults / SETTINGS_Load / SETTINGS_Fill
+ * - Default, read and write the registry settings (SETTINGS_FIELDS).
+ **************************************************************************/
+void SETTINGS_Defaults(Settings& settings) {
+#define SET_DEFAULT(field, name, def, min, max)   settings.field = def;
+  SETTINGS_FIELDS(SET_DEFAULT)
+#undef SET_DEFAULT
+}
+
+void SETTINGS_Load(Settings& settings, JsonObjectConst doc) {
+#define SET_LOAD(field, name, def, min, max)      settings.field = doc[name] | (def);
+  SETTINGS_FIELDS(SET_LOAD)
+#undef SET_LOAD
+}
+
+void SETTINGS_Fill(const Settings& settings, JsonDocument& doc) {
+#define SET_FILL(field, name, def, min, max)      doc[name] = settings.field;
+  SETTINGS_FIELDS(SET_FILL)
+#undef SET_FILL
+}
+
+/**************************************************************************
+ * SETTINGS_Set
+ * - Set a registry setting by name, clamped to its range. Returns false if
+ *   the name is not a registry setting.
+ **************************************************************************/
+bool SETTINGS_Set(Settings& settings, const char * variable, int val) {
+#define SET_SET(field, name, def, min, max) \
+  if (!strcmp(variable, name)) { settings.field = constrain(val, min, max); return true; }
+  SETTINGS_FIELDS(SET_SET)
+#undef SET_SET
+  return false;
+}
+
 /**************************************************************************
  * cam_SaveSettings
  * - Save (some of) the current camera settings to the SPIFFS config file.
@@ -141,14 +1040,13 @@ void cam_SaveSettings(bool RemoveOnly) {
         File settingsFile = SPIFFS.open(SETTINGSFILE, FILE_WRITE);
         if ( settingsFile ) {
           Serial.println("- SaveSettings: new settings file created");
-          StaticJsonDocument<256> jsonDoc;
+          StaticJsonDocument<SETTINGS_JSON_CAPACITY> jsonDoc;
           // Set the values in the document
-          jsonDoc["brightness"] = camSettings.brightness;
-          jsonDoc["contrast"] = camSettings.contrast;
-          jsonDoc["framesize"] = camSettings.framesize;
-          jsonDoc["quality"] = camSettings.quality;
-          jsonDoc["hmirror"] = camSettings.hmirror;
-          jsonDoc["vflip"] = camSettings.vflip;
+          SETTINGS_Fill(camSettings, jsonDoc);
+          for (int p = 0; p < CP_COUNT; p++) {
+            if (camSettings.sensor[p] != CAM_PARAM_UNSET) jsonDoc[camParamNames[p]] = camSettings.sensor[p];
+          }
+          jsonDoc["profile"] = camSettings.profile;
 
           if (serializeJson(jsonDoc, settingsFile) == 0) {
             Serial.println(F("\t---! SaveSettings: Failed to write to file"));
@@ -186,17 +1084,16 @@ static esp_err_t cam_ReadSettings() {
 
       if ( settingsFile ) {
         // Config file opened ok. Read contents.
-        StaticJsonDocument<512> jsonDoc;
+        StaticJsonDocument<SETTINGS_JSON_CAPACITY> jsonDoc;
         DeserializationError error = deserializeJson(jsonDoc, settingsFile);
         if (error) {
           Serial.print(F("\t---! ReadSettings: Failed to deserialize file. Err: ")); Serial.println(error.c_str());           
         } else {
-          camSettings.brightness = jsonDoc["brightness"] | 0;     // brightness (-2 > +2)
-          camSettings.contrast = jsonDoc["contrast"] | 0;         // contrast (-2 > +2)
-          camSettings.framesize = jsonDoc["framesize"] | 6;       // frame size (0 > 10   default: 6 = VGA(640x480) )
-          camSettings.quality = jsonDoc["quality"] | 10;          // quality (10 > 63     default: high )
-          camSettings.hmirror = jsonDoc["hmirror"] | 0;           // horizontal mirror (0/1 default: no)
-          camSettings.vflip = jsonDoc["vflip"] | 0;               // verical flip (0/1    default: no)
+          SETTINGS_Load(camSettings, jsonDoc.as<JsonObjectConst>());   // registry settings (missing: default)
+          for (int p = 0; p < CP_COUNT; p++) {
+            camSettings.sensor[p] = jsonDoc[camParamNames[p]] | CAM_PARAM_UNSET;   // sensor parameters (default: sensor default)
+          }
+          strlcpy(camSettings.profile, jsonDoc["profile"] | "", sizeof(camSettings.profile));
           camSettings.isValid = true;
 
           readConfigOK = true;
@@ -217,12 +1114,11 @@ static esp_err_t cam_ReadSettings() {
 
   if ( !readConfigOK ) {
     // Settings file in SPIFFS not found/loaded. Initialize with defaults.
-    camSettings.brightness = 0;             // brightness (-2 > +2)
-    camSettings.contrast = 0;               // contrast (-2 > +2)
-    camSettings.framesize = 6;              // frame size (0 > 10   default: 6 = VGA(640x480) )
-    camSettings.quality = 10;               // quality (10 > 63     default: high )
-    camSettings.hmirror = 0;                // horizontal mirror (0/1 default: no)
-    camSettings.vflip = 0;                  // verical flip (0/1    default: no)
+    SETTINGS_Defaults(camSettings);         // registry settings
+    for (int p = 0; p < CP_COUNT; p++) {
+      camSettings.sensor[p] = CAM_PARAM_UNSET;  // sensor parameters (default: sensor default, read at cam_init)
+    }
+    camSettings.profile[0] = 0;             // no profile applied
     camSettings.isValid = true;
 
     Serial.println("\t- ReadSettings: Unable to read settings. Defaults set. Saving new settings....");
@@ -236,152 +1132,251 @@ static esp_err_t cam_ReadSettings() {
 }
 
 /**************************************************************************
- * cam_ReportSettings
- * - Give feedback on the current settings and status. (TODO: still not implemented)
+ * cam_ApplyRoi
+ * - Apply the region of interest to the sensor (roi_mode 2), or restore the
+ *   normal frame size window (other modes).
+ * - Sensor windowing is only available for the OV2640 (set_res_raw), other
+ *   sensors fall back to cropping in software (roi_mode 1).
+ * - OV2640 window coordinates are in UXGA (1600x1200) sensor pixels.
  **************************************************************************/
-void cam_ReportSettings() {
-  // TO BE IMPLEMENTED
+int cam_ApplyRoi() {
+  sensor_t * s = esp_camera_sensor_get();
+
+  if (camSettings.roiMode != 2) {
+    return s->set_framesize(s, (framesize_t)camSettings.framesize);
+  }
+  if (s->id.PID != OV2640_PID || s->set_res_raw == NULL) {
+    Serial.println("\t!! ROI: sensor window not supported, cropping photos instead");
+    camSettings.roiMode = 1;
+    return s->set_framesize(s, (framesize_t)camSettings.framesize);
+  }
+
+  ImgWindow win;
+  IMG_RoiWindow(camSettings.roiX, camSettings.roiY, camSettings.roiW, camSettings.roiH, camSettings.roiScale, &win);
+
+  Serial.printf("\t- ROI: sensor window %dx%d at %d,%d -> %dx%d\n", win.totalX, win.totalY, win.offsetX, win.offsetY, win.outputX, win.outputY);
+  // OV2640: startX selects the sensor mode (0 = UXGA), offset/total = window, output = scaled frame size.
+  return s->set_res_raw(s, 0, 0, 0, 0, win.offsetX, win.offsetY, win.totalX, win.totalY, win.outputX, win.outputY, false, false);
 }
 
 /**************************************************************************
- * cam_UpdateSettings
- * - set camera property based on provided setting and value (format: <setting>:<value>)
- * - setting and value must be delimited by ":"
- * - value must be numeric
- * 
- * settings template taken from: 
- * - https://randomnerdtutorials.com/esp32-cam-video-streaming-face-recognition-arduino-ide/
- * - https://randomnerdtutorials.com/esp32-cam-ov2640-camera-settings/
- * 
+ * cam_GetParam
+ * - Current value of a sensor parameter, from the sensor status.
  **************************************************************************/
-static esp_err_t cam_UpdateSettings (const String& newSettingValue) {
-  int posDelimiter = -1;
-  int val = 0;
-  int res = -1;
-  int sign = 1;
-  bool validSetting = true;
-  bool saveSettings = false;
-
-  Serial.print("- cam_UpdateSettings: "); Serial.println(newSettingValue);
+int cam_GetParam(const camera_status_t& st, int param) {
+  switch (param) {
+    case CP_AEC:            return st.aec;
+    case CP_AEC2:           return st.aec2;
+    case CP_AE_LEVEL:       return st.ae_level;
+    case CP_AGC:            return st.agc;
+    case CP_GAINCEILING:    return st.gainceiling;
+    case CP_AWB:            return st.awb;
+    case CP_AWB_GAIN:       return st.awb_gain;
+    case CP_WB_MODE:        return st.wb_mode;
+    case CP_AEC_VALUE:      return st.aec_value;
+    case CP_AGC_GAIN:       return st.agc_gain;
+    case CP_BRIGHTNESS:     return st.brightness;
+    case CP_CONTRAST:       return st.contrast;
+    case CP_SATURATION:     return st.saturation;
+    case CP_SHARPNESS:      return st.sharpness;
+    case CP_DENOISE:        return st.denoise;
+    case CP_SPECIAL_EFFECT: return st.special_effect;
+    case CP_BPC:            return st.bpc;
+    case CP_WPC:            return st.wpc;
+    case CP_RAW_GMA:        return st.raw_gma;
+    case CP_LENC:           return st.lenc;
+    case CP_HMIRROR:        return st.hmirror;
+    case CP_VFLIP:          return st.vflip;
+    case CP_DCW:            return st.dcw;
+    case CP_COLORBAR:       return st.colorbar;
+  }
+  return CAM_PARAM_UNSET;
+}
 
-  posDelimiter = newSettingValue.indexOf(":");
-  if (newSettingValue == "reset") {
-    // Remove existing settigs from SPIFFS
-    cam_SaveSettings(true);
-    // Read default values and create new SPIFFS file.
-    cam_ReadSettings();
+/**************************************************************************
+ * cam_SetParam
+ * - Set a sensor parameter. Returns the sensor driver result (0 = ok).
+ **************************************************************************/
+int cam_SetParam(sensor_t * s, int param, int val) {
+  switch (param) {
+    case CP_AEC:            return s->set_exposure_ctrl(s, val);
+    case CP_AEC2:           return s->set_aec2(s, val);
+    case CP_AE_LEVEL:       return s->set_ae_level(s, val);
+    case CP_AGC:            return s->set_gain_ctrl(s, val);
+    case CP_GAINCEILING:    return s->set_gainceiling(s, (gainceiling_t)val);
+    case CP_AWB:            return s->set_whitebal(s, val);
+    case CP_AWB_GAIN:       return s->set_awb_gain(s, val);
+    case CP_WB_MODE:        return s->set_wb_mode(s, val);
+    case CP_AEC_VALUE:      return s->set_aec_value(s, val);
+    case CP_AGC_GAIN:       return s->set_agc_gain(s, val);
+    case CP_BRIGHTNESS:     return s->set_brightness(s, val);
+    case CP_CONTRAST:       return s->set_contrast(s, val);
+    case CP_SATURATION:     return s->set_saturation(s, val);
+    case CP_SHARPNESS:      return s->set_sharpness(s, val);
+    case CP_DENOISE:        return s->set_denoise(s, val);
+    case CP_SPECIAL_EFFECT: return s->set_special_effect(s, val);
+    case CP_BPC:            return s->set_bpc(s, val);
+    case CP_WPC:            return s->set_wpc(s, val);
+    case CP_RAW_GMA:        return s->set_raw_gma(s, val);
+    case CP_LENC:           return s->set_lenc(s, val);
+    case CP_HMIRROR:        return s->set_hmirror(s, val);
+    case CP_VFLIP:          return s->set_vflip(s, val);
+    case CP_DCW:            return s->set_dcw(s, val);
+    case CP_COLORBAR:       return s->set_colorbar(s, val);
+  }
+  return -1;
+}
 
-  } else if ( posDelimiter>0 && posDelimiter < newSettingValue.length() ) {
-    char variable[posDelimiter+1];
-    newSettingValue.substring(0,posDelimiter).toCharArray(variable,sizeof(variable));
+/**************************************************************************
+ * cam_FindParam
+ * - Index of a sensor parameter by its setting name (-1 = unknown).
+ **************************************************************************/
+int cam_FindParam(const char * name) {
+  for (int p = 0; p < CP_COUNT; p++) {
+    if (!strcmp(name, camParamNames[p])) return p;
+  }
+  return -1;
+}
 
-    if (newSettingValue.charAt(posDelimiter+1) == '-') {
-      // The provided value is negative (allowed). Keep the sign and increase the offset.
-      sign = -1;
-      posDelimiter++;
+/**************************************************************************
+ * cam_RestoreSensor
+ * - Apply all stored sensor parameters in one pass (in CamParam order).
+ * - Parameters never set keep the sensor default, which is stored instead,
+ *   so the settings always hold a complete snapshot of the sensor state.
+ **************************************************************************/
+void cam_RestoreSensor() {
+  sensor_t * s = esp_camera_sensor_get();
+
+  for (int p = 0; p < CP_COUNT; p++) {
+    if (camSettings.sensor[p] == CAM_PARAM_UNSET) {
+      camSettings.sensor[p] = cam_GetParam(s->status, p);
+    } else if (cam_SetParam(s, p, camSettings.sensor[p]) != 0) {
+      Serial.print("\t!! Sensor does not support setting: "); Serial.println(camParamNames[p]);
     }
-    if (posDelimiter+1 < newSettingValue.length() ) {
-      // Validate that the provided value is numeric.
-      for (int i=posDelimiter+1; i<newSettingValue.length(); i++) {
-        if ( !isdigit(newSettingValue.charAt(i)) ) {
-          Serial.println("\t!! NON-NUMERIC settings parameter");
-          validSetting = false;
-        }
-      }
-    } else {
-      Serial.println("\t!! INVALID setting: no value provided");
-      validSetting = false;
+  }
+}
+
+/**************************************************************************
+ * cam_ProfilePath
+ * - SPIFFS file of a named profile ("/profile_<name>.json").
+ * - Only names of [A-Za-z0-9_-] that fit camSettings.profile and the path
+ *   (SPIFFS name limit) are accepted, so a name can't leave the profile files.
+ **************************************************************************/
+bool cam_ProfilePath(const String& name, char * path, size_t size) {
+  if (name.length() == 0 || name.length() >= sizeof(camSettings.profile)) {
+    return false;
+  }
+  for (unsigned int i = 0; i < name.length(); i++) {
+    char c = name.charAt(i);
+    if (!isalnum(c) && c != '_' && c != '-') {
+      return false;
     }
-  
-    if (validSetting) {
-      // Extract the setting (variable) and new value (val) from the provided parameter. 
-      val = newSettingValue.substring(posDelimiter+1).toInt();
-      val = val*sign;
+  }
+  int len = snprintf(path, size, "/profile_%s.json", name.c_str());
+  return (len > 0 && (size_t)len < size);
+}
 
-      Serial.print("\t- DO CHANGE: variable="); Serial.print(variable); Serial.print(" val="); Serial.println(val);
+/**************************************************************************
+ * cam_SaveProfile
+ * - Save the current sensor parameters as a named profile (e.g. "night").
+ **************************************************************************/
+bool cam_SaveProfile(const String& name) {
+  StaticJsonDocument<CAM_PROFILE_JSON_CAPACITY> jsonDoc;
+  char path[CAM_PROFILE_PATH_LEN];
 
-      sensor_t * s = esp_camera_sensor_get();
+  if (!cam_ProfilePath(name, path, sizeof(path)) || !SPIFFS.begin(true)) {
+    return false;
+  }
+  File profileFile = SPIFFS.open(path, FILE_WRITE);
+  if (!profileFile) {
+    return false;
+  }
+  for (int p = 0; p < CP_COUNT; p++) {
+    jsonDoc[camParamNames[p]] = camSettings.sensor[p];
+  }
+  bool saved = (serializeJson(jsonDoc, profileFile) > 0);
+  profileFile.close();
+  return saved;
+}
 
-           if (!strcmp(variable, "saturation")) res = s->set_saturation(s, val);
-      else if (!strcmp(variable, "gainceiling")) res = s->set_gainceiling(s, (gainceiling_t)val);
-      else if (!strcmp(variable, "colorbar")) res = s->set_colorbar(s, val);
-      else if (!strcmp(variable, "awb")) res = s->set_whitebal(s, val);
-      else if (!strcmp(variable, "agc")) res = s->set_gain_ctrl(s, val);
-      else if (!strcmp(variable, "aec")) res = s->set_exposure_ctrl(s, val);
-      else if (!strcmp(variable, "awb_gain")) res = s->set_awb_gain(s, val);
-      else if (!strcmp(variable, "agc_gain")) res = s->set_agc_gain(s, val);
-      else if (!strcmp(variable, "aec_value")) res = s->set_aec_value(s, val);
-      else if (!strcmp(variable, "aec2")) res = s->set_aec2(s, val);
-      else if (!strcmp(variable, "dcw")) res = s->set_dcw(s, val);
-      else if (!strcmp(variable, "bpc")) res = s->set_bpc(s, val);
-      else if (!strcmp(variable, "wpc")) res = s->set_wpc(s, val);
-      else if (!strcmp(variable, "raw_gma")) res = s->set_raw_gma(s, val);
-      else if (!strcmp(variable, "lenc")) res = s->set_lenc(s, val);
-      else if (!strcmp(variable, "special_effect")) res = s->set_special_effect(s, val);
-      else if (!strcmp(variable, "wb_mode")) res = s->set_wb_mode(s, val);
-      else if (!strcmp(variable, "ae_level")) res = s->set_ae_level(s, val);
-      // For each of the following settings, also update the settings struct and save to SPIFFS.
-      else if (!strcmp(variable, "framesize")) {
-        if (s->pixformat == PIXFORMAT_JPEG) { 
-          res = s->set_framesize(s, (framesize_t)val);
-          camSettings.framesize = (framesize_t)val;
-          saveSettings = true;
-        }
-      }
-      else if (!strcmp(variable, "quality")) {
-        res = s->set_quality(s, val);
-        camSettings.quality = val;
-        saveSettings = true;
-      }
-      else if (!strcmp(variable, "contrast")) {
-        res = s->set_contrast(s, val);
-        camSettings.contrast = val;
-        saveSettings = true;
-      }
-      else if (!strcmp(variable, "brightness")) {
-        res = s->set_brightness(s, val);
-        camSettings.brightness = val;
-        saveSettings = true;
-      }
-      else if (!strcmp(variable, "hmirror")) {
-        res = s->set_hmirror(s, val);
-        camSettings.hmirror = val;
-        saveSettings = true;
-      }  
-      else if (!strcmp(variable, "vflip")) {
-        res = s->set_vflip(s, val);
-        camSettings.vflip = val;
-        saveSettings = true;
-      }  
-/*
-      else if(!strcmp(variable, "face_detect")) {
-          detection_enabled = val;
-          if(!detection_enabled) {
-              recognition_enabled = 0;
-          }
-      }
-      else if(!strcmp(variable, "face_enroll")) is_enrolling = val;
-      else if(!strcmp(variable, "face_recognize")) {
-          recognition_enabled = val;
-          if(recognition_enabled){
-              detection_enabled = val;
-          }
-      }
-*/
-      else {
-        Serial.print("\t!! UNKNOWN/UNSUPPORTED setting: "); Serial.println(newSettingValue);
+/**************************************************************************
+ * cam_ApplyProfile
+ * - Switch all sensor parameters to a named profile, saved earlier with
+ *   "saveprofile". The "day" and "night" profiles have built-in defaults.
+ * - Parameters missing in the profile are left unchanged.
+ **************************************************************************/
+bool cam_ApplyProfile(const String& name) {
+  // Built-in profiles, used until they are saved: automatic exposure and gain, with
+  // (for the night) the DSP night mode, brighter exposure and a high gain ceiling.
+  static const int16_t day[][2] = { {CP_AEC, 1}, {CP_AEC2, 0}, {CP_AE_LEVEL, 0}, {CP_AGC, 1}, {CP_GAINCEILING, GAINCEILING_2X},
+                                    {CP_AWB, 1}, {CP_AWB_GAIN, 1}, {CP_WB_MODE, 0}, {CP_BPC, 0}, {CP_WPC, 1} };
+  static const int16_t night[][2] = { {CP_AEC, 1}, {CP_AEC2, 1}, {CP_AE_LEVEL, 2}, {CP_AGC, 1}, {CP_GAINCEILING, GAINCEILING_32X},
+                                      {CP_AWB, 1}, {CP_AWB_GAIN, 1}, {CP_WB_MODE, 0}, {CP_BPC, 1}, {CP_WPC, 1} };
+  char path[CAM_PROFILE_PATH_LEN];
+  bool found = false;
+
+  if (!cam_ProfilePath(name, path, sizeof(path))) {
+    return false;
+  }
+  if (SPIFFS.begin(true) && SPIFFS.exists(path)) {
+    File profileFile = SPIFFS.open(path, FILE_READ);
+    StaticJsonDocument<CAM_PROFILE_JSON_CAPACITY> jsonDoc;
+    if (profileFile && !deserializeJson(jsonDoc, profileFile)) {
+      for (int p = 0; p < CP_COUNT; p++) {
+        camSettings.sensor[p] = jsonDoc[camParamNames[p]] | camSettings.sensor[p];
       }
+      found = true;
     }
-  } else {
-    Serial.print("\t!! INVALID setting format: "); Serial.println(newSettingValue);
+    profileFile.close();
+  } else if (name == "day" || name == "night") {
+    const int16_t (*values)[2] = (name == "day") ? day : night;
+    int count = (name == "day") ? sizeof(day) / sizeof(day[0]) : sizeof(night) / sizeof(night[0]);
+    for (int i = 0; i < count; i++) {
+      camSettings.sensor[values[i][0]] = values[i][1];
+    }
+    found = true;
   }
 
-  if (saveSettings) {
-    // Save the changed camera settings.
+  if (found) {
+    strlcpy(camSettings.profile, name.c_str(), sizeof(camSettings.profile));
+    cam_RestoreSensor();
     cam_SaveSettings(false);
   }
-  
-  return res;
+  return found;
+}
+
+/**************************************************************************
+ * cam_SetQuality
+ * - Set the sensor JPEG quality, from any task: the stream quality while a
+ *   WebSocket client chose one ("quality:"), else the photo quality
+ *   (camSettings.quality).
+ * - hold: 1 = a photo or clip capture starts, -1 = it is done, 0 = no
+ *   change. While a capture is held the photo quality is used, so photos
+ *   and clips never get the stream quality.
+ * - Returns true if the sensor quality changed: frames already on their
+ *   way have the old quality.
+ **************************************************************************/
+bool cam_SetQuality(int hold = 0) {
+  bool changed = false;
+
+  if (qualityLock) xSemaphoreTake(qualityLock, portMAX_DELAY);
+  qualityHolds = max(0, qualityHolds + hold);
+  int quality = camSettings.quality;
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  if (qualityHolds == 0 && wsQuality >= 0) {
+    quality = wsQuality;
+  }
+#endif
+  if (quality != sensorQuality) {
+    sensor_t * s = esp_camera_sensor_get();
+    if (s) {
+      s->set_quality(s, quality);
+      sensorQuality = quality;
+      changed = true;
+    }
+  }
+  if (qualityLock) xSemaphoreGive(qualityLock);
+  return changed;
 }
 
 /**************************************************************************
@@ -413,8 +1408,10 @@ static esp_err_t cam_init()
   config.pin_reset = RESET_GPIO_NUM;
   config.xclk_freq_hz = 20000000;
   config.pixel_format = PIXFORMAT_JPEG;
+  config.grab_mode = camSettings.grabMode ? CAMERA_GRAB_LATEST : CAMERA_GRAB_WHEN_EMPTY;
+  config.fb_location = CAMERA_FB_IN_PSRAM;
   //init with high specs to pre-allocate larger buffers
-  if (psramFound()) {
+  if (psramFound() && !camSettings.fbLocation) {
     config.frame_size = FRAMESIZE_UXGA;
     config.jpeg_quality = 10;
     config.fb_count = 2;
@@ -422,21 +1419,20 @@ static esp_err_t cam_init()
     config.frame_size = FRAMESIZE_SVGA;
     config.jpeg_quality = 12;
     config.fb_count = 1;
+    config.fb_location = CAMERA_FB_IN_DRAM;
   }
 
   if (camSettings.isValid) {
-    // Initialize the camera with previously stored values. 
-    // NOTE this is just a subset of the possible values. The other settings will have default values after each start.
+    // Initialize the camera with previously stored values (complete sensor state). 
     res = esp_camera_init(&config);
     if (res == ESP_OK) {
       sensor_t * s = esp_camera_sensor_get();
 
       s->set_framesize(s, (framesize_t)camSettings.framesize);        // framesize (e.g. CIF, VGA, ..) 
-      s->set_quality(s, camSettings.quality);                         // set the frame size
-      s->set_contrast(s, camSettings.contrast);                       // override the automatic/default contrast
-      s->set_brightness(s, camSettings.contrast);                     // override the automatic/default brightness
-      s->set_hmirror(s, camSettings.hmirror);                         // flip image horizontally
-      res = s->set_vflip(s, camSettings.vflip);                       // flip image vertically
+      sensorQuality = -1;                                             // new sensor state
+      cam_SetQuality();                                               // set the JPEG quality (photo, or the stream's)
+      cam_RestoreSensor();                                            // exposure, gain, white balance, image adjustments, ..
+      if (camSettings.roiMode == 2) cam_ApplyRoi();                   // sensor window for the region of interest
 
     } else {
       Serial.printf("Camera init failed with error 0x%x!\nRestarting in 10s...", res);
@@ -446,6 +1442,302 @@ static esp_err_t cam_init()
   return res;
 }
 
+/**************************************************************************
+ * CAM_Enter / CAM_Leave
+ * - Stream tasks (web server, WebSocket) take a frame only between these.
+ *   CAM_Enter fails while the camera is re-initialized (cam_Reinit).
+ **************************************************************************/
+bool CAM_Enter() {
+  camStreamFrames++;
+  if (camPaused) {
+    camStreamFrames--;
+    return false;
+  }
+  return true;
+}
+
+void CAM_Leave() {
+  camStreamFrames--;
+}
+
+/**************************************************************************
+ * cam_Reinit
+ * - Initialize the camera driver again (new grab mode or frame buffer
+ *   location), from the loop only. No task may be in esp_camera_fb_get()
+ *   or hold a frame buffer meanwhile:
+ *   - photos and clips are started by the loop, so none may be in progress,
+ *   - the streams are paused, waiting for them to return their frames.
+ * - Refused (ESP_ERR_INVALID_STATE) while a photo or clip is in progress,
+ *   or a stream does not return its frame within CAM_REINIT_WAIT ms.
+ **************************************************************************/
+esp_err_t cam_Reinit() {
+  if (pipeInFlight > 0 || clipRecording) {
+    Serial.println("\t!! Camera busy (photo or clip), not re-initialized");
+    return ESP_ERR_INVALID_STATE;
+  }
+  camPaused = true;
+  unsigned long started = millis();
+  while (camStreamFrames > 0 && millis() - started < CAM_REINIT_WAIT) {
+    delay(10);
+  }
+  if (camStreamFrames > 0) {
+    camPaused = false;
+    Serial.println("\t!! Camera busy (stream), not re-initialized");
+    return ESP_ERR_INVALID_STATE;
+  }
+  esp_camera_deinit();
+  esp_err_t res = cam_init();
+  camPaused = false;
+  return res;
+}
+
+/**************************************************************************
+ * cam_UpdateSettings
+ * - set camera property based on provided setting and value (format: <setting>:<value>)
+ * - setting and value must be delimited by ":"
+ * - value must be numeric
+ * 
+ * settings template taken from: 
+ * - https://randomnerdtutorials.com/esp32-cam-video-streaming-face-recognition-arduino-ide/
+ * - https://randomnerdtutorials.com/esp32-cam-ov2640-camera-settings/
+ * 
+ **************************************************************************/
+static esp_err_t cam_UpdateSettings (const String& newSettingValue) {
+  int posDelimiter = -1;
+  int val = 0;
+  int res = -1;
+  int sign = 1;
+  bool validSetting = true;
+  bool saveSettings = false;
+
+  Serial.print("- cam_UpdateSettings: "); Serial.println(newSettingValue);
+
+  posDelimiter = newSettingValue.indexOf(":");
+  if (newSettingValue == "reset") {
+    // Remove existing settigs from SPIFFS
+    cam_SaveSettings(true);
+    // Read default values and create new SPIFFS file.
+    cam_ReadSettings();
+
+  } else if ( posDelimiter>0 && posDelimiter < newSettingValue.length() ) {
+    char variable[posDelimiter+1];
+    newSettingValue.substring(0,posDelimiter).toCharArray(variable,sizeof(variable));
+
+    if (newSettingValue.charAt(posDelimiter+1) == '-') {
+      // The provided value is negative (allowed). Keep the sign and increase the offset.
+      sign = -1;
+      posDelimiter++;
+    }
+    if (posDelimiter+1 < newSettingValue.length() ) {
+      // Validate that the provided value is numeric.
+      for (int i=posDelimiter+1; i<newSettingValue.length(); i++) {
+        if ( !isdigit(newSettingValue.charAt(i)) ) {
+          Serial.println("\t!! NON-NUMERIC settings parameter");
+          validSetting = false;
+        }
+      }
+    } else {
+      Serial.println("\t!! INVALID setting: no value provided");
+      validSetting = false;
+    }
+  
+    if (validSetting) {
+      // Extract the setting (variable) and new value (val) from the provided parameter. 
+      val = newSettingValue.substring(posDelimiter+1).toInt();
+      val = val*sign;
+
+      Serial.print("\t- DO CHANGE: variable="); Serial.print(variable); Serial.print(" val="); Serial.println(val);
+
+      sensor_t * s = esp_camera_sensor_get();
+
+      int param = cam_FindParam(variable);
+      Settings previous = camSettings;
+
+      // For each of the following settings, also update the settings struct and save to SPIFFS.
+      if (param >= 0) {
+        // Sensor parameter (exposure, gain, white balance, image adjustments, ..)
+        res = cam_SetParam(s, param, val);
+        if (res == 0) {
+          camSettings.sensor[param] = cam_GetParam(s->status, param);
+          saveSettings = true;
+        }
+      }
+      else if (SETTINGS_Set(camSettings, variable, val)) {
+        // Registry setting (clamped to its range): apply it.
+        if (!strcmp(variable, "framesize") || !strncmp(variable, "roi_", 4)) {
+          res = cam_ApplyRoi();                                 // new frame size, or sensor window when used
+        } else if (!strcmp(variable, "quality")) {
+          cam_SetQuality();                                     // sensor: unless a client streams at its own quality
+          res = ESP_OK;
+          qualityCtl.sizeQ = 0;                                 // manual quality: restart the auto quality estimate
+          qualityCtl.changedAt = esp_timer_get_time();
+        } else if (!strcmp(variable, "grab_mode") || !strcmp(variable, "fb_location")) {
+          // Driver options: the camera must be initialized again (when no frame is in use).
+          res = (camSettings.grabMode == previous.grabMode && camSettings.fbLocation == previous.fbLocation) ? ESP_OK : cam_Reinit();
+          if (res == ESP_ERR_INVALID_STATE) {
+            camSettings.grabMode = previous.grabMode;           // Refused: keep the running driver options
+            camSettings.fbLocation = previous.fbLocation;
+          }
+        } else {
+          res = 0;                                              // used at the next photo
+        }
+        saveSettings = (res != ESP_ERR_INVALID_STATE);
+      }
+/*
+      else if(!strcmp(variable, "face_detect")) {
+          detection_enabled = val;
+          if(!detection_enabled) {
+              recognition_enabled = 0;
+          }
+      }
+      else if(!strcmp(variable, "face_enroll")) is_enrolling = val;
+      else if(!strcmp(variable, "face_recognize")) {
+          recognition_enabled = val;
+          if(recognition_enabled){
+              detection_enabled = val;
+          }
+      }
+*/
+      else {
+        Serial.print("\t!! UNKNOWN/UNSUPPORTED setting: "); Serial.println(newSettingValue);
+      }
+    }
+  } else {
+    Serial.print("\t!! INVALID setting format: "); Serial.println(newSettingValue);
+  }
+
+  if (saveSettings) {
+    // Save the changed camera settings.
+    cam_SaveSettings(false);
+  }
+  
+  return res;
+}
+
+/**************************************************************************
+ * cam_FrameTime
+ * - Time (esp_timer, us) the frame was captured.
+ **************************************************************************/
+int64_t cam_FrameTime(const camera_fb_t * fb) {
+  return (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+}
+
+/**************************************************************************
+ * cam_FreshFrame
+ * - Starting with fb, return stale frames and take the next one, until a
+ *   frame's exposure started after the given time (esp_timer, us).
+ * - Frame timestamps mark the start of the readout. Exposure starts at most
+ *   one frame period earlier, so a frame is fresh when timestamp - period is
+ *   after the trigger. The frame period is measured from consecutive frames.
+ **************************************************************************/
+camera_fb_t * cam_FreshFrame(camera_fb_t * fb, int64_t after) {
+  int64_t prevTime = 0;
+
+  for (int i = 0; fb && i < CAM_FRESH_MAX_DRAIN; i++) {
+    int64_t frameTime = cam_FrameTime(fb);
+    if (prevTime > 0 && frameTime - prevTime < 2 * freshStats.framePeriod) {
+      // Consecutive frames: update the frame period.
+      freshStats.framePeriod += (frameTime - prevTime - freshStats.framePeriod) / 4;
+    }
+    if (frameTime - freshStats.framePeriod >= after) {
+      break;                                                    // Exposed after the trigger
+    }
+    esp_camera_fb_return(fb);
+    freshStats.drained++;
+    prevTime = frameTime;
+    fb = esp_camera_fb_get();
+    if (fb) {
+      METRIC_Add(metrics.frames[FRAME_PHOTO]);
+    }
+  }
+  return fb;
+}
+
+/**************************************************************************
+ * cam_GetFrame
+ * - Get a frame for a photo that was triggered at triggerTime (esp_timer, us).
+ * - Fresh frame mode: the driver keeps filling its buffers, so the next frame
+ *   can be one or two frame periods old. Stale frames are skipped (see
+ *   cam_FreshFrame), so the photo was exposed after the trigger.
+ * - fb: a frame already taken for this photo (NULL = take one).
+ **************************************************************************/
+camera_fb_t * cam_GetFrame(int64_t triggerTime, camera_fb_t * fb = NULL) {
+  if (!fb) {
+    fb = esp_camera_fb_get();
+    if (fb) {
+      METRIC_Add(metrics.frames[FRAME_PHOTO]);
+    }
+  }
+  if (!fb || !camSettings.freshFrame || triggerTime <= 0) {
+    return fb;
+  }
+
+  fb = cam_FreshFrame(fb, triggerTime);
+  if (!fb) {
+    return NULL;
+  }
+  freshStats.lastUs = cam_FrameTime(fb) - freshStats.framePeriod - triggerTime;
+  freshStats.maxUs = max(freshStats.maxUs, freshStats.lastUs);
+  freshStats.sumUs += freshStats.lastUs;
+  freshStats.frames++;
+  return fb;
+}
+
+/**************************************************************************
+ * cam_AutoQuality
+ * - Steer the JPEG quality so photos come out close to a target size.
+ * - The target is either a size (target_size) or an upload time (target_time,
+ *   converted to a size using the measured upload throughput).
+ * - Model: photo size is roughly inversely proportional to the quality value,
+ *   so size*quality is tracked as a running average of recent photos and the
+ *   quality for the target follows directly. This settles in a few photos.
+ * - The learned quality is saved (rate limited) so it survives a restart.
+ * - From the loop (photo_Results), with the size of each finished photo:
+ *   camSettings and SPIFFS are only changed by the loop.
+ **************************************************************************/
+void cam_AutoQuality(const PhotoJob& job) {
+  long target = camSettings.targetSize;
+
+  if (job.photoLen > 0) {
+    qualityCtl.lastSize = job.photoLen;
+  }
+  if (target == 0 && camSettings.targetTime > 0 && qualityCtl.uploadRate > 0) {
+    target = qualityCtl.uploadRate * camSettings.targetTime / 1000;
+  }
+  if (target <= 0 || job.photoLen == 0) {
+    return;
+  }
+  if (job.frameTime < qualityCtl.changedAt) {
+    // Frame was buffered before the last quality change, it says nothing about the new quality.
+    return;
+  }
+
+  float sample = (float)job.photoLen * camSettings.quality;
+  if (qualityCtl.sizeQ == 0) {
+    qualityCtl.sizeQ = sample;
+  } else {
+    qualityCtl.sizeQ += CAM_QUALITY_SMOOTHING * (sample - qualityCtl.sizeQ);
+  }
+
+  if (abs((long)job.photoLen - target) > target * CAM_QUALITY_DEADBAND / 100) {
+    int newQuality = constrain((int)lroundf(qualityCtl.sizeQ / target), CAM_QUALITY_MIN, CAM_QUALITY_MAX);
+    if (newQuality != camSettings.quality) {
+      Serial.printf("\t- AutoQuality: %u bytes (target %ld), quality %d -> %d\n", job.photoLen, target, camSettings.quality, newQuality);
+      camSettings.quality = newQuality;
+      cam_SetQuality();
+      qualityCtl.changedAt = esp_timer_get_time();
+      qualityCtl.unsaved = true;
+    }
+  }
+
+  if (qualityCtl.unsaved && (qualityCtl.lastSave == 0 || millis() - qualityCtl.lastSave > CAM_QUALITY_SAVE_INTERVAL)) {
+    // Limit flash writes while the quality is still settling.
+    cam_SaveSettings(false);
+    qualityCtl.lastSave = millis();
+    qualityCtl.unsaved = false;
+  }
+}
+
 /**************************************************************************
  * showFileConfig
  * - Show the contents of the SPIFFS config file.
@@ -515,86 +1807,768 @@ int RSSItoPrecentage(int valRSSI) {
 }
 
 /**************************************************************************
- * reportState
- * - Feedback the current app state and telemetry values.
+ * MqttChunkWriter
+ * - Small write-combining adapter between ArduinoJson and the MQTT client.
+ * - ArduinoJson emits mostly single characters, which would otherwise each
+ *   become a separate TCP write.
  **************************************************************************/
-void reportState() {
-  const int LEN = 30;
-  char startReason[LEN];
-  char UpTime[LEN];
-  long espTemperature = temperatureRead();
-  long UptimeSeconds = esp_timer_get_time()/1000/1000;
-  String ipAddress = WiFi.localIP().toString();
-
-  getRestartReason(startReason, LEN);
-  sprintf(UpTime, "%01.0fd%01.0f:%02.0f:%02.0f", floor(UptimeSeconds/86400.0), floor(fmod((UptimeSeconds/3600.0),24.0)), floor(fmod(UptimeSeconds,3600.0)/60.0), fmod(UptimeSeconds,60.0));
-
-  StaticJsonDocument<640> doc;
-  // Set the values in the document
-  doc["IP Address"] = ipAddress;                                  // device IP address
-  doc["RSSI (dBm)"] = WiFi.RSSI();                                // dBm value (negative)
-  doc["wifi"] = RSSItoPrecentage( WiFi.RSSI() );                  // dBm value converted to signal strength percentage
-  doc["Core Temperature (°C)"] = espTemperature;                  // ESP core temperature
-  doc["Uptime"] = UpTime;                                         // day.hours:minutes:seconds since last boot
-  doc["Start Reason"] = startReason;                              // reason for last restart
-  doc["Free Heap Memory"] = esp_get_free_heap_size();
-  doc["Min Free Heap"] = esp_get_minimum_free_heap_size();
-
-/*
-  esp_chip_info_t espInfo;
-  esp_chip_info(&espInfo);
-  doc["ESP Core Count"] = espInfo.cores;
-  doc["ESP Model"] = espInfo.model;
-  doc["Revision"] = espInfo.revision;
-  doc["IDFversion"] = esp_get_idf_version();
-*/
+class MqttChunkWriter : public Print {
+  public:
+    size_t write(uint8_t c) override {
+      chunk[used++] = c;
+      if (used == sizeof(chunk)) flush();
+      return 1;
+    }
+    size_t write(const uint8_t *buffer, size_t size) override {
+      for (size_t i=0; i<size; i++) write(buffer[i]);
+      return size;
+    }
+    void flush() {
+      if (used > 0) {
+        written += mqttClient.write(chunk, used);
+        used = 0;
+      }
+    }
+    size_t written = 0;
+  private:
+    uint8_t chunk[MQTT_CHUNK_SIZE];
+    size_t used = 0;
+};
 
-  char buffer[640];
-  serializeJson(doc, buffer);
-  mqttClient.publish(MQTT_PUB_STATE, buffer);
+/**************************************************************************
+ * mqttPublish
+ * - Publish a text payload (counted like the documents).
+ **************************************************************************/
+bool mqttPublish(const char* topic, const char* payload) {
+  if (!mqttClient.publish(topic, payload)) {
+    mqttPublishFailed++;
+    return false;
+  }
+  METRIC_Add(metrics.mqttOut);
+  return true;
 }
 
 /**************************************************************************
- * reportWiFi
- * - Feedback the current WiFi RSSI value.
+ * mqttPublishDoc
+ * - Publish a document (JSON or MessagePack) without serializing it to a
+ *   buffer first.
+ * - The payload length is measured up front (measureJson/measureMsgPack),
+ *   then the document is serialized straight into the MQTT packet
+ *   (beginPublish/write).
+ * - Overflowed documents and oversize payloads are counted and reported.
  **************************************************************************/
-void reportWiFi() {
-
-  //mqttClient.publish( MQTT_PUB_WIFI, String( (WiFi.RSSI()+100)*2 ).c_str() );
-  mqttClient.publish( MQTT_PUB_WIFI, String( RSSItoPrecentage( WiFi.RSSI() ) ).c_str() );
+bool mqttPublishDoc(const char* topic, const JsonDocument& doc, bool msgPack, bool retained = false) {
+  if (doc.overflowed()) {
+    // Some members did not fit in the document and are missing. Still publish the rest.
+    mqttPublishOversize++;
+    Serial.print("\t---! MQTT JSON document overflowed: "); Serial.println(topic);
+  }
 
-/*
-  StaticJsonDocument<124> doc;
-  // Set the values in the document
-  doc["RSSI (dBm)"] = WiFi.RSSI();                                // dBm value (negative)
-  doc["wifi"] = (WiFi.RSSI()+100)*2;                              // dBm value converted to signal strength percentage
+  size_t len = msgPack ? measureMsgPack(doc) : measureJson(doc);
+  if (len > MQTT_MAX_PAYLOAD) {
+    mqttPublishOversize++;
+    Serial.printf("\t---! MQTT payload too large (%u bytes): %s\n", len, topic);
+    return false;
+  }
 
-  char buffer[124];
-  serializeJson(doc, buffer);
-  mqttClient.publish(MQTT_PUB_WIFI, buffer);
-*/
+  if (!mqttClient.beginPublish(topic, len, retained)) {
+    mqttPublishFailed++;
+    return false;
+  }
+  MqttChunkWriter writer;
+  if (msgPack) {
+    serializeMsgPack(doc, writer);
+  } else {
+    serializeJson(doc, writer);
+  }
+  writer.flush();
+  if (!mqttClient.endPublish() || writer.written != len) {
+    mqttPublishFailed++;
+    return false;
+  }
+  METRIC_Add(metrics.mqttOut);
+  return true;
 }
 
 /**************************************************************************
- * reportConfig
- * - Feedback the general settings (that is currently in memory).
+ * mqttPublishJson
+ * - Publish a JSON document (see mqttPublishDoc).
  **************************************************************************/
-void reportConfig() {
-
-  StaticJsonDocument<256> configDoc;
-  // Set the values in the document
-  configDoc["CAM_enabled"] = config.CAM_enabled;
-  configDoc["PIR_enabled"] = config.PIR_enabled;
-  configDoc["PIR_delay"] = config.PIR_delay;
-  configDoc["ReportState"] = config.ReportState;
-  configDoc["ReportWiFi"] = config.ReportWiFi;
-  configDoc["TempInterval"] = config.TempInterval;
-  configDoc["StateInterval"] = config.StateInterval;
+bool mqttPublishJson(const char* topic, const JsonDocument& doc, bool retained = false) {
+  return mqttPublishDoc(topic, doc, false, retained);
+}
 
-  char buffer[256];
-  serializeJson(configDoc, buffer);
-  mqttClient.publish(MQTT_PUB_CONFIG, buffer);
+/**************************************************************************
+ * mqttPublishReport
+ * - Publish a state, config or camera settings report in the configured
+ *   wire format: JSON, or MessagePack with short keys (WIRE_Compact).
+ **************************************************************************/
+bool mqttPublishReport(const char* topic, const JsonDocument& doc) {
+  if (config.WireFormat != WIRE_MSGPACK) {
+    return mqttPublishJson(topic, doc);
+  }
+  HeapJsonDocument compact(doc.memoryUsage() + JSON_OBJECT_SIZE(4));
+  WIRE_Compact(doc.as<JsonObjectConst>(), compact.to<JsonObject>());
+  return mqttPublishDoc(topic, compact, true);
+}
+
+/**************************************************************************
+ * PIPE_Done
+ * - Account a finished job of a pipeline stage (started at esp_timer start).
+ **************************************************************************/
+void PIPE_Done(PipeStage * stage, int64_t start) {
+  long elapsed = esp_timer_get_time() - start;
+  long slowest = __atomic_load_n(&stage->maxUs, __ATOMIC_RELAXED);
+
+  __atomic_add_fetch(&stage->busyUs, elapsed, __ATOMIC_RELAXED);
+  while (elapsed > slowest && !__atomic_compare_exchange_n(&stage->maxUs, &slowest, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  __atomic_add_fetch(&stage->jobs, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&stage->busySince, 0, __ATOMIC_RELAXED);
+}
+
+/**************************************************************************
+ * PIPE_Send
+ * - Queue a job for a pipeline stage, waiting at most wait ticks for room.
+ **************************************************************************/
+bool PIPE_Send(PipeStage * stage, const PhotoJob * job, TickType_t wait) {
+  if (xQueueSend(stage->queue, job, wait) != pdTRUE) {
+    __atomic_add_fetch(&stage->dropped, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  UBaseType_t waiting = uxQueueMessagesWaiting(stage->queue);
+  UBaseType_t most = __atomic_load_n(&stage->queueMax, __ATOMIC_RELAXED);
+  while (waiting > most && !__atomic_compare_exchange_n(&stage->queueMax, &most, waiting, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  return true;
+}
+
+/**************************************************************************
+ * PIPE_Report
+ * - Add the per-stage pipeline statistics to the state report. Busy % and
+ *   jobs per minute are over the time since the previous report, so the
+ *   bottleneck shows as the stage that is (nearly) always busy.
+ **************************************************************************/
+void PIPE_Report(JsonObject pipe, bool restart) {
+  PipeStage * stages[] = { &pipeCapture, &pipeUpload, &pipeStream };
+  int64_t now = esp_timer_get_time();
+  double interval = max((int64_t)1, now - pipeReportedAt);
+
+  for (PipeStage * stage : stages) {
+    JsonObject stat = pipe.createNestedObject(stage->name);
+    unsigned long jobsDone = __atomic_load_n(&stage->jobs, __ATOMIC_RELAXED);
+    int64_t busyTotal = __atomic_load_n(&stage->busyUs, __ATOMIC_RELAXED);
+    unsigned long jobs = jobsDone - stage->reportJobs;
+    int64_t busyUs = busyTotal - stage->reportBusyUs;
+    stat["busy %"] = (int)(100 * busyUs / interval);
+    stat["per min"] = jobs * 60000000.0 / interval;
+    stat["avg ms"] = jobs ? (long)(busyUs / jobs / 1000) : 0;
+    stat["max ms"] = __atomic_load_n(&stage->maxUs, __ATOMIC_RELAXED) / 1000;
+    if (stage->queue) {
+      stat["queued"] = uxQueueMessagesWaiting(stage->queue);
+      stat["queue max"] = __atomic_load_n(&stage->queueMax, __ATOMIC_RELAXED);
+    }
+    stat["dropped"] = __atomic_load_n(&stage->dropped, __ATOMIC_RELAXED);
+    if (restart) {
+      stage->reportJobs = jobsDone;                   // Loop only
+      stage->reportBusyUs = busyTotal;
+    }
+  }
+  if (restart) {
+    pipeReportedAt = now;
+  }
+}
+
+/**************************************************************************
+ * HEAP_AddRegion
+ * - Add the free, largest block and fragmentation of a heap region.
+ *   Fragmentation: % of the free memory that is not in the largest block.
+ **************************************************************************/
+void HEAP_AddRegion(JsonObject region, uint32_t caps) {
+  size_t free = heap_caps_get_free_size(caps);
+  size_t largest = heap_caps_get_largest_free_block(caps);
+
+  region["size"] = heap_caps_get_total_size(caps);
+  region["free"] = free;
+  region["min_free"] = heap_caps_get_minimum_free_size(caps);
+  region["largest_block"] = largest;
+  region["fragmentation"] = free ? 100 - (int)(largest * 100 / free) : 0;
+}
+
+/**************************************************************************
+ * HEAP_Report
+ * - Publish the heap state: internal RAM and PSRAM, and the allocations
+ *   per subsystem (MQTT topic: gate/monitor/heap).
+ **************************************************************************/
+void HEAP_Report() {
+  StaticJsonDocument<HEAP_JSON_CAPACITY> doc;
+
+  HEAP_AddRegion(doc.createNestedObject("internal"), MALLOC_CAP_INTERNAL);
+  if (psramFound()) {
+    HEAP_AddRegion(doc.createNestedObject("psram"), MALLOC_CAP_SPIRAM);
+  }
+  JsonObject subsystems = doc.createNestedObject("subsystems");
+  for (HeapAccount & account : heapAccounts) {
+    JsonObject stat = subsystems.createNestedObject(account.name);
+    stat["current"] = account.current;
+    stat["peak"] = account.peak;
+    stat["allocs"] = account.allocs;
+    stat["frees"] = account.frees;
+    stat["failed"] = account.failed;
+    stat["retained"] = account.retained;
+    stat["scopes"] = account.scopes;
+  }
+  mqttPublishJson(topics[PUB_HEAP], doc);
+}
+
+/**************************************************************************
+ * PROF_Begin / PROF_End
+ * - Loop profiler probes: PROF_End charges the time since the previous
+ *   probe (CPU cycle counter, no system call) to a loop() section and
+ *   starts the next one.
+ * - A section over config.StallThreshold is remembered as stalled and
+ *   reported by PROFILE_Check, outside the timed sections.
+ **************************************************************************/
+inline void PROF_Begin() {
+  profiler.startCycles = ESP.getCycleCount();
+  profiler.startMs = millis();
+}
+
+void PROF_End(ProfSection section) {
+  ProfStats & stat = profSections[section];
+  uint32_t us = (ESP.getCycleCount() - profiler.startCycles) / ESP.getCpuFreqMHz();
+  unsigned long ms = millis() - profiler.startMs;
+
+  if (ms > 10000) {
+    us = ms * 1000;                                                 // The cycle counter may have wrapped
+  }
+  stat.count++;
+  stat.lastUs = us;
+  stat.maxUs = max(stat.maxUs, us);
+  stat.sumUs += us;
+  if (stat.stallCheck && config.StallThreshold > 0 && us > (uint32_t)config.StallThreshold * 1000) {
+    stat.stalls++;
+    profiler.stalled = section;
+    profiler.stallUs = us;
+  }
+  PROF_Begin();
+}
+
+/**************************************************************************
+ * PROFILE_Tasks
+ * - Per task: priority, state, free stack (high-water mark, bytes) and the
+ *   CPU use since the previous profile (% of one core, only when FreeRTOS
+ *   keeps run time stats: CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS).
+ * - Without the FreeRTOS trace facility only the app's own tasks are listed.
+ * - The task list is sized from the current number of tasks (a few spare
+ *   entries for tasks created meanwhile); uxTaskGetSystemState lists none
+ *   when the array is too small, then it is tried once more.
+ * - CPU use is tracked for the first PROFILE_MAX_TASKS tasks.
+ **************************************************************************/
+void PROFILE_Tasks(JsonArray tasks, bool restart) {
+#if configUSE_TRACE_FACILITY
+  static const char * const stateNames[] = { "running", "ready", "blocked", "suspended", "deleted" };
+  TaskStatus_t * status = NULL;
+  uint32_t total = 0;
+  UBaseType_t count = 0;
+
+  for (int attempt = 0; attempt < 2 && count == 0; attempt++) {
+    UBaseType_t size = uxTaskGetNumberOfTasks() + 4;
+    HEAP_Free(status);
+    status = (TaskStatus_t *)HEAP_Alloc(HEAP_MQTT, size * sizeof(TaskStatus_t), psramFound() ? MALLOC_CAP_SPIRAM : MALLOC_CAP_DEFAULT);
+    if (!status) {
+      Serial.println("\t---! Profile: no memory for the task list");
+      return;
+    }
+    count = uxTaskGetSystemState(status, size, &total);
+  }
+
+  for (UBaseType_t i = 0; i < count; i++) {
+    JsonObject task = tasks.createNestedObject();
+    task["name"] = status[i].pcTaskName;
+    task["prio"] = status[i].uxCurrentPriority;
+    task["state"] = (status[i].eCurrentState <= eDeleted) ? stateNames[status[i].eCurrentState] : "invalid";
+    task["stack_free"] = status[i].usStackHighWaterMark;
+#if configGENERATE_RUN_TIME_STATS
+    for (int t = 0; t < profiler.tasks; t++) {
+      if (profiler.taskNumber[t] == status[i].xTaskNumber && total != profiler.runTimeTotal) {
+        task["cpu %"] = (int)(100.0 * (status[i].ulRunTimeCounter - profiler.runTime[t]) / (total - profiler.runTimeTotal));
+        break;
+      }
+    }
+#endif
+  }
+#if configGENERATE_RUN_TIME_STATS
+  if (restart) {
+    profiler.tasks = min(count, (UBaseType_t)PROFILE_MAX_TASKS);
+    for (int i = 0; i < profiler.tasks; i++) {
+      profiler.taskNumber[i] = status[i].xTaskNumber;
+      profiler.runTime[i] = status[i].ulRunTimeCounter;
+    }
+    profiler.runTimeTotal = total;
+  }
+#endif
+  HEAP_Free(status);
+#else
+  struct { const char * name; TaskHandle_t handle; } known[] = {
+    { "loop", xTaskGetCurrentTaskHandle() }, { "capture", pipeCapture.task }, { "upload", pipeUpload.task },
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    { "ws", wsTask },
+#endif
+#if CLIP_RECORDER
+    { "clip", clip.task },
+#endif
+  };
+  for (auto & k : known) {
+    if (k.handle) {
+      JsonObject task = tasks.createNestedObject();
+      task["name"] = k.name;
+      task["stack_free"] = uxTaskGetStackHighWaterMark(k.handle);
+    }
+  }
+#endif
+}
+
+/**************************************************************************
+ * PROFILE_Report
+ * - Publish the profile (MQTT topic: gate/monitor/profile): tasks, loop()
+ *   sections (count, last/avg/max time, stalls) and the photo jobs in
+ *   progress. stall: what stalled (a stall report, NULL = "profile").
+ **************************************************************************/
+void PROFILE_Report(const char * stall, uint32_t stallUs) {
+  HeapJsonDocument doc(PROFILE_JSON_SIZE);
+  int64_t now = esp_timer_get_time();
+
+  if (stall) {
+    JsonObject info = doc.createNestedObject("stall");
+    info["section"] = stall;
+    info["ms"] = stallUs / 1000;
+    info["threshold"] = config.StallThreshold;
+  }
+  doc["interval_ms"] = (long)((now - profiler.reportedAt) / 1000);       // CPU use is over this interval
+  doc["task_count"] = uxTaskGetNumberOfTasks();
+  PROFILE_Tasks(doc.createNestedArray("tasks"), stall == NULL);
+
+  JsonObject loopStats = doc.createNestedObject("loop");
+  for (ProfStats & section : profSections) {
+    JsonObject stat = loopStats.createNestedObject(section.name);
+    stat["count"] = section.count;
+    stat["last us"] = section.lastUs;
+    stat["avg us"] = section.count ? (uint32_t)(section.sumUs / section.count) : 0;
+    stat["max us"] = section.maxUs;
+    stat["stalls"] = section.stalls;
+  }
+
+  // Photo jobs in progress, e.g. an upload stuck in esp_http_client_perform.
+  JsonObject jobs = doc.createNestedObject("busy");
+  for (PipeStage * stage : { &pipeCapture, &pipeUpload }) {
+    int64_t since = __atomic_load_n(&stage->busySince, __ATOMIC_RELAXED);
+    jobs[stage->name] = since > 0 ? (long)((now - since) / 1000) : 0;   // ms
+  }
+  doc["stall_reports"] = profiler.stallReports;
+  if (stall == NULL) {
+    profiler.reportedAt = now;
+  }
+  mqttPublishJson(topics[PUB_PROFILE], doc);
+}
+
+/**************************************************************************
+ * PROFILE_Check
+ * - Stall detector, once per loop: a loop() section (see PROF_End) or a
+ *   capture/upload job that took (is taking) longer than StallThreshold
+ *   publishes a profile with the stalled section. One report per stall.
+ **************************************************************************/
+void PROFILE_Check() {
+  const char * stall = NULL;
+  uint32_t stallUs = 0;
+
+  if (profiler.stalled >= 0) {
+    stall = profSections[profiler.stalled].name;
+    stallUs = profiler.stallUs;
+    profiler.stalled = -1;
+  }
+  PipeStage * stages[] = { &pipeCapture, &pipeUpload };
+  int64_t now = esp_timer_get_time();
+  for (int i = 0; i < 2 && config.StallThreshold > 0; i++) {
+    int64_t since = __atomic_load_n(&stages[i]->busySince, __ATOMIC_RELAXED);
+    if (since > 0 && since != profiler.pipeStalled[i] && now - since > (int64_t)config.StallThreshold * 1000) {
+      profiler.pipeStalled[i] = since;                              // Report this job once
+      stall = stages[i]->name;
+      stallUs = now - since;
+    }
+  }
+  if (!stall) {
+    return;
+  }
+
+  Serial.printf("Profile - Stall: %s took %ums\n", stall, stallUs / 1000);
+  profiler.stallReports++;
+  if (mqttClient.connected() && RL_Take(RL_TELEMETRY)) {
+    PROFILE_Report(stall, stallUs);
+  } else {
+    RL_Drop(RL_TELEMETRY);
+  }
+}
+
+/**************************************************************************
+ * fillState
+ * - Current app state and telemetry values (restart: start a new pipeline
+ *   statistics interval).
+ **************************************************************************/
+void fillState(JsonDocument& doc, bool restart) {
+  const int LEN = 30;
+  char startReason[LEN];
+  char UpTime[LEN];
+  long espTemperature = temperatureRead();
+  long UptimeSeconds = esp_timer_get_time()/1000/1000;
+  String ipAddress = WiFi.localIP().toString();
+
+  getRestartReason(startReason, LEN);
+  sprintf(UpTime, "%01.0fd%01.0f:%02.0f:%02.0f", floor(UptimeSeconds/86400.0), floor(fmod((UptimeSeconds/3600.0),24.0)), floor(fmod(UptimeSeconds,3600.0)/60.0), fmod(UptimeSeconds,60.0));
+
+  // Set the values in the document
+  doc["IP Address"] = ipAddress;                                  // device IP address
+  doc["RSSI (dBm)"] = WiFi.RSSI();                                // dBm value (negative)
+  doc["wifi"] = RSSItoPrecentage( WiFi.RSSI() );                  // dBm value converted to signal strength percentage
+  doc["Core Temperature (°C)"] = espTemperature;                  // ESP core temperature
+  doc["Uptime"] = UpTime;                                         // day.hours:minutes:seconds since last boot
+  doc["Start Reason"] = startReason;                              // reason for last restart
+  doc["Free Heap Memory"] = esp_get_free_heap_size();
+  doc["Min Free Heap"] = esp_get_minimum_free_heap_size();
+  doc["WiFi Reconnects"] = net.wifiReconnects;
+  doc["MQTT Reconnects"] = net.mqttReconnects;
+  doc["Last Downtime (s)"] = net.lastDowntime/1000;               // duration of the last WiFi/MQTT outage
+  doc["Total Downtime (s)"] = net.totalDowntime/1000;             // total WiFi/MQTT outage time since boot
+  doc["Offline Photos Spooled"] = photoSpool.spooled;             // photos taken offline, uploaded when back online
+  doc["Offline Photos Dropped"] = photoSpool.dropped;             // photos lost offline (spool full, no PSRAM)
+  doc["Offline Photos Waiting"] = photoSpool.count;
+  doc["MQTT Publish Failures"] = mqttPublishFailed;               // JSON publishes that could not be sent
+  doc["MQTT Oversize"] = mqttPublishOversize;                     // JSON payloads truncated or dropped for size
+  doc["Motion Sessions"] = motion.sessions;
+  doc["PIR Pulses"] = motion.pulses;
+  doc["PIR Pulse Rate (/min)"] = MOTION_PulseRate(esp_timer_get_time());
+  doc["PIR Pulse Width (ms)"] = (int)motion.pulseWidth;
+  doc["PIR Retriggers Suppressed"] = motion.suppressed;           // PIR retriggers without photo (PIR_delay, noise)
+  doc["Events Dropped"] = isrEvents.overflows + taskEvents.overflows;   // event ring(s) full, should stay 0
+  doc["Events Max Queued"] = max(isrEvents.highWater, taskEvents.highWater);
+  JsonObject rateDropped = doc.createNestedObject("Rate Limit Dropped");   // actions dropped per class
+  for (int i = 0; i < RL_CLASSES; i++) {
+    rateDropped[buckets[i].name] = buckets[i].dropped;
+  }
+  doc["Rate Limit Deferred"] = buckets[RL_MANUAL_PHOTO].deferred;
+  doc["Photos Pending"] = pendingPhotos;
+  doc["Boots"] = rtcState.boots;                                  // starts since power on (incl. deep sleep wakeups)
+  doc["PIR Wakeups"] = rtcState.wakeups;
+  doc["Awake (%)"] = POWER_AwakePercent();
+  doc["Est Current (mA)"] = POWER_AvgCurrent();                   // estimated average current since power on
+  if (rtcState.wakePhotos > 0) {
+    doc["Wake To Photo Last (ms)"] = rtcState.wakePhotoLast;      // PIR wakeup until the photo was uploaded
+    doc["Wake To Photo Avg (ms)"] = (uint32_t)(rtcState.wakePhotoSum / rtcState.wakePhotos);
+    doc["Wake To Photo Max (ms)"] = rtcState.wakePhotoMax;
+  }
+  if (config.LapseInterval > 0) {
+    doc["Time-lapse Frames"] = lapse.captured;
+    doc["Time-lapse Uploads"] = lapse.uploads;
+    doc["Time-lapse Deferred"] = lapse.deferrals;
+    doc["Time-lapse Skipped"] = lapse.skipped;
+    doc["Time-lapse Failed"] = lapse.failed;
+  }
+  if (freshStats.frames > 0) {
+    doc["Trigger To Exposure Last (ms)"] = freshStats.lastUs / 1000;   // fresh frame mode: trigger until the photo's exposure started
+    doc["Trigger To Exposure Avg (ms)"] = (long)(freshStats.sumUs / freshStats.frames / 1000);
+    doc["Trigger To Exposure Max (ms)"] = freshStats.maxUs / 1000;
+    doc["Stale Frames Drained"] = freshStats.drained;
+    doc["Frame Period (ms)"] = (long)(freshStats.framePeriod / 1000);
+  }
+  if (usableStats.photos > 0) {
+    doc["Trigger To Usable Last (ms)"] = usableStats.lastUs / 1000;   // trigger until the photo is out of the camera
+    doc["Trigger To Usable Avg (ms)"] = (long)(usableStats.sumUs / usableStats.photos / 1000);
+    doc["Trigger To Usable Max (ms)"] = usableStats.maxUs / 1000;
+  }
+  if (camSettings.night > 0) {
+    doc["Night Photos"] = night.photos;                             // flash photos
+    doc["Night Scene Luma"] = night.sceneLuma;                      // scene at the last trigger (0-255)
+    doc["Night Photo Luma"] = night.photoLuma;
+    doc["Night Exposure"] = night.aecValue;                         // learned, preloaded for the next night photo
+    doc["Night Gain"] = night.agcGain;
+    if (night.usable.photos > 0) {
+      doc["Night Frames Per Photo"] = (float)night.frames / night.photos;
+      doc["Night To Usable Avg (ms)"] = (long)(night.usable.sumUs / night.usable.photos / 1000);
+    }
+  }
+  if (streamClients > 0 || metrics.streamSavedFrames > 0) {
+    // Idle-scene suppression: bytes not streamed, per hour since the previous report (before PIPE_Report restarts it).
+    uint64_t saved = METRIC_Get(metrics.streamSavedBytes);
+    double hours = max((int64_t)1, esp_timer_get_time() - pipeReportedAt) / 3600000000.0;
+    doc["Stream Idle"] = streamsIdle.load();
+    doc["Stream Frames Saved"] = METRIC_Get(metrics.streamSavedFrames);
+    doc["Stream Saved (kB/h)"] = (long)((saved - streamSavedReported) / 1024 / hours);
+    doc["Stream Check (us)"] = streamCheckUs;
+    if (restart) {
+      streamSavedReported = saved;
+    }
+  }
+  PIPE_Report(doc.createNestedObject("Pipeline"), restart);      // per stage: busy %, jobs/min, queue use
+  doc["JPEG Quality"] = camSettings.quality;                      // current (possibly auto adjusted) JPEG quality
+  doc["Last Photo (bytes)"] = qualityCtl.lastSize;
+  if (config.DedupThreshold > 0) {
+    doc["Duplicates Skipped"] = photoHash.skipped;
+    doc["Hash Distance"] = photoHash.lastDistance;                // distance of the last photo to the last upload
+    doc["Hash Last (us)"] = photoHash.lastUs;                     // time to hash the last photo
+    doc["Hash Max (us)"] = photoHash.maxUs;
+  }
+  if (camSettings.roiMode == 1) {
+    doc["ROI Photos"] = roiStats.photos;
+    doc["ROI Failures"] = roiStats.failures;
+    doc["ROI Last (ms)"] = roiStats.lastMs;                       // decode/crop/encode time of the last photo
+    doc["ROI Max (ms)"] = roiStats.maxMs;
+    doc["ROI Last In/Out (bytes)"] = String(roiStats.lastIn) + "/" + String(roiStats.lastOut);
+  }
+
+/*
+  esp_chip_info_t espInfo;
+  esp_chip_info(&espInfo);
+  doc["ESP Core Count"] = espInfo.cores;
+  doc["ESP Model"] = espInfo.model;
+  doc["Revision"] = espInfo.revision;
+  doc["IDFversion"] = esp_get_idf_version();
+*/
+}
+
+/**************************************************************************
+ * reportState
+ * - Feedback the current app state and telemetry values.
+ **************************************************************************/
+void reportState() {
+  HeapJsonDocument doc(STATE_JSON_SIZE);
+
+  fillState(doc, true);
+  mqttPublishReport(topics[PUB_STATE], doc);
+}
+
+/**************************************************************************
+ * reportWiFi
+ * - Feedback the current WiFi RSSI value.
+ **************************************************************************/
+void reportWiFi() {
+
+  //mqttClient.publish( topics[PUB_WIFI], String( (WiFi.RSSI()+100)*2 ).c_str() );
+  mqttPublish( topics[PUB_WIFI], String( RSSItoPrecentage( WiFi.RSSI() ) ).c_str() );
+
+/*
+  StaticJsonDocument<124> doc;
+  // Set the values in the document
+  doc["RSSI (dBm)"] = WiFi.RSSI();                                // dBm value (negative)
+  doc["wifi"] = (WiFi.RSSI()+100)*2;                              // dBm value converted to signal strength percentage
+
+  char buffer[124];
+  serializeJson(doc, buffer);
+  mqttPublish(topics[PUB_WIFI], buffer);
+*/
+}
+
+/**************************************************************************
+ * CFG_Assign / CFG_Load / CFG_Set / CFG_Parse
+ * - Typed access to a registry field (CONFIG_FIELDS), picked by the type
+ *   of the Config member. CFG_Set (JSON) and CFG_Parse (command text) only
+ *   change the field if the value has the right type and is in range.
+ * - CFG_Parse scale: registry units per unit of the text (e.g. 1000 for a
+ *   command in seconds and a field in ms), applied before the range check.
+ **************************************************************************/
+void CFG_Assign(bool& field, bool value) { field = value; }
+void CFG_Assign(int& field, long value) { field = value; }
+template<size_t N> void CFG_Assign(char (&field)[N], const char * value) { strlcpy(field, value, N); }
+
+void CFG_Load(bool& field, JsonVariantConst value, bool def) { field = value | def; }
+void CFG_Load(int& field, JsonVariantConst value, long def) { field = value | (int)def; }
+template<size_t N> void CFG_Load(char (&field)[N], JsonVariantConst value, const char * def) { strlcpy(field, value | def, N); }
+
+bool CFG_Set(bool& field, JsonVariantConst value, long min, long max) {
+  if (!value.is<bool>()) return false;
+  field = value.as<bool>();
+  return true;
+}
+bool CFG_Set(int& field, JsonVariantConst value, long min, long max) {
+  if (!value.is<long>() || value.as<long>() < min || value.as<long>() > max) return false;
+  field = value.as<long>();
+  return true;
+}
+template<size_t N> bool CFG_Set(char (&field)[N], JsonVariantConst value, long min, long max) {
+  if (!value.is<const char *>() || strlen(value.as<const char *>()) >= N) return false;
+  strlcpy(field, value.as<const char *>(), N);
+  return true;
+}
+
+bool CFG_Parse(bool& field, const String& value, long min, long max, long scale) {
+  if (value != "true" && value != "false") return false;
+  field = (value == "true");
+  return true;
+}
+bool CFG_Parse(int& field, const String& value, long min, long max, long scale) {
+  int first = (value.length() > 0 && value.charAt(0) == '-') ? 1 : 0;
+  if (value.length() == first || value.length() - first > 9) return false;  // 9 digits: no overflow
+  for (int i = first; i < value.length(); i++) {
+    if (!isdigit(value.charAt(i))) return false;
+  }
+  long long scaled = (long long)value.toInt() * scale;
+  if (scaled < min || scaled > max) return false;
+  field = scaled;
+  return true;
+}
+template<size_t N> bool CFG_Parse(char (&field)[N], const String& value, long min, long max, long scale) {
+  if (value.length() >= N) return false;
+  strlcpy(field, value.c_str(), N);
+  return true;
+}
+
+/**************************************************************************
+ * CONFIG_Defaults / CONFIG_Load / CONFIG_Fill
+ * - Default, read (missing: default) and write the configuration; Fill
+ *   only writes the fields with one of the flags (CFG_PERSIST/CFG_REPORT).
+ **************************************************************************/
+void CONFIG_Defaults(Config& cfg) {
+#define CFG_DEFAULT(type, name, def, min, max, flags)  CFG_Assign(cfg.name, def);
+  CONFIG_FIELDS(CFG_DEFAULT)
+#undef CFG_DEFAULT
+}
+
+void CONFIG_Load(Config& cfg, JsonObjectConst doc) {
+#define CFG_LOAD(type, name, def, min, max, flags)     CFG_Load(cfg.name, doc[#name], def);
+  CONFIG_FIELDS(CFG_LOAD)
+#undef CFG_LOAD
+}
+
+void CONFIG_Fill(const Config& cfg, JsonDocument& doc, int only) {
+#define CFG_FILL(type, name, def, min, max, flags)     if ((flags) & only) doc[#name] = cfg.name;
+  CONFIG_FIELDS(CFG_FILL)
+#undef CFG_FILL
+}
+
+/**************************************************************************
+ * fillConfig
+ * - The general settings (that is currently in memory).
+ **************************************************************************/
+void fillConfig(JsonDocument& configDoc) {
+  CONFIG_Fill(config, configDoc, CFG_REPORT);
+  configDoc["ClientId"] = mqttClientId;
+}
+
+/**************************************************************************
+ * reportConfig
+ * - Feedback the general settings (that is currently in memory).
+ **************************************************************************/
+void reportConfig() {
+  StaticJsonDocument<CONFIG_JSON_CAPACITY> configDoc;
+
+  fillConfig(configDoc);
+  mqttPublishReport(topics[PUB_CONFIG], configDoc);
+}
+
+/**************************************************************************
+ * cam_FillSettings
+ * - The current settings and sensor status.
+ **************************************************************************/
+void cam_FillSettings(JsonDocument& doc) {
+  sensor_t * s = esp_camera_sensor_get();
+
+  doc["sensor"] = s->id.PID;
+  SETTINGS_Fill(camSettings, doc);
+  doc["framesize"] = s->status.framesize;                         // as in the sensor
+  doc["quality"] = s->status.quality;
+  for (int p = 0; p < CP_COUNT; p++) {
+    doc[camParamNames[p]] = cam_GetParam(s->status, p);
+  }
+  doc["profile"] = (const char *)camSettings.profile;
+}
+
+/**************************************************************************
+ * cam_ReportSettings
+ * - Give feedback on the current settings and sensor status.
+ **************************************************************************/
+void cam_ReportSettings() {
+  StaticJsonDocument<SETTINGS_JSON_CAPACITY> doc;
+
+  cam_FillSettings(doc);
+  mqttPublishReport(topics[PUB_CAMERA], doc);
+}
+
+/**************************************************************************
+ * WIRE_Measure
+ * - Payload size and the average time (over WIRE_BENCH_RUNS) to serialize
+ *   a report document: JSON, MessagePack, and MessagePack with short keys
+ *   (the time includes the key translation).
+ * - The documents are serialized for real (serializeJson/serializeMsgPack)
+ *   into a payload buffer of MQTT_MAX_PAYLOAD bytes, the bytes a publish
+ *   streams into the MQTT packet.
+ **************************************************************************/
+void WIRE_Measure(JsonObject result, const JsonDocument& doc, char * payload) {
+  HeapJsonDocument compact(doc.memoryUsage() + JSON_OBJECT_SIZE(4));
+  size_t len = 0;
+  int64_t start = esp_timer_get_time();
+
+  for (int i = 0; i < WIRE_BENCH_RUNS; i++) {
+    len = serializeJson(doc, payload, MQTT_MAX_PAYLOAD);
+  }
+  result["json_bytes"] = len;
+  result["json_us"] = (long)((esp_timer_get_time() - start) / WIRE_BENCH_RUNS);
+
+  start = esp_timer_get_time();
+  for (int i = 0; i < WIRE_BENCH_RUNS; i++) {
+    len = serializeMsgPack(doc, payload, MQTT_MAX_PAYLOAD);
+  }
+  result["msgpack_bytes"] = len;
+  result["msgpack_us"] = (long)((esp_timer_get_time() - start) / WIRE_BENCH_RUNS);
+
+  start = esp_timer_get_time();
+  for (int i = 0; i < WIRE_BENCH_RUNS; i++) {
+    compact.clear();
+    WIRE_Compact(doc.as<JsonObjectConst>(), compact.to<JsonObject>());
+    len = serializeMsgPack(compact, payload, MQTT_MAX_PAYLOAD);
+  }
+  result["compact_bytes"] = len;
+  result["compact_us"] = (long)((esp_timer_get_time() - start) / WIRE_BENCH_RUNS);
+}
+
+/**************************************************************************
+ * WIRE_Benchmark
+ * - Compare the wire formats on the state, config and camera settings
+ *   reports, result on gate/monitor/wire (JSON).
+ **************************************************************************/
+void WIRE_Benchmark() {
+  StaticJsonDocument<512> result;
+  HeapJsonDocument doc(STATE_JSON_SIZE);
+  char * payload = (char *)HEAP_Alloc(HEAP_MQTT, MQTT_MAX_PAYLOAD, MALLOC_CAP_DEFAULT);
+
+  if (!payload) {
+    Serial.println("\t---! Wire benchmark: no memory for the payload buffer");
+    return;
+  }
+  fillState(doc, false);
+  WIRE_Measure(result.createNestedObject("state"), doc, payload);
+  doc.clear();
+  fillConfig(doc);
+  WIRE_Measure(result.createNestedObject("config"), doc, payload);
+  doc.clear();
+  cam_FillSettings(doc);
+  WIRE_Measure(result.createNestedObject("settings"), doc, payload);
+  result["runs"] = WIRE_BENCH_RUNS;
+  HEAP_Free(payload);
+
+  mqttPublishJson(topics[PUB_WIRE], result);
+}
+
+/**************************************************************************
+ * WIRE_ReportKeys
+ * - Publish the short key table: the long key of each index (JSON array).
+ **************************************************************************/
+void WIRE_ReportKeys() {
+  HeapJsonDocument doc(JSON_ARRAY_SIZE(WIRE_KEYS));
+  JsonArray keys = doc.to<JsonArray>();
 
+  for (int i = 0; i < WIRE_KEYS; i++) {
+    keys.add(wireKeys[i]);
+  }
+  mqttPublishJson(topics[PUB_WIRE], doc);
 }
 
 /**************************************************************************
@@ -613,15 +2587,9 @@ void saveConfig() {
     File configFile = SPIFFS.open(CONFIGFILE, FILE_WRITE);
     if ( configFile ) {
       //Serial.println("SaveConfig: new config file created");
-      StaticJsonDocument<256> configDoc;
+      StaticJsonDocument<CONFIG_JSON_CAPACITY> configDoc;
       // Set the values in the document
-      configDoc["CAM_enabled"] = config.CAM_enabled;
-      configDoc["PIR_enabled"] = config.PIR_enabled;
-      configDoc["PIR_delay"] = config.PIR_delay;
-      configDoc["TempInterval"] = config.TempInterval;
-      configDoc["ReportState"] = config.ReportState;
-      configDoc["ReportWiFi"] = config.ReportWiFi;
-      configDoc["StateInterval"] = config.StateInterval;
+      CONFIG_Fill(config, configDoc, CFG_PERSIST);
 
       if (serializeJson(configDoc, configFile) == 0) {
         Serial.println(F("\t---! Failed to write to file"));
@@ -632,551 +2600,2996 @@ void saveConfig() {
     } else {
       Serial.println("\t---! SaveConfig: Failed to create file");
     }
-  } else {
-    Serial.println("\t---! SaveConfig: SPIFFS mount failed");
+  } else {
+    Serial.println("\t---! SaveConfig: SPIFFS mount failed");
+  }
+}
+
+/**************************************************************************
+ * img_JpegReader
+ * - esp_jpg_decode input callback: read from the JPEG in memory.
+ **************************************************************************/
+static uint32_t img_JpegReader(void * arg, size_t index, uint8_t *buf, size_t len) {
+  const camera_fb_t * fb = ((ImgDecode *)arg)->fb;
+  if (index + len > fb->len) {
+    len = fb->len - index;
+  }
+  if (buf) {
+    memcpy(buf, fb->buf + index, len);
+  }
+  return len;
+}
+
+/**************************************************************************
+ * img_Decode
+ * - Decode a JPEG frame (optionally scaled 1/2, 1/4 or 1/8) and hand the
+ *   pixel blocks (BGR888) to the given writer.
+ **************************************************************************/
+static bool img_Decode(ImgDecode * dec, jpg_scale_t scale, jpg_writer_cb writer) {
+  if (dec->fb->format != PIXFORMAT_JPEG) {
+    return false;
+  }
+  return esp_jpg_decode(dec->fb->len, scale, img_JpegReader, writer, dec) == ESP_OK;
+}
+
+/**************************************************************************
+ * img_RoiWriter
+ * - esp_jpg_decode output callback: keep only the pixels inside the ROI.
+ **************************************************************************/
+static bool img_RoiWriter(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+  ImgDecode * dec = (ImgDecode *)arg;
+
+  if (data) {
+    IMG_RoiCopy(&dec->roi, dec->rgb, x, y, w, h, data);
+  }
+  return true;
+}
+
+/**************************************************************************
+ * img_CropRoi
+ * - Crop (and optionally downscale) a JPEG frame to the region of interest.
+ * - Decodes directly into an ROI sized buffer, then re-encodes to JPEG.
+ * - On success the caller must free() *out.
+ * - The crop time and sizes go to *stats, for roiStats (photo_Results).
+ **************************************************************************/
+static bool img_CropRoi(const camera_fb_t * fb, uint8_t ** out, size_t * outLen, PhotoUpload * stats) {
+  int64_t started = esp_timer_get_time();
+  ImgDecode dec;
+  bool ok = false;
+
+  memset(&dec, 0, sizeof(dec));
+  dec.fb = fb;
+  if (!IMG_RoiRect(fb->width >> camSettings.roiScale, fb->height >> camSettings.roiScale,
+                   camSettings.roiX, camSettings.roiY, camSettings.roiW, camSettings.roiH, &dec.roi)) {
+    return false;
+  }
+  dec.roi.w &= ~1;                                  // Even size for the encoder
+  dec.roi.h &= ~1;
+
+  size_t rgbLen = dec.roi.w * dec.roi.h * 3;
+  dec.rgb = (uint8_t *)HEAP_Alloc(HEAP_CAMERA, rgbLen, psramFound() ? MALLOC_CAP_SPIRAM : MALLOC_CAP_DEFAULT);
+  if (!dec.rgb) {
+    Serial.printf("\t---! ROI: no memory for %u bytes\n", rgbLen);
+    return false;
+  }
+  if (img_Decode(&dec, (jpg_scale_t)camSettings.roiScale, img_RoiWriter)) {
+    ok = fmt2jpg(dec.rgb, rgbLen, dec.roi.w, dec.roi.h, PIXFORMAT_RGB888, CAM_ROI_JPEG_QUALITY, out, outLen);
+  }
+  HEAP_Free(dec.rgb);
+
+  stats->roiMs = (esp_timer_get_time() - started) / 1000;
+  stats->roiIn = fb->len;
+  stats->roi = ok ? 1 : -1;
+  if (ok) {
+    stats->roiOut = *outLen;
+    Serial.printf("\t- ROI: %ux%u %u -> %u bytes in %lums\n", dec.roi.w, dec.roi.h, fb->len, *outLen, stats->roiMs);
+  }
+  return ok;
+}
+
+/**************************************************************************
+ * img_HashWriter
+ * - esp_jpg_decode output callback: accumulate luminance of the pixels in the
+ *   hash window into an 8x8 grid of cells.
+ **************************************************************************/
+static bool img_HashWriter(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+  ImgDecode * dec = (ImgDecode *)arg;
+
+  if (data) {
+    IMG_GridAdd(&dec->grid, dec->roi.x, dec->roi.y, dec->roi.w, dec->roi.h, x, y, w, h, data);
+  }
+  return true;
+}
+
+/**************************************************************************
+ * img_Cells
+ * - Average luminance of each cell of an 8x8 grid over the frame (or the
+ *   ROI): a small signature of the scene.
+ * - The frame is decoded at 1/8 scale, i.e. only the DC coefficient of each
+ *   JPEG block is used, which keeps this cheap.
+ **************************************************************************/
+static bool img_Cells(const camera_fb_t * fb, bool roi, uint8_t cells[64]) {
+  ImgDecode dec;
+
+  memset(&dec, 0, sizeof(dec));
+  dec.fb = fb;
+  int frameW = (fb->width + 7) / 8;
+  int frameH = (fb->height + 7) / 8;
+  if (roi) {
+    IMG_RoiRect(frameW, frameH, camSettings.roiX, camSettings.roiY, camSettings.roiW, camSettings.roiH, &dec.roi);
+  } else {
+    dec.roi.w = frameW;
+    dec.roi.h = frameH;
+  }
+  if (dec.roi.w < 8 || dec.roi.h < 8 || !img_Decode(&dec, JPG_SCALE_8X, img_HashWriter)) {
+    return false;
+  }
+  IMG_GridCells(&dec.grid, cells);
+  return true;
+}
+
+/**************************************************************************
+ * img_Hash
+ * - Average hash (aHash) of a JPEG frame: one bit per cell of an 8x8 grid,
+ *   set when the cell is brighter than the whole image.
+ * - When photos are cropped (roi_mode 1) only the ROI is hashed.
+ **************************************************************************/
+static bool img_Hash(const camera_fb_t * fb, uint64_t * hash) {
+  uint8_t cells[64];
+
+  if (!img_Cells(fb, camSettings.roiMode == 1, cells)) {
+    return false;
+  }
+  *hash = IMG_HashCells(cells);
+  return true;
+}
+
+/**************************************************************************
+ * STREAM_Changed
+ * - Did the scene change since the last frame sent? The JPEG size is
+ *   checked first (free); only frames of about the same size are decoded
+ *   (1/8 scale) and their cell luminances compared.
+ * - A frame whose size already shows a change is not decoded: *decoded is
+ *   false and the next frame sent is the size-only reference.
+ **************************************************************************/
+bool STREAM_Changed(StreamIdle * state, const camera_fb_t * fb, uint8_t cells[64], bool * decoded) {
+  int64_t started = esp_timer_get_time();
+  bool changed = true;
+
+  *decoded = false;
+  if (!state->valid || abs((long)fb->len - (long)state->refLen) * 100 > (long)state->refLen * STREAM_IDLE_SIZE_DELTA) {
+    return true;
+  }
+  if (!img_Cells(fb, false, cells)) {
+    return true;
+  }
+  *decoded = true;
+  if (state->cellsValid) {
+    changed = IMG_CellsChanged(cells, state->refCells, STREAM_IDLE_LUMA_DELTA);
+  }
+  streamCheckUs = esp_timer_get_time() - started;
+  return changed;
+}
+
+/**************************************************************************
+ * STREAM_Skip
+ * - Idle-scene suppression: true if this stream frame can be dropped.
+ * - After STREAM_IDLE_AFTER ms without a change the stream goes idle and
+ *   only sends a keep-alive frame every STREAM_KEEPALIVE ms. The first
+ *   changed frame is sent right away and the stream is back at full rate.
+ **************************************************************************/
+bool STREAM_Skip(StreamIdle * state, const camera_fb_t * fb) {
+  int64_t now = esp_timer_get_time();
+  uint8_t cells[64];
+  bool decoded;
+
+  if (!config.StreamIdle || fb->format != PIXFORMAT_JPEG) {
+    return false;
+  }
+  bool changed = STREAM_Changed(state, fb, cells, &decoded);
+  if (changed) {
+    state->changedAt = now;
+    if (state->idle) {
+      state->idle = false;
+      streamsIdle--;
+    }
+  } else if (!state->idle && now - state->changedAt >= (int64_t)STREAM_IDLE_AFTER * 1000) {
+    state->idle = true;
+    streamsIdle++;
+  }
+
+  if (state->idle && now - state->sentAt < (int64_t)STREAM_KEEPALIVE * 1000) {
+    METRIC_Add(metrics.streamSavedFrames);
+    METRIC_Add(metrics.streamSavedBytes, (uint64_t)fb->len);
+    return true;
+  }
+  // Sent: the reference for the next frames.
+  state->valid = true;
+  state->refLen = fb->len;
+  state->cellsValid = decoded;
+  if (decoded) {
+    memcpy(state->refCells, cells, sizeof(state->refCells));
+  }
+  state->sentAt = now;
+  return false;
+}
+
+/**************************************************************************
+ * STREAM_End
+ * - A stream stopped: it no longer counts as idle.
+ **************************************************************************/
+void STREAM_End(StreamIdle * state) {
+  if (state->idle) {
+    state->idle = false;
+    streamsIdle--;
+  }
+}
+
+/**************************************************************************
+ * cam_StreamHandler
+ * - 
+ **************************************************************************/
+static esp_err_t cam_StreamHandler(httpd_req_t *req) {
+  camera_fb_t * fb = NULL;
+  esp_err_t res = ESP_OK;
+  size_t _jpg_buf_len = 0;
+  uint8_t * _jpg_buf = NULL;
+  char * part_buf[64];
+
+  Serial.println("Camera StreamHandler started");
+
+  res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
+  if (res != ESP_OK) {
+    return res;
+  }
+  
+  streamClients++;                                  // Keeps the device awake in low-power mode
+  size_t heapBefore = HEAP_Begin();
+  StreamIdle idle = {};
+
+  // loop until web server is stopped (MQTT video toggle) ...
+//  while (runWebServer) {
+
+  while (true) {
+    int64_t frameStart = esp_timer_get_time();
+    size_t hlen = 0;
+    if (!CAM_Enter()) {
+      vTaskDelay(pdMS_TO_TICKS(STREAM_IDLE_CHECK));                     // Camera being re-initialized
+      continue;
+    }
+    fb = esp_camera_fb_get();
+    if (fb && STREAM_Skip(&idle, fb)) {
+      esp_camera_fb_return(fb);                                         // Scene unchanged, nothing new to show
+      CAM_Leave();
+      fb = NULL;
+      vTaskDelay(pdMS_TO_TICKS(STREAM_IDLE_CHECK));
+      continue;
+    }
+    if (!fb) {
+      Serial.println("\t---! SH: Camera capture failed");
+      res = ESP_FAIL;
+    } else {
+      METRIC_Add(metrics.frames[FRAME_STREAM]);
+      if (fb->width > 400) {
+        if (fb->format != PIXFORMAT_JPEG) {
+          bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
+          esp_camera_fb_return(fb);
+          fb = NULL;
+          if (!jpeg_converted) {
+            Serial.println("\t---! SH: JPEG compression failed");
+            res = ESP_FAIL;
+          } else {
+            HEAP_Track(HEAP_STREAM, _jpg_buf_len);
+          }
+        } else {
+          _jpg_buf_len = fb->len;
+          _jpg_buf = fb->buf;
+        }
+      }
+    }
+    if (res == ESP_OK) {
+      hlen = snprintf((char *)part_buf, 64, _STREAM_PART, _jpg_buf_len);
+      res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+    }
+    if (res == ESP_OK) {
+      res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
+    }
+    if (res == ESP_OK) {
+      res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+    }
+    if (fb) {
+      esp_camera_fb_return(fb);
+      fb = NULL;
+      _jpg_buf = NULL;
+    } else if (_jpg_buf) {
+      free(_jpg_buf);
+      HEAP_Track(HEAP_STREAM, -(int32_t)_jpg_buf_len);
+      _jpg_buf = NULL;
+    }
+    CAM_Leave();
+    if (res != ESP_OK) {
+      break;
+    }
+    METRIC_Add(metrics.streamFrames);
+    METRIC_Add(metrics.streamBytes, (uint64_t)(hlen + _jpg_buf_len + strlen(_STREAM_BOUNDARY)));
+    PIPE_Done(&pipeStream, frameStart);
+    //Serial.printf("MJPG: %uB\n",(uint32_t)(_jpg_buf_len));
+  }
+
+  STREAM_End(&idle);
+  streamClients--;
+  HEAP_End(HEAP_STREAM, heapBefore);
+  Serial.println("- SH: StreamHandler stopped");
+  return res;
+}
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+/**************************************************************************
+ * WS_Find / WS_Remove
+ * - Client slot of a socket (NULL: none), free a client slot. Web server
+ *   task only.
+ **************************************************************************/
+WsClient * WS_Find(int fd) {
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (wsClients[i].fd == fd) return &wsClients[i];
+  }
+  return NULL;
+}
+
+void WS_Remove(WsClient * client) {
+  Serial.printf("- WS: client %d gone (%u frames, ack %lldms avg)\n", client->fd, client->frames,
+                client->acks ? client->ackUsSum / client->acks / 1000 : 0);
+  client->fd = -1;
+  streamClients--;
+  if (--wsClientCount == 0 && wsQuality >= 0) {
+    wsQuality = -1;
+    cam_SetQuality();                                                     // Back to the photo quality
+  }
+}
+
+/**************************************************************************
+ * WS_Due
+ * - Wait (us) until a client can take the next frame: 0 = now, -1 = no
+ *   client has credits left (wait for an ack).
+ **************************************************************************/
+int64_t WS_Due(int64_t now) {
+  int64_t wait = -1;
+
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    WsClient * client = &wsClients[i];
+    if (client->fd < 0 || client->credits <= 0) continue;
+    int64_t due = max((int64_t)0, client->nextFrame - now);
+    wait = (wait < 0) ? due : min(wait, due);
+  }
+  return wait;
+}
+
+/**************************************************************************
+ * WS_SendWork
+ * - Send the captured frame (wsFrame) as a binary message to each client
+ *   that is due and has a credit. Runs in the web server task (queued by
+ *   WS_Task), then hands the frame back.
+ **************************************************************************/
+void WS_SendWork(void * arg) {
+  camera_fb_t * fb = wsFrame;
+  int64_t now = esp_timer_get_time();
+  httpd_ws_frame_t frame = {};
+
+  frame.type = HTTPD_WS_TYPE_BINARY;
+  frame.final = true;
+  frame.payload = fb->buf;
+  frame.len = fb->len;
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    WsClient * client = &wsClients[i];
+    if (client->fd < 0) continue;
+    if (httpd_ws_get_fd_info(stream_httpd, client->fd) != HTTPD_WS_CLIENT_WEBSOCKET) {
+      WS_Remove(client);                                                  // Closed by the client
+      continue;
+    }
+    if (client->credits <= 0 || client->nextFrame > now) continue;
+    if (httpd_ws_send_frame_async(stream_httpd, client->fd, &frame) != ESP_OK) {
+      WS_Remove(client);
+      continue;
+    }
+    client->sentAt[(client->sentHead + client->inFlight) % WS_MAX_CREDITS] = esp_timer_get_time();
+    client->inFlight++;
+    client->credits--;
+    client->nextFrame = max(client->nextFrame + 1000000 / client->fps, now);
+    client->frames++;
+    METRIC_Add(metrics.streamFrames);
+    METRIC_Add(metrics.streamBytes, (uint64_t)fb->len);
+  }
+  int done = 1;
+  xQueueSend(wsDone, &done, 0);
+}
+
+/**************************************************************************
+ * WS_Task
+ * - Sender task: capture a frame when a client is due and has a credit,
+ *   and let the web server task send it. Idle without clients/credits.
+ **************************************************************************/
+void WS_Task(void * param) {
+  StreamIdle idle = {};
+  int done;
+
+  for (;;) {
+    int64_t wait = (wsClientCount > 0) ? WS_Due(esp_timer_get_time()) : -1;
+    if (wsClientCount == 0) {
+      STREAM_End(&idle);
+    }
+    if (wait != 0) {
+      // Nothing to send: wait for the frame time, or a client/ack (WS_Handler).
+      ulTaskNotifyTake(pdTRUE, (wait < 0) ? portMAX_DELAY : pdMS_TO_TICKS(wait / 1000 + 1));
+      continue;
+    }
+    int64_t frameStart = esp_timer_get_time();
+    if (!CAM_Enter()) {
+      vTaskDelay(pdMS_TO_TICKS(STREAM_IDLE_CHECK));                       // Camera being re-initialized
+      continue;
+    }
+    camera_fb_t * fb = esp_camera_fb_get();
+    if (!fb) {
+      CAM_Leave();
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
+    }
+    METRIC_Add(metrics.frames[FRAME_STREAM]);
+    if (STREAM_Skip(&idle, fb)) {
+      esp_camera_fb_return(fb);                                           // Scene unchanged, nothing new to show
+      CAM_Leave();
+      vTaskDelay(pdMS_TO_TICKS(STREAM_IDLE_CHECK));
+      continue;
+    }
+    if (fb->format == PIXFORMAT_JPEG) {
+      wsFrame = fb;
+      if (httpd_queue_work(stream_httpd, WS_SendWork, NULL) == ESP_OK) {
+        xQueueReceive(wsDone, &done, portMAX_DELAY);
+        PIPE_Done(&pipeStream, frameStart);
+      } else {
+        vTaskDelay(pdMS_TO_TICKS(100));                                   // Web server stopped
+      }
+    }
+    esp_camera_fb_return(fb);
+    CAM_Leave();
+  }
+}
+
+/**************************************************************************
+ * WS_Command
+ * - Text message from a client:
+ *   - "ack"            : a frame was received (and shown), one more credit
+ *   - "credit:<n>"     : n more credits (frames in flight, WS_MAX_CREDITS)
+ *   - "fps:<n>"        : frame rate for this client (1-30)
+ *   - "quality:<n>"    : JPEG quality while streaming (sensor, 4-63), photos
+ *                        and clips keep the photo quality (cam_SetQuality)
+ **************************************************************************/
+void WS_Command(WsClient * client, const char * command) {
+  int value;
+
+  if (strcmp(command, "ack") == 0) {
+    if (client->inFlight > 0) {
+      // Ack latency: from sending the oldest frame in flight to its ack.
+      int64_t latency = esp_timer_get_time() - client->sentAt[client->sentHead];
+      client->sentHead = (client->sentHead + 1) % WS_MAX_CREDITS;
+      client->inFlight--;
+      client->ackUsLast = latency;
+      client->ackUsMax = max(client->ackUsMax, latency);
+      client->ackUsSum += latency;
+      client->acks++;
+    }
+    client->credits = min(client->credits + 1, WS_MAX_CREDITS - client->inFlight);
+  } else if (sscanf(command, "credit:%d", &value) == 1) {
+    client->credits = constrain(client->credits + value, 0, WS_MAX_CREDITS - client->inFlight);
+  } else if (sscanf(command, "fps:%d", &value) == 1) {
+    client->fps = constrain(value, 1, 30);
+  } else if (sscanf(command, "quality:%d", &value) == 1) {
+    wsQuality = constrain(value, 4, 63);
+    cam_SetQuality();                                                     // Not while a photo or clip is captured
+  } else {
+    Serial.print("- WS: unknown command "); Serial.println(command);
+  }
+}
+
+/**************************************************************************
+ * WS_Handler
+ * - "/ws": WebSocket video stream, one binary message per JPEG frame.
+ * - Flow control: a frame is only sent while the client has credits.
+ *   Each "ack" returns one, so at most WS_MAX_CREDITS frames are ever in
+ *   flight and frames don't pile up in the socket buffers.
+ **************************************************************************/
+static esp_err_t WS_Handler(httpd_req_t *req) {
+  int fd = httpd_req_to_sockfd(req);
+
+  if (req->method == HTTP_GET) {
+    // Handshake: a new client.
+    WsClient * client = WS_Find(-1);
+    if (!client || !wsTask) {
+      Serial.println("\t---! WS: too many clients");
+      return ESP_FAIL;
+    }
+    memset(client, 0, sizeof(WsClient));
+    client->fd = fd;
+    client->credits = WS_INITIAL_CREDITS;
+    client->fps = WS_DEFAULT_FPS;
+    client->nextFrame = esp_timer_get_time();
+    wsClientCount++;
+    streamClients++;                                                      // Keeps the device awake in low-power mode
+    Serial.printf("- WS: client %d connected\n", fd);
+    xTaskNotifyGive(wsTask);
+    return ESP_OK;
+  }
+
+  char text[32];
+  httpd_ws_frame_t frame = {};
+  esp_err_t res = httpd_ws_recv_frame(req, &frame, 0);                    // Get the length
+  if (res != ESP_OK || frame.len >= sizeof(text)) {
+    return ESP_FAIL;                                                      // Not a command: close
+  }
+  frame.payload = (uint8_t *)text;
+  res = httpd_ws_recv_frame(req, &frame, sizeof(text) - 1);
+  if (res != ESP_OK) {
+    return res;
+  }
+  text[frame.len] = 0;
+  WsClient * client = WS_Find(fd);
+  if (client && frame.type == HTTPD_WS_TYPE_TEXT) {
+    WS_Command(client, text);
+    xTaskNotifyGive(wsTask);                                              // Maybe a frame can go now
+  }
+  return ESP_OK;
+}
+
+/**************************************************************************
+ * WS_Closed
+ * - Web server close function (httpd close_fn): a socket is closed, free
+ *   its client slot. Also a client waiting for an ack (no credits) is
+ *   removed right away, WS_SendWork only sees the clients it sends to.
+ **************************************************************************/
+void WS_Closed(httpd_handle_t server, int fd) {
+  WsClient * client = WS_Find(fd);
+
+  if (client) {
+    WS_Remove(client);
+    xTaskNotifyGive(wsTask);
+  }
+  close(fd);                                                              // close_fn replaces the server's own close
+}
+
+/**************************************************************************
+ * WS_Start
+ * - Start the WebSocket stream sender task.
+ **************************************************************************/
+bool WS_Start() {
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    wsClients[i].fd = -1;
+  }
+  wsDone = xQueueCreate(1, sizeof(int));
+  return wsDone && xTaskCreatePinnedToCore(WS_Task, "ws", WS_STACK, NULL, 2, &wsTask, PIPE_UPLOAD_CORE) == pdPASS;
+}
+#endif
+
+#if CLIP_RECORDER
+/**************************************************************************
+ * CLIP_Number
+ * - Number of a clip file name ("clip0042.avi" -> 42), -1 if not a clip.
+ **************************************************************************/
+int CLIP_Number(const char * name) {
+  const char * base = strrchr(name, '/');
+  base = base ? base + 1 : name;
+  if (strlen(base) != 12 || strncmp(base, "clip", 4) != 0 || strcmp(base + 8, ".avi") != 0) {
+    return -1;
+  }
+  for (int i = 4; i < 8; i++) {
+    if (!isdigit(base[i])) return -1;
+  }
+  return atoi(base + 4);
+}
+
+/**************************************************************************
+ * CLIP_MakeRoom
+ * - Delete the oldest clips until CLIP_MIN_FREE is free on the SD card.
+ **************************************************************************/
+void CLIP_MakeRoom() {
+  char path[32];
+
+  while (clip.oldest <= clip.newest && SD_MMC.totalBytes() - SD_MMC.usedBytes() < CLIP_MIN_FREE) {
+    snprintf(path, sizeof(path), CLIP_DIR "/clip%04d.avi", clip.oldest++);
+    if (SD_MMC.remove(path)) {
+      Serial.print("\t- Clip deleted (card full): "); Serial.println(path);
+    }
+  }
+}
+
+/**************************************************************************
+ * CLIP_Path
+ * - SD card path of a clip: the recording ("clipNNNN.tmp") or the finished
+ *   clip ("clipNNNN.avi", its name).
+ **************************************************************************/
+void CLIP_Path(char * path, size_t size, const char * name, bool recording) {
+  snprintf(path, size, CLIP_DIR "/%.8s%s", name, recording ? ".tmp" : ".avi");
+}
+
+/**************************************************************************
+ * CLIP_Open
+ * - Create the next clip file and write a placeholder header.
+ **************************************************************************/
+bool CLIP_Open() {
+  char path[32];
+  uint8_t header[AVI_HEADER_SIZE];
+
+  CLIP_MakeRoom();
+  memset(&clip.current, 0, sizeof(clip.current));
+  snprintf(clip.current.name, sizeof(clip.current.name), "clip%04d.avi", clip.newest + 1);
+  CLIP_Path(path, sizeof(path), clip.current.name, true);
+  clip.file = SD_MMC.open(path, FILE_WRITE);
+  if (!clip.file) {
+    Serial.print("\t---! Clip: cannot create "); Serial.println(path);
+    return false;
+  }
+  clip.newest++;
+  clip.moviSize = 0;
+  sensor_t * s = esp_camera_sensor_get();
+  clip.current.framesize = s ? s->status.framesize : FRAMESIZE_INVALID;
+  AVI_Header(header, clip.current, config.ClipFps, 0, 0);
+  return clip.file.write(header, sizeof(header)) == sizeof(header);
+}
+
+/**************************************************************************
+ * CLIP_WriteFrame
+ * - Append a JPEG frame ('00dc' chunk) and add it to the index.
+ **************************************************************************/
+bool CLIP_WriteFrame(const camera_fb_t * fb) {
+  static const uint8_t pad = 0;
+  uint8_t head[8];
+  ClipInfo * info = &clip.current;
+
+  AVI_Put32(AVI_PutId(head, "00dc"), fb->len);
+  int64_t start = esp_timer_get_time();
+  if (clip.file.write(head, sizeof(head)) != sizeof(head) || clip.file.write(fb->buf, fb->len) != fb->len ||
+      ((fb->len & 1) && clip.file.write(&pad, 1) != 1)) {                 // Chunks are padded to an even size
+    Serial.println("\t---! Clip: SD card write failed");
+    return false;
+  }
+  uint32_t us = esp_timer_get_time() - start;
+
+  if (info->frames == 0) {
+    info->width = fb->width;
+    info->height = fb->height;
+  }
+  AVI_AddFrame(info, clip.index, &clip.moviSize, fb->len);
+
+  if (info->framesize < FRAMESIZE_INVALID) {
+    ClipWriteStats * stats = &clipStats[info->framesize];
+    stats->width = fb->width;
+    stats->height = fb->height;
+    stats->frames++;
+    stats->bytes += fb->len;
+    stats->writeUs += us;
+    stats->slowestUs = max(stats->slowestUs, us);
+  }
+  return true;
+}
+
+/**************************************************************************
+ * CLIP_Close
+ * - Append the index (idx1) from the preallocated array and close the file.
+ * - Then the header gets the final sizes, frame count and measured frame
+ *   rate: the closed file is opened again to overwrite its first bytes (the
+ *   recording never seeks back), and renamed to the clip name.
+ **************************************************************************/
+void CLIP_Close() {
+  uint8_t buf[8 + 16 * 32];                                               // idx1 written 32 entries at a time
+  ClipInfo * info = &clip.current;
+  uint32_t indexSize = AVI_IndexSize(info->frames);
+  bool ok = true;
+
+  AVI_Put32(AVI_PutId(buf, "idx1"), 16 * info->frames);
+  size_t used = 8;
+  for (uint32_t i = 0; i < info->frames && ok; i++) {
+    AVI_IndexEntry(buf + used, clip.index[2 * i], clip.index[2 * i + 1]);
+    used += 16;
+    if (used + 16 > sizeof(buf) || i == info->frames - 1) {
+      ok = (clip.file.write(buf, used) == used);
+      used = 0;
+    }
+  }
+  if (info->frames == 0) {
+    ok = (clip.file.write(buf, 8) == 8);
+  }
+
+  clip.file.close();
+
+  char path[32], finished[32];
+  uint8_t header[AVI_HEADER_SIZE];
+  CLIP_Path(path, sizeof(path), info->name, true);
+  CLIP_Path(finished, sizeof(finished), info->name, false);
+  AVI_Header(header, *info, config.ClipFps, clip.moviSize, indexSize);
+  if (ok) {
+    File file = SD_MMC.open(path, "r+");                                  // Update in place, from the start
+    ok = file && file.write(header, sizeof(header)) == sizeof(header);
+    if (file) file.close();
+  }
+  ok = ok && SD_MMC.rename(path, finished);
+  info->bytes = AVI_HEADER_SIZE + clip.moviSize + indexSize;
+  if (!ok) {
+    Serial.println("\t---! Clip: SD card write failed (index/header)");
+  }
+}
+
+/**************************************************************************
+ * CLIP_Task
+ * - Recorder task: records a clip each time it is triggered (CLIP_Trigger),
+ *   at ClipFps until the recording time is over.
+ **************************************************************************/
+void CLIP_Task(void * param) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (!CLIP_Open()) {
+      clip.failed++;
+      clipRecording = false;
+      continue;
+    }
+    Serial.print("Clip - Recording "); Serial.println(clip.current.name);
+    int64_t qualityAt = cam_SetQuality(1) ? esp_timer_get_time() : 0;   // Photo quality, not a stream's
+
+    TickType_t wake = xTaskGetTickCount();
+    int64_t first = 0;
+    int64_t last = 0;
+    bool ok = true;
+    while (ok && (int32_t)(clip.until - millis()) > 0 && clip.current.frames < CLIP_MAX_FRAMES) {
+      camera_fb_t * fb = esp_camera_fb_get();
+      if (fb) {
+        METRIC_Add(metrics.frames[FRAME_CLIP]);
+        if (fb->format == PIXFORMAT_JPEG && cam_FrameTime(fb) >= qualityAt) {
+          ok = CLIP_WriteFrame(fb);
+          last = cam_FrameTime(fb);
+          if (first == 0) first = last;
+        }
+        esp_camera_fb_return(fb);
+      }
+      vTaskDelayUntil(&wake, pdMS_TO_TICKS(1000 / constrain(config.ClipFps, 1, 25)));
+    }
+    cam_SetQuality(-1);
+    clip.current.durationMs = (last - first) / 1000;
+    CLIP_Close();
+    if (ok) clip.recorded++; else clip.failed++;
+    xQueueSend(clip.results, &clip.current, 0);
+    clipRecording = false;
+  }
+}
+
+/**************************************************************************
+ * CLIP_Trigger / CLIP_Extend
+ * - Start recording for at least ms (Trigger), or keep a running recording
+ *   going for at least ms (Extend). From the loop.
+ **************************************************************************/
+void CLIP_Trigger(uint32_t ms) {
+  if (!clip.mounted || ms == 0) {
+    return;
+  }
+  uint32_t until = millis() + ms;
+  if (clipRecording) {
+    if ((int32_t)(until - clip.until) > 0) clip.until = until;
+    return;
+  }
+  clip.until = until;
+  clipRecording = true;
+  xTaskNotifyGive(clip.task);
+}
+
+void CLIP_Extend(uint32_t ms) {
+  if (clipRecording) {
+    CLIP_Trigger(ms);
+  }
+}
+
+/**************************************************************************
+ * CLIP_Results
+ * - Report the finished clips (MQTT, from the loop only).
+ **************************************************************************/
+void CLIP_Results() {
+  ClipInfo info;
+
+  while (clip.results && xQueueReceive(clip.results, &info, 0) == pdTRUE) {
+    StaticJsonDocument<256> doc;
+    doc["event"] = "clip";
+    doc["name"] = info.name;
+    doc["frames"] = info.frames;
+    doc["duration_ms"] = info.durationMs;
+    doc["fps"] = (info.durationMs > 0) ? (info.frames - 1) * 1000.0f / info.durationMs : 0;
+    doc["bytes"] = info.bytes;
+    doc["width"] = info.width;
+    doc["height"] = info.height;
+    mqttPublishJson(topics[PUB_CLIP], doc);
+  }
+}
+
+/**************************************************************************
+ * CLIP_Report
+ * - Publish the recorder state and the SD card write rate per frame size
+ *   (sustained frames per second the card takes, without the camera).
+ **************************************************************************/
+void CLIP_Report() {
+  HeapJsonDocument doc(1024);
+
+  doc["mounted"] = clip.mounted;
+  if (clip.mounted) {
+    doc["card_mb"] = (uint32_t)(SD_MMC.totalBytes() >> 20);
+    doc["used_mb"] = (uint32_t)(SD_MMC.usedBytes() >> 20);
+    doc["clips"] = max(0, clip.newest - clip.oldest + 1);
+  }
+  doc["recording"] = (bool)clipRecording;
+  doc["recorded"] = clip.recorded;
+  doc["failed"] = clip.failed;
+  JsonArray write = doc.createNestedArray("write");
+  for (int i = 0; i < FRAMESIZE_INVALID; i++) {
+    ClipWriteStats * stats = &clipStats[i];
+    if (stats->frames == 0) continue;
+    JsonObject size = write.createNestedObject();
+    size["size"] = String(stats->width) + "x" + String(stats->height);
+    size["frames"] = stats->frames;
+    size["avg kB"] = (uint32_t)(stats->bytes / stats->frames / 1024);
+    size["write fps"] = stats->writeUs ? stats->frames * 1000000.0f / stats->writeUs : 0;
+    size["MB/s"] = stats->writeUs ? (float)stats->bytes / stats->writeUs : 0;
+    size["max ms"] = stats->slowestUs / 1000;
+  }
+  mqttPublishJson(topics[PUB_CLIP], doc);
+}
+
+/**************************************************************************
+ * CLIP_ListHandler
+ * - "GET /clips": the clips on the SD card (JSON array, name and size).
+ **************************************************************************/
+static esp_err_t CLIP_ListHandler(httpd_req_t *req) {
+  char entry[64];
+  bool first = true;
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_send_chunk(req, "[", 1);
+  File dir = SD_MMC.open(CLIP_DIR);
+  if (dir) {
+    for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+      const char * name = strrchr(file.name(), '/');
+      name = name ? name + 1 : file.name();
+      if (CLIP_Number(name) >= 0) {
+        int len = snprintf(entry, sizeof(entry), "%s{\"name\":\"%s\",\"size\":%u}", first ? "" : ",", name, (unsigned)file.size());
+        httpd_resp_send_chunk(req, entry, len);
+        first = false;
+      }
+      file.close();
+    }
+    dir.close();
+  }
+  httpd_resp_send_chunk(req, "]", 1);
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/**************************************************************************
+ * CLIP_GetHandler
+ * - "GET /clip?name=clip0001.avi": download a clip.
+ **************************************************************************/
+static esp_err_t CLIP_GetHandler(httpd_req_t *req) {
+  char query[48];
+  char name[20];
+  char path[32];
+  char disposition[48];
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+      httpd_query_key_value(query, "name", name, sizeof(name)) != ESP_OK || CLIP_Number(name) < 0) {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Use /clip?name=clipNNNN.avi");
+  }
+  if (clipRecording && strcmp(name, clip.current.name) == 0) {
+    httpd_resp_set_status(req, "409 Conflict");
+    return httpd_resp_send(req, "Still recording", HTTPD_RESP_USE_STRLEN);
+  }
+  snprintf(path, sizeof(path), CLIP_DIR "/%s", name);
+  File file = SD_MMC.open(path, FILE_READ);
+  if (!file) {
+    return httpd_resp_send_404(req);
+  }
+  uint8_t * buf = (uint8_t *)HEAP_Alloc(HEAP_HTTP, CLIP_SEND_CHUNK, MALLOC_CAP_DEFAULT);
+  if (!buf) {
+    file.close();
+    return httpd_resp_send_500(req);
+  }
+
+  httpd_resp_set_type(req, "video/x-msvideo");
+  snprintf(disposition, sizeof(disposition), "inline; filename=%s", name);
+  httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+  esp_err_t res = ESP_OK;
+  size_t len;
+  while (res == ESP_OK && (len = file.read(buf, CLIP_SEND_CHUNK)) > 0) {
+    res = httpd_resp_send_chunk(req, (const char *)buf, len);
+  }
+  if (res == ESP_OK) {
+    res = httpd_resp_send_chunk(req, NULL, 0);
+  }
+  HEAP_Free(buf);
+  file.close();
+  return res;
+}
+
+/**************************************************************************
+ * CLIP_Start
+ * - Mount the SD card (1-bit mode), find the clips on it, preallocate the
+ *   index and start the recorder task.
+ **************************************************************************/
+bool CLIP_Start() {
+  if (!SD_MMC.begin("/sdcard", true) || SD_MMC.cardType() == CARD_NONE) {
+    Serial.println("\t---! Clip recorder: no SD card");
+    return false;
+  }
+  SD_MMC.mkdir(CLIP_DIR);
+  clip.oldest = 0;
+  clip.newest = 0;
+  File dir = SD_MMC.open(CLIP_DIR);
+  if (dir) {
+    for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+      int number = CLIP_Number(file.name());
+      if (number >= 0) {
+        clip.oldest = (clip.oldest == 0) ? number : min(clip.oldest, number);
+        clip.newest = max(clip.newest, number);
+      }
+      file.close();
+    }
+    dir.close();
+  }
+  if (clip.oldest == 0) {
+    clip.oldest = 1;                                                      // No clips yet (numbers start at 1)
+  }
+  char name[16], path[32];
+  snprintf(name, sizeof(name), "clip%04d.avi", clip.newest + 1);
+  CLIP_Path(path, sizeof(path), name, true);
+  SD_MMC.remove(path);                                                    // Recording cut short by a reset
+
+  clip.index = (uint32_t *)HEAP_Alloc(HEAP_CAMERA, CLIP_MAX_FRAMES * 2 * sizeof(uint32_t), psramFound() ? MALLOC_CAP_SPIRAM : MALLOC_CAP_DEFAULT);
+  clip.results = xQueueCreate(2, sizeof(ClipInfo));
+  if (!clip.index || !clip.results ||
+      xTaskCreatePinnedToCore(CLIP_Task, "clip", CLIP_STACK, NULL, 2, &clip.task, PIPE_CAPTURE_CORE) != pdPASS) {
+    Serial.println("\t---! Clip recorder: start failed");
+    return false;
+  }
+  clip.mounted = true;
+  Serial.printf("\t- Clip recorder: %d clip(s) on the SD card, %lluMB free\n", max(0, clip.newest - clip.oldest + 1),
+                (SD_MMC.totalBytes() - SD_MMC.usedBytes()) >> 20);
+  return true;
+}
+#endif
+
+/**************************************************************************
+ * METRICS_Print / METRICS_Header
+ * - Append to the "/metrics" text. The buffer is static: rendering doesn't
+ *   use the heap, and the web server task serves one request at a time.
+ **************************************************************************/
+static char metricsText[METRICS_BUFFER_SIZE];
+static size_t metricsLen = 0;
+
+void METRICS_Print(const char * format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  int n = vsnprintf(metricsText + metricsLen, sizeof(metricsText) - metricsLen, format, args);
+  va_end(args);
+  if (n > 0) {
+    metricsLen = min(metricsLen + n, sizeof(metricsText));    // Full: sizeof(metricsText) (truncated)
+  }
+}
+
+void METRICS_Header(const char * name, const char * type, const char * help) {
+  METRICS_Print("# HELP gatecam_%s %s\n# TYPE gatecam_%s %s\n", name, help, name, type);
+}
+
+void METRICS_Value(const char * name, const char * type, const char * help, long long value) {
+  METRICS_Header(name, type, help);
+  METRICS_Print("gatecam_%s %lld\n", name, value);
+}
+
+/**************************************************************************
+ * METRICS_Handler
+ * - "GET /metrics": counters and gauges in the Prometheus text format.
+ **************************************************************************/
+static esp_err_t METRICS_Handler(httpd_req_t *req) {
+  METRIC_Add(metrics.scrapes);
+  metricsLen = 0;
+
+  METRICS_Header("frames_captured_total", "counter", "Camera frames captured.");
+  for (int i = 0; i < FRAME_SOURCES; i++) {
+    METRICS_Print("gatecam_frames_captured_total{source=\"%s\"} %u\n", frameSourceNames[i], METRIC_Get(metrics.frames[i]));
+  }
+  METRICS_Value("stream_frames_total", "counter", "Frames sent to video stream clients.", METRIC_Get(metrics.streamFrames));
+  METRICS_Value("stream_bytes_total", "counter", "Bytes sent to video stream clients.", METRIC_Get(metrics.streamBytes));
+  METRICS_Value("stream_clients", "gauge", "Connected video stream clients.", streamClients);
+  METRICS_Value("stream_saved_frames_total", "counter", "Stream frames not sent, scene unchanged.", METRIC_Get(metrics.streamSavedFrames));
+  METRICS_Value("stream_saved_bytes_total", "counter", "Stream bytes not sent, scene unchanged.", METRIC_Get(metrics.streamSavedBytes));
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  METRICS_Header("ws_ack_latency_seconds", "gauge", "WebSocket stream, frame send to ack time (last, per client).");
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (wsClients[i].fd >= 0) {
+      METRICS_Print("gatecam_ws_ack_latency_seconds{client=\"%d\"} %.3f\n", i, wsClients[i].ackUsLast / 1000000.0);
+    }
+  }
+#endif
+
+  METRICS_Header("uploads_total", "counter", "Photo uploads (HTTP POST).");
+  METRICS_Print("gatecam_uploads_total{result=\"ok\"} %u\n", METRIC_Get(metrics.uploads));
+  METRICS_Print("gatecam_uploads_total{result=\"failed\"} %u\n", METRIC_Get(metrics.uploadFailures));
+  METRICS_Value("upload_bytes_total", "counter", "Bytes uploaded by successful uploads.", METRIC_Get(metrics.uploadBytes));
+  METRICS_Header("upload_duration_seconds", "histogram", "Latency of the successful uploads.");
+  uint32_t count = 0;
+  for (int i = 0; i <= UPLOAD_BUCKETS; i++) {
+    count += METRIC_Get(metrics.uploadBuckets[i]);                // Cumulative
+    if (i < UPLOAD_BUCKETS) {
+      METRICS_Print("gatecam_upload_duration_seconds_bucket{le=\"%u.%03u\"} %u\n", uploadBucketsMs[i] / 1000, uploadBucketsMs[i] % 1000, count);
+    } else {
+      METRICS_Print("gatecam_upload_duration_seconds_bucket{le=\"+Inf\"} %u\n", count);
+    }
+  }
+  uint64_t sumMs = METRIC_Get(metrics.uploadMsSum);
+  METRICS_Print("gatecam_upload_duration_seconds_sum %llu.%03u\n", sumMs / 1000, (unsigned)(sumMs % 1000));
+  METRICS_Print("gatecam_upload_duration_seconds_count %u\n", count);
+
+  METRICS_Value("mqtt_received_total", "counter", "MQTT messages received.", METRIC_Get(metrics.mqttIn));
+  METRICS_Value("mqtt_published_total", "counter", "MQTT messages published.", METRIC_Get(metrics.mqttOut));
+  METRICS_Value("mqtt_publish_failures_total", "counter", "MQTT publishes that failed.", mqttPublishFailed);
+  METRICS_Value("wifi_reconnects_total", "counter", "WiFi reconnects since boot.", net.wifiReconnects);
+  METRICS_Value("mqtt_reconnects_total", "counter", "MQTT reconnects since boot.", net.mqttReconnects);
+  METRICS_Value("offline_photos_dropped_total", "counter", "Photos lost while offline (spool full, no PSRAM).", photoSpool.dropped);
+
+  METRICS_Value("heap_free_bytes", "gauge", "Free internal heap.", heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+  METRICS_Value("heap_min_free_bytes", "gauge", "Lowest free internal heap since boot.", heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+  METRICS_Value("heap_largest_block_bytes", "gauge", "Largest free internal heap block.", heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+  METRICS_Value("psram_free_bytes", "gauge", "Free PSRAM.", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+  METRICS_Value("wifi_rssi_dbm", "gauge", "WiFi signal strength.", WiFi.RSSI());
+  METRICS_Value("uptime_seconds", "gauge", "Time since boot.", esp_timer_get_time() / 1000000);
+
+  if (metricsLen >= sizeof(metricsText) - 1) {
+    Serial.println("\t---! Metrics: text buffer too small (METRICS_BUFFER_SIZE)");
+    return httpd_resp_send_500(req);
+  }
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  return httpd_resp_send(req, metricsText, metricsLen);
+}
+
+/**************************************************************************
+ * METRICS_Start
+ * - Start the "/metrics" web server. The video stream handler keeps the
+ *   stream server's task busy for as long as a client watches, so the
+ *   metrics have their own server (and task), on METRICS_PORT.
+ **************************************************************************/
+void METRICS_Start() {
+  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.server_port = METRICS_PORT;
+  config.ctrl_port = config.ctrl_port + 1;          // The stream server has the default
+  config.max_open_sockets = 1;                      // One scraper, sockets are scarce (LWIP_MAX_SOCKETS)
+  config.lru_purge_enable = true;                   // A scraper's stale keep-alive connection makes room
+  config.max_uri_handlers = 1;
+
+  httpd_uri_t metrics_uri = {
+    .uri       = "/metrics",
+    .method    = HTTP_GET,
+    .handler   = METRICS_Handler,
+    .user_ctx  = NULL
+  };
+  if (metrics_httpd == NULL && httpd_start(&metrics_httpd, &config) == ESP_OK) {
+    httpd_register_uri_handler(metrics_httpd, &metrics_uri);
+  } else {
+    Serial.println("\t---! Metrics: web server not started");
+  }
+}
+
+/**************************************************************************
+ * cam_RegisterHandlers
+ * - Register all URIs of the stream web server: stream and, when built in,
+ *   the WebSocket stream and the clip list/download.
+ **************************************************************************/
+void cam_RegisterHandlers(httpd_handle_t server) {
+  httpd_uri_t index_uri = {
+    .uri       = "/",
+    .method    = HTTP_GET,
+    .handler   = cam_StreamHandler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &index_uri);
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  httpd_uri_t ws_uri = { .uri = "/ws", .method = HTTP_GET, .handler = WS_Handler, .user_ctx = NULL, .is_websocket = true };
+  httpd_register_uri_handler(server, &ws_uri);
+#endif
+#if CLIP_RECORDER
+  httpd_uri_t clips_uri = { .uri = "/clips", .method = HTTP_GET, .handler = CLIP_ListHandler, .user_ctx = NULL };
+  httpd_uri_t clip_uri = { .uri = "/clip", .method = HTTP_GET, .handler = CLIP_GetHandler, .user_ctx = NULL };
+  httpd_register_uri_handler(server, &clips_uri);
+  httpd_register_uri_handler(server, &clip_uri);
+#endif
+}
+
+/**************************************************************************
+ * cam_StopStartHTTPServer
+ * - Start the web server for video
+ **************************************************************************/
+void cam_StopStartHTTPServer() {
+  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.server_port = 80;
+  config.core_id = PIPE_UPLOAD_CORE;                // Stream (JPEG conversion and sending) off the capture core
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  config.close_fn = WS_Closed;                      // Free the WebSocket client slots of closed sockets
+#endif
+
+Serial.print("-- cam_StopStartHTTPServer: stream is null - "); Serial.println( (stream_httpd == NULL) );
+
+  if (runWebServer) {
+    Serial.println("- Cam StartServer start");
+
+    //Serial.printf("Starting web server on port: '%d'\n", config.server_port);
+    if (httpd_start(&stream_httpd, &config) == ESP_OK) {
+      cam_RegisterHandlers(stream_httpd);
+    }
+  } else {
+    Serial.println("- Cam StartServer stop");
+    if (stream_httpd != NULL) {
+      httpd_stop(stream_httpd);
+    }
+  }
+  Serial.println("Cam StartServer done");
+}
+
+/**************************************************************************
+ * cam_StopStartHTTPServer
+ * - Start the web server for video
+ **************************************************************************/
+void cam_StartHTTPServer() {
+  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.server_port = 80;
+  config.core_id = PIPE_UPLOAD_CORE;                // Stream (JPEG conversion and sending) off the capture core
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  config.close_fn = WS_Closed;                      // Free the WebSocket client slots of closed sockets
+#endif
+
+Serial.print("-- cam_StartHTTPServer: stream is null - "); Serial.println( (stream_httpd == NULL) );
+
+  if (stream_httpd == NULL) {
+    Serial.println("- Cam StartServer start");
+
+    //Serial.printf("Starting web server on port: '%d'\n", config.server_port);
+    if (httpd_start(&stream_httpd, &config) == ESP_OK) {
+      cam_RegisterHandlers(stream_httpd);
+    }
+  } else {
+    Serial.println("- Cam StartServer already running");
+  }
+  Serial.println("Cam StartServer done");
+}
+
+/**************************************************************************
+ * readConfig
+ * - Get the settings on initialisation.
+ **************************************************************************/
+static esp_err_t readConfig() {
+  int res = 0;
+  bool readConfigOK = false;
+
+  if (SPIFFS.begin(true)) {
+    //Serial.println("ReadConfig: SPIFFS mounted");
+    if ( SPIFFS.exists(CONFIGFILE) ) {
+      File configFile = SPIFFS.open(CONFIGFILE, FILE_READ);
+
+      if ( configFile ) {
+        // Config file opened ok. Read contents.
+        StaticJsonDocument<CONFIG_JSON_CAPACITY> configDoc;
+        DeserializationError error = deserializeJson(configDoc, configFile);
+        if (error) {
+          Serial.print(F("\t---! Failed to deserialize file. Err: ")); Serial.println(error.c_str());           
+        } else {
+          CONFIG_Load(config, configDoc.as<JsonObjectConst>());          // Missing values: default (CONFIG_FIELDS)
+
+          readConfigOK = true;
+          res = 1;
+        }
+
+      } else {
+        Serial.println("\t---! Failed to open existing file for reading.");
+      }
+      // Close the file
+      configFile.close();
+    } else {
+      Serial.println("\t---!  ReadConfig: SPIFFS does not exist");
+    }
+  } else {
+    Serial.println("\t---!  ReadConfig: SPIFFS mount failed");
+  }
+
+  if ( !readConfigOK ) {
+    // Configuration in SPIFFS not found/loaded. Initialize with defaults and save to new SPIFFS file.
+    CONFIG_Defaults(config);
+
+    Serial.println("\t- Unable to read config. Defaults set. Saving new config....");
+
+    // Save config to SPIFFS.
+    saveConfig();
+
+    res = 1;
+  }
+  return res;  
+}
+
+/**************************************************************************
+ * NET_backoff
+ * - Get the delay before the next connection attempt.
+ * - Exponential (doubles per consecutive failure, capped at NET_BACKOFF_MAX)
+ *   with random jitter, so devices don't retry in lock-step after an outage.
+ **************************************************************************/
+unsigned long NET_backoff(int failures) {
+  unsigned long window = NET_BACKOFF_MIN;
+
+  for (int i=0; i<failures && window<NET_BACKOFF_MAX; i++) {
+    window *= 2;
+  }
+  if (window > NET_BACKOFF_MAX) {
+    window = NET_BACKOFF_MAX;
+  }
+  // Wait at least half the window, plus a random part of the other half.
+  return window/2 + esp_random() % (window/2 + 1);
+}
+
+/**************************************************************************
+ * WiFi_event
+ * - WiFi event handler (runs in the WiFi event task, not in loop()).
+ * - Only flags the link state, NET_loop() acts on it.
+ **************************************************************************/
+void WiFi_event(WiFiEvent_t event) {
+  switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      wifiUp = true;
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+    case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+      wifiUp = false;
+      break;
+    default:
+      break;
+  }
+}
+
+/**************************************************************************
+ * WiFi_init
+ * - Prepare the WiFi station. The connection itself is made by NET_loop().
+ **************************************************************************/
+void WiFi_init()
+{
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);                     // Reconnects are managed by NET_loop() (with backoff)
+  WiFi.onEvent(WiFi_event);
+}
+
+/**************************************************************************
+ *  MQTT_BuildTopics
+ *  - Build the client ID (from the MAC address) and all topics (from the
+ *    configured prefix, or "cam-<MAC>" if none), once.
+ **************************************************************************/
+void MQTT_BuildTopics() {
+  uint64_t mac = ESP.getEfuseMac();                 // Byte 0 (LSB) is the first MAC byte
+  char macId[7];
+  char prefix[sizeof(config.TopicPrefix) + 4];
+
+  snprintf(macId, sizeof(macId), "%02x%02x%02x", (uint8_t)(mac >> 24), (uint8_t)(mac >> 32), (uint8_t)(mac >> 40));
+  snprintf(mqttClientId, sizeof(mqttClientId), "%s-%s", MQTT_CLIENT_ID, macId);
+  if (config.TopicPrefix[0]) {
+    strlcpy(prefix, config.TopicPrefix, sizeof(prefix));
+  } else {
+    snprintf(prefix, sizeof(prefix), "cam-%s", macId);
+  }
+  for (int i = 0; i < TOPIC_COUNT; i++) {
+    snprintf(topics[i], MQTT_TOPIC_SIZE, "%s/%s", prefix, topicSuffixes[i]);
+  }
+  snprintf(topicWildcard, MQTT_TOPIC_SIZE, "%s/+/cmnd", prefix);
+  Serial.printf("MQTT - client %s, topics %s/..\n", mqttClientId, prefix);
+}
+
+/**************************************************************************
+ *  MQTT_SubscribeTopic / MQTT_Subscribe
+ *  - Subscribe (or unsubscribe) the command topics: one wildcard for all
+ *    "<prefix>/<device>/cmnd" topics, plus the topics outside the pattern.
+ **************************************************************************/
+void MQTT_SubscribeTopic(const char * topic, bool subscribe) {
+  if (subscribe) {
+    mqttClient.subscribe(topic);
+  } else {
+    mqttClient.unsubscribe(topic);
+  }
+}
+
+void MQTT_Subscribe(bool subscribe) {
+  MQTT_SubscribeTopic(topicWildcard, subscribe);
+  for (int i = SUB_CAMCOMMAND; i < TOPIC_COUNT; i++) {
+    if (strcmp(strrchr(topics[i], '/'), "/cmnd") != 0) {
+      MQTT_SubscribeTopic(topics[i], subscribe);    // Not covered by the wildcard
+    }
+  }
+}
+
+/**************************************************************************
+ *  MQTT_FindTopic
+ *  - Local dispatch of the (wildcard) subscription: the subscribed topic
+ *    a message arrived on, TOPIC_COUNT if unknown.
+ **************************************************************************/
+TopicId MQTT_FindTopic(const char * topic) {
+  for (int i = SUB_CAMCOMMAND; i < TOPIC_COUNT; i++) {
+    if (strcmp(topic, topics[i]) == 0) {
+      return (TopicId)i;
+    }
+  }
+  return TOPIC_COUNT;
+}
+
+/**************************************************************************
+ *  MQTT_init
+ *  - Single attempt to connect to the MQTT broker (no waiting/retry here)
+ *  - Subscribe to MQTT topics
+***************************************************************************/
+bool MQTT_init() {
+
+  mqttClient.disconnect();
+  Serial.print("Attempting MQTT connection... ");
+  // Attempt to connect (cleanSession = false : inform broker to not start new session when reconnect)
+  if (mqttClient.connect(mqttClientId, MQTT_user, MQTT_pwd,NULL,0,false,NULL,false)) {
+    Serial.print("connected. "); Serial.print(" WiFi="); Serial.println(WiFi.RSSI());
+    // Subscribe
+    MQTT_Subscribe(true);
+    Serial.print("Subscribed to MQTT: "); Serial.println(topicWildcard);
+    return true;
+  }
+  Serial.print("failed! rc="); Serial.print(mqttClient.state());
+  Serial.print(" RSSI="); Serial.print(WiFi.RSSI()); Serial.print(" IP="); Serial.println(WiFi.localIP());
+  return false;
+}
+
+/**************************************************************************
+ *  NET_markDown
+ *  - Start timing an outage (only once connectivity has been established).
+***************************************************************************/
+void NET_markDown() {
+  if (net.everOnline && net.downSince == 0) {
+    net.downSince = millis();
+  }
+}
+
+/**************************************************************************
+ *  NET_loop
+ *  - Non-blocking WiFi/MQTT connection state machine, called every loop().
+ *  - Each call does at most one (bounded) connection attempt, failed attempts
+ *    are retried after a jittered exponential backoff.
+***************************************************************************/
+void NET_loop() {
+  unsigned long now = millis();
+
+  if (!wifiUp && (net.state == NET_MQTT_DOWN || net.state == NET_ONLINE)) {
+    // WiFi dropped (reported by WiFi_event). Start reconnecting right away.
+    Serial.println("NET - WiFi connection lost");
+    NET_markDown();
+    mqttClient.disconnect();
+    net.state = NET_WIFI_DOWN;
+    net.retryAt = now;
+  }
+
+  switch (net.state) {
+    case NET_WIFI_DOWN:
+      if ((long)(now - net.retryAt) >= 0) {
+        Serial.print("NET - Connecting to: "); Serial.println(ssid);
+        WiFi.disconnect();
+        if (rtcState.channel > 0 && net.wifiFailures == 0) {
+          // Fast reconnect to the last access point (known channel, no scan).
+          WiFi.begin(ssid, password, rtcState.channel, rtcState.bssid);
+        } else {
+          WiFi.begin(ssid, password);
+        }
+        net.attemptStart = now;
+        net.state = NET_WIFI_CONNECTING;
+      }
+      break;
+
+    case NET_WIFI_CONNECTING:
+      if (wifiUp) {
+        Serial.print("NET - WiFi connected. RSSI: "); Serial.print(WiFi.RSSI()); Serial.print(" Local IP: "); Serial.println(WiFi.localIP());
+        if (net.everOnline) net.wifiReconnects++;
+        memcpy(rtcState.bssid, WiFi.BSSID(), sizeof(rtcState.bssid));
+        rtcState.channel = WiFi.channel();
+        if (time(NULL) < 1600000000) {
+          // Clock not set yet: (re)start NTP time sync, used to timestamp uploads.
+          configTzTime(ntp_timezone, ntp_server);
+        }
+        net.wifiFailures = 0;
+        net.state = NET_MQTT_DOWN;
+        net.retryAt = now;
+      } else if (now - net.attemptStart > NET_WIFI_TIMEOUT) {
+        net.wifiFailures++;
+        rtcState.channel = 0;                                           // The access point may have moved: scan next time
+        net.retryAt = now + NET_backoff(net.wifiFailures);
+        Serial.printf("NET - WiFi connect timed out, retry in %lums\n", net.retryAt - now);
+        net.state = NET_WIFI_DOWN;
+      }
+      break;
+
+    case NET_MQTT_DOWN:
+      if ((long)(now - net.retryAt) >= 0) {
+        if (MQTT_init()) {
+          if (net.downSince != 0) {
+            // Connectivity restored after an outage.
+            net.lastDowntime = millis() - net.downSince;
+            net.totalDowntime += net.lastDowntime;
+            net.downSince = 0;
+          }
+          if (net.everOnline) net.mqttReconnects++;
+          net.mqttFailures = 0;
+          net.state = NET_ONLINE;
+          if (!net.everOnline) {
+            // Report the startup event for monitoring of crashes and restarts.
+            net.everOnline = true;
+            reportState();
+          }
+        } else {
+          net.mqttFailures++;
+          net.retryAt = millis() + NET_backoff(net.mqttFailures);
+        }
+      }
+      break;
+
+    case NET_ONLINE:
+      if (!mqttClient.connected()) {
+        Serial.print("NET - MQTT connection lost. rc="); Serial.println(mqttClient.state());
+        NET_markDown();
+        net.state = NET_MQTT_DOWN;
+        net.retryAt = now;
+      }
+      break;
+  }
+}
+
+/**************************************************************************
+ *  MQTT_ValidPrefix
+ *  - A topic prefix must fit the config and can't hold MQTT separators or
+ *    wildcards.
+ **************************************************************************/
+bool MQTT_ValidPrefix(const char * prefix) {
+  return strlen(prefix) < sizeof(config.TopicPrefix) && !strpbrk(prefix, "/+#");
+}
+
+/**************************************************************************
+ *  CONFIG_Check
+ *  - Field checks beyond type and range, for a value set through the
+ *    registry (CONFIG_SetField, CONFIG_ParseCommand). May normalize it.
+ **************************************************************************/
+bool CONFIG_Check(Config& candidate, const char * name) {
+  if (strcmp(name, "TopicPrefix") == 0) {
+    if (strcmp(candidate.TopicPrefix, "mac") == 0) {
+      candidate.TopicPrefix[0] = 0;                 // Derive from the MAC address
+    }
+    return MQTT_ValidPrefix(candidate.TopicPrefix);
+  }
+  return true;
+}
+
+/**************************************************************************
+ *  CONFIG_SetField
+ *  - Validate one "setconfig" member and set it in the (copy of the)
+ *    configuration. Returns false, with the reason in error, if invalid.
+ **************************************************************************/
+bool CONFIG_SetField(Config& updated, const char * name, JsonVariantConst value, char * error, size_t errorSize) {
+#define CFG_SETFIELD(type, field, def, min, max, flags) \
+  if (((flags) & CFG_SET) && strcmp(name, #field) == 0) { \
+    if (CFG_Set(updated.field, value, min, max) && CONFIG_Check(updated, #field)) return true; \
+    snprintf(error, errorSize, "%s: wrong type, out of range or invalid", name); \
+    return false; \
+  }
+  CONFIG_FIELDS(CFG_SETFIELD)
+#undef CFG_SETFIELD
+  if (strcmp(name, "ClientId") == 0) {
+    return true;                                    // Read-only (from the MAC), so "getconfig" output can be sent back as is
+  }
+  snprintf(error, errorSize, "%s: unknown setting", name);
+  return false;
+}
+
+/**************************************************************************
+ *  CONFIG_ParseValue
+ *  - Set a settable configuration field (name not case sensitive) from
+ *    text, in units of 1/scale of the field (see CFG_Parse). Returns false,
+ *    leaving the configuration unchanged, if the field is unknown or the
+ *    value invalid.
+ **************************************************************************/
+bool CONFIG_ParseValue(Config& updated, const char * name, const String& value, long scale = 1) {
+  Config candidate = updated;
+#define CFG_PARSE(type, field, def, min, max, flags) \
+  if (((flags) & CFG_SET) && strcasecmp(name, #field) == 0) { \
+    if (!CFG_Parse(candidate.field, value, min, max, scale) || !CONFIG_Check(candidate, #field)) return false; \
+    updated = candidate; \
+    return true; \
+  }
+  CONFIG_FIELDS(CFG_PARSE)
+#undef CFG_PARSE
+  return false;
+}
+
+/**************************************************************************
+ *  CONFIG_ParseCommand
+ *  - "<name>:<value>" command for any settable configuration field, e.g.
+ *    "ReportState:true", in the unit of the field.
+ **************************************************************************/
+bool CONFIG_ParseCommand(Config& updated, const String& command) {
+  int valSplit = command.indexOf(":");
+  if (valSplit <= 0) {
+    return false;
+  }
+  return CONFIG_ParseValue(updated, command.substring(0, valSplit).c_str(), command.substring(valSplit+1));
+}
+
+/**************************************************************************
+ *  CONFIG_Changed
+ *  - Apply the side effects of a configuration change made through the
+ *    registry ("setconfig" or "<name>:<value>"). Returns true if anything
+ *    changed; prefixChanged is set if the topics must be rebuilt.
+ **************************************************************************/
+bool CONFIG_Changed(const Config& previous, bool& prefixChanged) {
+  if (config.PIR_enabled && !previous.PIR_enabled) {
+    motionEnabledAt = esp_timer_get_time();                               // Start clean, don't report on any previous triggers
+  }
+  if (config.LapseInterval != previous.LapseInterval) {
+    rtcState.lapseNext = 0;                                               // Schedule from now on
+  }
+  if (strcmp(config.TopicPrefix, previous.TopicPrefix) != 0) {
+    prefixChanged = true;
+  }
+  return (memcmp(&config, &previous, sizeof(Config)) != 0);
+}
+
+/**************************************************************************
+ *  CONFIG_Command
+ *  - Unit-specific "<command>:<value>" for one registry field, e.g.
+ *    "interval:<seconds>" for StateInterval (scale 1000, see CFG_Parse).
+ *    Same checks as "<Field>:<value>". Returns true if anything changed.
+ **************************************************************************/
+bool CONFIG_Command(const char * field, const String& msgValue, long scale, bool& prefixChanged) {
+  int valSplit = msgValue.indexOf(":");
+  Config previous = config;
+
+  if (valSplit <= 0 || !CONFIG_ParseValue(config, field, msgValue.substring(valSplit+1), scale)) {
+    Serial.println(" >>> INVALID !!");
+    return false;
+  }
+  Serial.print(" NewVal="); Serial.println(msgValue.substring(valSplit+1));
+  return CONFIG_Changed(previous, prefixChanged);
+}
+
+/**************************************************************************
+ *  CONFIG_Apply
+ *  - Apply a JSON document with any subset of the configuration, all or
+ *    nothing: every member is validated on a copy, the copy replaces the
+ *    configuration only if all are valid.
+ **************************************************************************/
+bool CONFIG_Apply(const byte * message, unsigned int length, char * error, size_t errorSize) {
+  StaticJsonDocument<CONFIG_JSON_CAPACITY> doc;
+  DeserializationError parseError = deserializeJson(doc, message, length);
+
+  if (parseError) {
+    snprintf(error, errorSize, "invalid JSON: %s", parseError.c_str());
+    return false;
+  }
+  if (!doc.is<JsonObject>()) {
+    snprintf(error, errorSize, "not a JSON object");
+    return false;
+  }
+  Config updated = config;
+  for (JsonPairConst member : doc.as<JsonObjectConst>()) {
+    if (!CONFIG_SetField(updated, member.key().c_str(), member.value(), error, errorSize)) {
+      return false;
+    }
+  }
+  config = updated;
+  return true;
+}
+
+/**************************************************************************
+ *  MQTT_HandleMessage
+ *  - Handle received MQTT messages
+ **************************************************************************/
+void MQTT_HandleMessage (char* topic, byte* message, unsigned int length) {
+  String msgValue;
+  bool configChanged = false;
+  bool configEcho = false;
+  bool prefixChanged = false;
+  TopicId topicId = MQTT_FindTopic(topic);
+
+  Serial.print("MQTT Message arrived on topic: ");
+  Serial.print(topic);
+  Serial.print(". Message: ");
+  msgValue.reserve(length);                         // One allocation, instead of growing per character
+  for (int i = 0; i < length; i++) {
+    Serial.print((char)message[i]);
+    msgValue += (char)message[i];
+  }
+  Serial.println();
+  power.lastActivity = millis();                    // Stay awake a while for follow-up commands
+
+  // Process the received MQTT topics.. 
+
+// * - "gate/camera/cmnd" 
+// *      -> "photo"              : take and upload a photo
+// *      -> "enable"             : enable camera and allow PIR to trigger taking photos (MQTT trigger still possible when disabled)
+// *      -> "disable"            : disable camera actions (PIR still enabled)
+// *      -> "settings"           : report current cam settings and status (JSON)
+// *      -> "profile:<name>"     : apply a named sensor profile (e.g. day/night)
+// *      -> "saveprofile:<name>" : save the current sensor parameters as a named profile
+// *      -> "record[:<seconds>]" : record a clip to the SD card (default: ClipSeconds) (CLIP_RECORDER)
+// *      -> "clips"              : report the clip recorder and SD card write rates (CLIP_RECORDER)
+  if (topicId == SUB_CAMCOMMAND) 
+  { 
+    if (msgValue == "photo") {
+      Serial.println("\t- MQTT Take and upload photo");
+      EVT_Push(&taskEvents, EVT_PHOTO, esp_timer_get_time());
+    } else if (msgValue == "video") {                                     // now web server runs all the time. no stop/start needed.
+      //      actionTakeVideo = true;
+      if ( !runWebServer ) {
+        Serial.println("\t- MQTT Video - start");
+        runWebServer = true;
+        cam_StopStartHTTPServer();                                        // Start running the Web Server
+      } else {
+        Serial.println("\t- MQTT Video - stop");
+        runWebServer = false;
+        cam_StopStartHTTPServer();                                        // Start running the Web Server
+      }
+    } else if (msgValue == "enable") {
+      Serial.println("\t- MQTT enable camera");
+      configChanged = (config.CAM_enabled != true);
+      config.CAM_enabled = true;                                          // Enable Camera
+    }  else if (msgValue == "disable") {
+      Serial.println("\t- MQTT disable camera");
+      configChanged = (config.CAM_enabled != false);
+      config.CAM_enabled = false;                                         // Disable Camera
+    } else if (msgValue.substring(0,11) == "saveprofile") {
+      Serial.print("\t- MQTT save camera profile ");
+      int valSplit = msgValue.indexOf(":"); 
+      if (valSplit > 0 && cam_SaveProfile(msgValue.substring(valSplit+1))) {
+        Serial.println(msgValue.substring(valSplit+1));
+      } else {
+        Serial.println(" >>> INVALID !!");
+      }
+    } else if (msgValue.substring(0,7) == "profile") {
+      Serial.print("\t- MQTT apply camera profile ");
+      int valSplit = msgValue.indexOf(":"); 
+      if (valSplit > 0 && cam_ApplyProfile(msgValue.substring(valSplit+1))) {
+        Serial.println(msgValue.substring(valSplit+1));
+        cam_ReportSettings();
+      } else {
+        Serial.println(" >>> UNKNOWN PROFILE !!");
+      }
+    } else if (msgValue == "settings") {
+      Serial.println("\t- MQTT return current camera settings");
+      cam_ReportSettings();
+#if CLIP_RECORDER
+    } else if (msgValue.substring(0,6) == "record") {
+      int seconds = config.ClipSeconds;
+      if (msgValue != "record" && (msgValue.charAt(6) != ':' || !CFG_Parse(seconds, msgValue.substring(7), 1, CLIP_MAX_SECONDS, 1))) {
+        Serial.println("\t- MQTT record clip >>> INVALID !!");               // Not a number of seconds (1 - CLIP_MAX_SECONDS)
+      } else {
+        Serial.printf("\t- MQTT record clip (%ds)\n", seconds);
+        CLIP_Trigger(constrain(seconds, 1, CLIP_MAX_SECONDS) * 1000);
+      }
+    } else if (msgValue == "clips") {
+      Serial.println("\t- MQTT report clip recorder");
+      CLIP_Report();
+#endif
+    } else if (msgValue.substring(0,5) == "dedup") {
+      Serial.print("\t- MQTT set duplicate photo threshold");
+      configChanged = CONFIG_Command("DedupThreshold", msgValue, 1, prefixChanged);
+    } else {
+      Serial.print(" UNKNOWN CAMERA action ("); Serial.print(msgValue); Serial.println(")");
+    }
+  }
+
+// * - "gate/camera/setsetting" 
+// *      -> "<setting>:<value>"  : Update the camera settings with the provided value
+  else if (topicId == SUB_CAMSETTING ) 
+  { 
+    Serial.println("\t- MQTT update camera setting");
+    cam_UpdateSettings(msgValue);
+  }
+
+// * - "gate/motion/cmnd" 
+// *      -> "enable"             : enable PIR motion feedback (default)
+// *      -> "disable"            : disable PIR motion feedback
+// *      -> "delay:<seconds>"    : set new delay/debounce between PIR triggers
+  else if (topicId == SUB_MOTION ) 
+  { 
+    if (msgValue == "disable") {
+      Serial.println("\t- MQTT disable PIR");
+      configChanged = (config.PIR_enabled != false);
+      config.PIR_enabled = false;                                     // Disable PIR sensor
+    } else if (msgValue == "enable") {
+      Serial.println("\t- MQTT enable PIR");
+      motionEnabledAt = esp_timer_get_time();                         // Start clean, don't report on any previous triggers
+      configChanged = (config.PIR_enabled != true);
+      config.PIR_enabled = true;                                      // Enable PIR sensor
+    } else if (msgValue.substring(0,5) == "delay") {
+      Serial.print("\t- MQTT set PIR debounce delay");
+      configChanged = CONFIG_Command("PIR_delay", msgValue, 1000, prefixChanged);    // Seconds
+    }
+    else {
+      Serial.print(" UNKNOWN MOTION action ("); Serial.print(msgValue); Serial.println(")");
+    }
+  }
+
+// * - "gate/temperature/cmnd" 
+// *      -> "reading"            : report the current temperature value
+// *      -> "interval:<seconds>" : set the interval between temperature updates (0=disabled)
+  else if (topicId == SUB_TEMP ) 
+  { 
+    if (msgValue == "reading") {
+      Serial.println("\t- MQTT request Temperature value");
+      requestTemperature = true;                                                  // Feed back the Temperature reading on next loop
+    } else if (msgValue.substring(0,8) == "interval") {
+      Serial.print("\t- MQTT set Temperature interval ");
+      configChanged = CONFIG_Command("TempInterval", msgValue, 1000, prefixChanged); // Seconds
+    }
+  }
+
+// * - "gate/timelapse/cmnd" 
+// *      -> "interval:<seconds>"     : set the time-lapse capture interval (0=disabled)
+// *      -> "window:<HH:MM>-<HH:MM>" : only capture within this (local) time window ("window:always" = all day)
+// *      -> "batch:<frames>"         : number of frames uploaded together
+  else if (topicId == SUB_TIMELAPSE ) 
+  { 
+    int valSplit = msgValue.indexOf(":"); 
+    String value = msgValue.substring(valSplit+1);
+    int h1, m1, h2, m2;
+    Config window = config;
+    if (valSplit <= 0) {
+      Serial.println("\t- MQTT time-lapse command >>> INVALID !!");
+    } else if (msgValue.substring(0,8) == "interval") {
+      Serial.print("\t- MQTT set time-lapse interval ");
+      configChanged = CONFIG_Command("LapseInterval", msgValue, 1, prefixChanged);  // Reschedules when changed
+    } else if (msgValue.substring(0,6) == "window") {
+      Serial.print("\t- MQTT set time-lapse window ");
+      if (value == "always") {
+        configChanged = (config.LapseStart != config.LapseEnd);
+        config.LapseStart = 0;
+        config.LapseEnd = 0;
+        Serial.println(value);
+      } else if (sscanf(value.c_str(), "%d:%d-%d:%d", &h1, &m1, &h2, &m2) == 4 && m1 >= 0 && m1 < 60 && m2 >= 0 && m2 < 60 &&
+                 CONFIG_ParseValue(window, "LapseStart", String(h1*60 + m1)) && CONFIG_ParseValue(window, "LapseEnd", String(h2*60 + m2))) {
+        Config previous = config;
+        config = window;
+        configChanged = CONFIG_Changed(previous, prefixChanged);
+        Serial.println(value);
+      } else {
+        Serial.println(" >>> INVALID !!");
+      }
+    } else if (msgValue.substring(0,5) == "batch") {
+      Serial.print("\t- MQTT set time-lapse batch ");
+      configChanged = CONFIG_Command("LapseBatch", msgValue, 1, prefixChanged);
+    }
+  }
+
+// * - "gate/monitor/cmnd" 
+// *      -> "restart"                  : trigger restart of ESP32
+// *      -> "getstate"                 : report the current state and telemetry values (RSSI, Memory, ..)
+// *      -> "getconfig"                : report the current state and telemetry values (RSSI, Memory, ..)
+// *      -> "getheap"                  : report the heap use per subsystem, largest free blocks, fragmentation
+// *      -> "profile"                  : report the tasks (stack, CPU use) and the time per loop section
+// *      -> "interval:<seconds>"       : set the interval between state updates (default=30s) (0=disabled)
+// *      -> "ReportState:<true/false>" : Enable/disable reporting full device state
+// *      -> "Reportwifi:<true/false>"  : Enable/disable reporting wifi strength
+// *      -> "<Field>:<value>"          : any other settable field of CONFIG_FIELDS (config name and unit)
+  else if (topicId == SUB_MONITOR ) 
+  { 
+    if (msgValue == "restart") {
+      Serial.println("\t- MQTT -- RESTART ESP32");
+      BlinkLED(3);                                                        // Visual indication during debugging
+      delay(100);
+      esp_restart();                                                      // RESTART ESP32 !!!!!
+    } else if (msgValue == "getstate") {
+      Serial.println("\t- MQTT request State and Telemetry values");
+      BlinkLED(1);
+      if (RL_Take(RL_TELEMETRY)) {
+        reportState();                                                    // Feedback current telemetry values (once)
+      } else {
+        RL_Drop(RL_TELEMETRY);
+      }
+    } else if (msgValue == "getconfig") {
+      Serial.println("\t- MQTT request Configuration values");
+      BlinkLED(1);
+      reportConfig();                                                     // Feedback current configuration (once)
+    } else if (msgValue == "wirebench") {
+      Serial.println("\t- MQTT compare the wire formats");
+      WIRE_Benchmark();                                                   // Sizes and serialization times (once)
+    } else if (msgValue == "wirekeys") {
+      Serial.println("\t- MQTT request short key table");
+      WIRE_ReportKeys();
+    } else if (msgValue.substring(0,6) == "format") {
+      Serial.print("\t- MQTT set wire format ");
+      int valSplit = msgValue.indexOf(":"); 
+      String format = (valSplit > 0) ? msgValue.substring(valSplit+1) : String("");
+      if (format == "json" || format == "msgpack") {
+        int wireFormat = (format == "msgpack") ? WIRE_MSGPACK : WIRE_JSON;
+        configChanged = (config.WireFormat != wireFormat);
+        config.WireFormat = wireFormat;
+        Serial.println(format);
+      } else {
+        Serial.println(" >>> INVALID !!");
+      }
+    } else if (msgValue == "getheap") {
+      Serial.println("\t- MQTT request Heap usage");
+      HEAP_Report();                                                      // Feedback heap state per subsystem (once)
+    } else if (msgValue == "profile") {
+      Serial.println("\t- MQTT request profile");
+      PROFILE_Report(NULL, 0);                                            // Feedback tasks, loop section times (once)
+    } else if (msgValue.substring(0,8) == "interval") {
+      Serial.print("\t- MQTT set State interval ");
+      configChanged = CONFIG_Command("StateInterval", msgValue, 1000, prefixChanged);  // Seconds
+    } else if (msgValue.substring(0,5) == "power") {
+      Serial.print("\t- MQTT set power mode ");
+      int valSplit = msgValue.indexOf(":"); 
+      String mode = msgValue.substring(valSplit+1);
+      int newMode = (mode == "on") ? POWER_ON : (mode == "light") ? POWER_LIGHT : (mode == "deep") ? POWER_DEEP : -1;
+      if (valSplit > 0 && newMode >= 0) {
+        configChanged = (config.PowerMode != newMode);
+        config.PowerMode = newMode;
+        Serial.println(mode);
+      } else {
+        Serial.println(" >>> INVALID !!");
+      }
+    } else if (msgValue.substring(0,9) == "sleepidle") {
+      Serial.print("\t- MQTT set sleep idle time ");
+      configChanged = CONFIG_Command("SleepIdle", msgValue, 1000, prefixChanged);  // Seconds, at least 5 (to receive commands)
+    } else if (msgValue.substring(0,6) == "prefix") {
+      Serial.print("\t- MQTT set topic prefix ");
+      int valSplit = msgValue.indexOf(":"); 
+      Config previous = config;
+      if (valSplit > 0 && CONFIG_ParseCommand(config, String("TopicPrefix") + msgValue.substring(valSplit))) {
+        configChanged = CONFIG_Changed(previous, prefixChanged);          // Same checks as "TopicPrefix:<name>" ("mac" = from the MAC)
+        Serial.println(config.TopicPrefix);
+      } else {
+        Serial.println(" >>> INVALID !!");
+      }
+    } else if (msgValue.substring(0,9) == "ratelimit") {
+      Serial.print("\t- MQTT set rate limit ");
+      int valSplit = msgValue.indexOf(":"); 
+      if (valSplit > 0 && RL_Configure(msgValue.substring(valSplit+1))) {
+        Serial.println(msgValue.substring(valSplit+1));
+      } else {
+        Serial.println(" >>> INVALID !!");
+      }
+    } else {
+      // Any other settable configuration field: "<name>:<value>" (CONFIG_FIELDS).
+      Config previous = config;
+      if (CONFIG_ParseCommand(config, msgValue)) {
+        Serial.print("\t- MQTT set "); Serial.println(msgValue);
+        configChanged = CONFIG_Changed(previous, prefixChanged);
+      } else {
+        Serial.print("\t- MQTT monitor command not handled: "); Serial.println(msgValue);
+      }
+    }
+  }
+
+// * - "gate/monitor/setconfig"
+// *      -> "<JSON>"                   : any subset of the configuration, validated as a whole, saved and reported once
+  else if (topicId == SUB_SETCONFIG )
+  {
+    char error[64];
+    Config previous = config;
+
+    Serial.println("\t- MQTT set configuration (JSON)");
+    if (CONFIG_Apply(message, length, error, sizeof(error))) {
+      configChanged = CONFIG_Changed(previous, prefixChanged);
+      configEcho = true;                                                  // Acknowledge, also if nothing changed
+    } else {
+      Serial.print("\t  >>> REJECTED: "); Serial.println(error);
+      mqttPublish(topics[PUB_CONFIGERROR], error);
+    }
+  }
+  else {
+    Serial.println("\t- MQTT topic not handled");                          // e.g. "<prefix>/<other>/cmnd" (wildcard)
+  }
+  if (prefixChanged) {
+    // Move to the new topics (topic/message buffers are not used after this).
+    MQTT_Subscribe(false);
+    MQTT_BuildTopics();
+    MQTT_Subscribe(true);
+  }
+  if (configChanged) {
+    // The configuration changed. Update the local SPIFFS config file with the new value.
+    saveConfig();
+  }
+  if (configChanged || configEcho) {
+    reportConfig();     // feedback of new configuration settings
+  }
+}
+
+/**************************************************************************
+ * isrDetectMovement
+ * - interrupt routine called when the PIR detected movement.
+ **************************************************************************/
+static void IRAM_ATTR isrDetectMovement(void * arg) {
+  //Serial.println("MOTION DETECTED!!!");
+  // Only queue the (timestamped) edge, everything else is done in loop().
+  bool high = (REG_READ(GPIO_IN_REG) >> pinPIR) & 1;
+  EVT_Push(&isrEvents, high ? EVT_PIR_RISE : EVT_PIR_FALL, esp_timer_get_time());
+}
+
+/**************************************************************************
+ * _http_event_handler
+ * - manages HTTP events.
+ **************************************************************************/
+esp_err_t _http_event_handler(esp_http_client_event_t *evt)
+{
+  switch (evt->event_id) {
+    case HTTP_EVENT_ERROR:
+      Serial.println("HTTP_EVENT_ERROR");
+      break;
+    case HTTP_EVENT_ON_CONNECTED:
+//      Serial.println("HTTP_EVENT_ON_CONNECTED");
+      break;
+    case HTTP_EVENT_HEADER_SENT:
+//      Serial.println("HTTP_EVENT_HEADER_SENT");
+      break;
+    case HTTP_EVENT_ON_HEADER:
+//      Serial.println();
+//      Serial.printf("HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+      break;
+    case HTTP_EVENT_ON_DATA:
+//      Serial.println();
+//      Serial.printf("HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
+      if (!esp_http_client_is_chunked_response(evt->client)) {
+        // Write out data
+        printf("%.*s", evt->data_len, (char*)evt->data);
+      }
+      break;
+    case HTTP_EVENT_ON_FINISH:
+//      Serial.println("");
+      Serial.println("HTTP_EVENT_ON_FINISH");
+      break;
+    case HTTP_EVENT_DISCONNECTED:
+      Serial.println("HTTP_EVENT_DISCONNECTED");
+      break;
+  }
+  return ESP_OK;
+}
+
+/**************************************************************************
+ * http_Write
+ * - Write all data to the open HTTP request (esp_http_client_write may write less).
+ **************************************************************************/
+static bool http_Write(esp_http_client_handle_t http_client, const char * data, size_t len) {
+  while (len > 0) {
+    int written = esp_http_client_write(http_client, data, len);
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    len -= written;
+  }
+  return true;
+}
+
+/**************************************************************************
+ * http_ImageHeader
+ * - Multipart header of an image part (also ends the previous part).
+ **************************************************************************/
+static int http_ImageHeader(char * buf, size_t size, const char * name) {
+  return snprintf(buf, size, "\r\n--" UPLOAD_BOUNDARY "\r\n"
+                  "Content-Disposition: form-data; name=\"%s\"; filename=\"gatecam.jpg\"\r\n"
+                  "Content-Type: image/jpeg\r\n\r\n", name);
+}
+
+/**************************************************************************
+ * http_UploadImages
+ * - POST one or more images as multipart/form-data:
+ *   - "meta"  : JSON document describing the capture(s)
+ *   - <name>  : the JPEG(s), written straight from their buffers
+ * - The multipart framing is built up front so the length is known, and
+ *   the request is streamed without copying the images.
+ **************************************************************************/
+static esp_err_t http_UploadImages(const char * name, const uint8_t * const images[], const size_t lens[], int count, const JsonDocument& meta) {
+  static const char* tail = "\r\n--" UPLOAD_BOUNDARY "--\r\n";
+  char head[UPLOAD_HEAD_SIZE];
+  char partHead[160];
+
+  // Framing: meta part header and meta JSON. Each image is preceded by its own part header.
+  size_t headLen = snprintf(head, sizeof(head), "--" UPLOAD_BOUNDARY "\r\n"
+                            "Content-Disposition: form-data; name=\"meta\"\r\n"
+                            "Content-Type: application/json\r\n\r\n");
+  headLen += serializeJson(meta, head + headLen, sizeof(head) - headLen);
+  if (headLen >= sizeof(head) - 1) {
+    Serial.println("\t---! Upload: metadata too large");
+    return ESP_ERR_INVALID_SIZE;
+  }
+  size_t partHeadLen = http_ImageHeader(partHead, sizeof(partHead), name);
+  size_t contentLen = headLen + count * partHeadLen + strlen(tail);
+  for (int i = 0; i < count; i++) {
+    contentLen += lens[i];
+  }
+
+  esp_http_client_config_t config_client = {0};
+  config_client.url = upload_url;
+  config_client.event_handler = _http_event_handler;
+  config_client.method = HTTP_METHOD_POST;
+
+  size_t heapBefore = HEAP_Begin();
+  esp_http_client_handle_t http_client = esp_http_client_init(&config_client);
+  esp_http_client_set_header(http_client, "Content-Type", "multipart/form-data; boundary=" UPLOAD_BOUNDARY);
+
+  int64_t uploadStart = esp_timer_get_time();
+  esp_err_t err = esp_http_client_open(http_client, contentLen);
+  if (err == ESP_OK) {
+    bool written = http_Write(http_client, head, headLen);
+    for (int i = 0; i < count && written; i++) {
+      written = http_Write(http_client, partHead, partHeadLen) &&
+                http_Write(http_client, (const char *)images[i], lens[i]);
+    }
+    if (written && http_Write(http_client, tail, strlen(tail))) {
+      esp_http_client_fetch_headers(http_client);
+      int status = esp_http_client_get_status_code(http_client);
+      if (status < 200 || status > 299) {
+        Serial.printf("\t---! Upload: HTTP status %d\n", status);
+        err = ESP_FAIL;
+      }
+    } else {
+      Serial.println("\t---! Upload: write failed");
+      err = ESP_FAIL;
+    }
+    esp_http_client_close(http_client);
+  } else {
+    Serial.printf("\t---! Upload: connect failed (err=0x%x)\n", err);
+  }
+  esp_http_client_cleanup(http_client);
+  HEAP_End(HEAP_HTTP, heapBefore);
+  METRIC_Upload(err == ESP_OK, contentLen, (esp_timer_get_time() - uploadStart) / 1000);
+
+  return err;
+}
+
+/**************************************************************************
+ * http_UploadPhoto
+ * - POST a single photo with its capture details ("meta" and "image" parts).
+ **************************************************************************/
+static esp_err_t http_UploadPhoto(const uint8_t * photo, size_t photoLen, const JsonDocument& meta) {
+  return http_UploadImages("image", &photo, &photoLen, 1, meta);
+}
+
+/**************************************************************************
+ * LAPSE_Upload
+ * - Upload the batched time-lapse frames in a single request. Upload stage
+ *   task (PIPE_UploadTask), the batch is not touched by the loop meanwhile.
+ **************************************************************************/
+esp_err_t LAPSE_Upload(const LapseBatch * batch) {
+  const uint8_t * images[LAPSE_MAX_BATCH];
+  HeapJsonDocument meta(256 + batch->count * JSON_OBJECT_SIZE(2));
+  char timestamp[24];
+  struct tm utc;
+
+  meta["trigger"] = "timelapse";
+  if (!isnan(lastTemperature)) {
+    meta["temperature"] = lastTemperature;
+  }
+  meta["rssi"] = WiFi.RSSI();
+  JsonArray frames = meta.createNestedArray("frames");          // one entry per image part, in order
+  for (int i = 0; i < batch->count; i++) {
+    images[i] = batch->buffer + batch->offset[i];
+    JsonObject frame = frames.createNestedObject();
+    if (batch->taken[i] > 1600000000) {
+      strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&batch->taken[i], &utc));
+      frame["time"] = timestamp;
+    }
+    frame["size"] = batch->len[i];
   }
+
+  Serial.printf("\t- Uploading %d time-lapse frame(s)\n", batch->count);
+  return http_UploadImages("timelapse[]", images, batch->len, batch->count, meta);
 }
 
 /**************************************************************************
- * cam_StreamHandler
- * - 
+ * LAPSE_Flush
+ * - Hand the batched time-lapse frames to the upload stage (one request),
+ *   so the loop doesn't wait for the upload. The result is counted in
+ *   LAPSE_Done. Captures go to the other batch meanwhile.
+ * - Offline the frames are dropped (and counted), not retried.
+ * - false: the upload stage is busy, try again later (the batch is kept).
  **************************************************************************/
-static esp_err_t cam_StreamHandler(httpd_req_t *req) {
-  camera_fb_t * fb = NULL;
-  esp_err_t res = ESP_OK;
-  size_t _jpg_buf_len = 0;
-  uint8_t * _jpg_buf = NULL;
-  char * part_buf[64];
+bool LAPSE_Flush() {
+  LapseBatch * batch = &lapse.batches[lapse.filling];
 
-  Serial.println("Camera StreamHandler started");
+  if (batch->count == 0) {
+    return true;
+  }
+  if (batch->uploading || !pipeUpload.queue || uxQueueSpacesAvailable(pipeUpload.queue) == 0) {
+    return false;
+  }
+  if (!wifiUp) {
+    lapse.failed += batch->count;
+    batch->count = 0;
+    batch->used = 0;
+    return true;
+  }
+  PhotoJob job = { "timelapse", 0, NULL, ESP_OK, -1, 0, 0, false, batch };
+  if (!PIPE_Send(&pipeUpload, &job, 0)) {
+    return false;
+  }
+  pipeInFlight++;
+  batch->uploading = true;
+  lapse.filling = 1 - lapse.filling;
+  return true;
+}
 
-  res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-  if (res != ESP_OK) {
-    return res;
+/**************************************************************************
+ * LAPSE_Done
+ * - A batch is back from the upload stage (photo_Results, loop): count it
+ *   and empty it for the next frames.
+ **************************************************************************/
+void LAPSE_Done(LapseBatch * batch, esp_err_t result) {
+  if (result == ESP_OK) {
+    lapse.uploads++;
+  } else {
+    lapse.failed += batch->count;
   }
-  
-  // loop until web server is stopped (MQTT video toggle) ...
-//  while (runWebServer) {
+  batch->count = 0;
+  batch->used = 0;
+  batch->uploading = false;
+}
 
-  while (true) {
-    fb = esp_camera_fb_get();
-    if (!fb) {
-      Serial.println("\t---! SH: Camera capture failed");
-      res = ESP_FAIL;
-    } else {
-      if (fb->width > 400) {
-        if (fb->format != PIXFORMAT_JPEG) {
-          bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-          esp_camera_fb_return(fb);
-          fb = NULL;
-          if (!jpeg_converted) {
-            Serial.println("\t---! SH: JPEG compression failed");
-            res = ESP_FAIL;
-          }
-        } else {
-          _jpg_buf_len = fb->len;
-          _jpg_buf = fb->buf;
-        }
-      }
-    }
-    if (res == ESP_OK) {
-      size_t hlen = snprintf((char *)part_buf, 64, _STREAM_PART, _jpg_buf_len);
-      res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+/**************************************************************************
+ * LAPSE_Capture
+ * - Take a time-lapse frame and add it to the batch (uploaded when full).
+ **************************************************************************/
+void LAPSE_Capture() {
+  LapseBatch * batch = &lapse.batches[lapse.filling];
+
+  if (!batch->buffer) {
+    batch->buffer = (uint8_t *)HEAP_Alloc(HEAP_CAMERA, LAPSE_BUFFER_SIZE, MALLOC_CAP_SPIRAM);
+    if (!batch->buffer) {
+      Serial.println("\t---! Time-lapse: no memory for the frame buffer");
+      lapse.failed++;
+      return;
     }
-    if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
+  }
+  if (batch->uploading) {
+    lapse.failed++;                                               // Not expected: captures wait for the pipeline (LAPSE_Check)
+    return;
+  }
+
+  camera_fb_t * fb = esp_camera_fb_get();
+  if (!fb) {
+    Serial.println("\t---! Time-lapse: camera capture failed");
+    lapse.failed++;
+    return;
+  }
+  METRIC_Add(metrics.frames[FRAME_LAPSE]);
+  if (fb->len > LAPSE_BUFFER_SIZE) {
+    lapse.failed++;
+    esp_camera_fb_return(fb);
+    return;
+  }
+  if (batch->used + fb->len > LAPSE_BUFFER_SIZE) {
+    // No room for this frame: send the batch first, the frame starts the other one.
+    if (!LAPSE_Flush()) {
+      lapse.failed++;
+      esp_camera_fb_return(fb);
+      return;
     }
-    if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+    batch = &lapse.batches[lapse.filling];
+    if (!batch->buffer) {
+      batch->buffer = (uint8_t *)HEAP_Alloc(HEAP_CAMERA, LAPSE_BUFFER_SIZE, MALLOC_CAP_SPIRAM);
     }
-    if (fb) {
+    if (!batch->buffer || batch->uploading) {
+      lapse.failed++;
       esp_camera_fb_return(fb);
-      fb = NULL;
-      _jpg_buf = NULL;
-    } else if (_jpg_buf) {
-      free(_jpg_buf);
-      _jpg_buf = NULL;
-    }
-    if (res != ESP_OK) {
-      break;
+      return;
     }
-    //Serial.printf("MJPG: %uB\n",(uint32_t)(_jpg_buf_len));
   }
+  batch->offset[batch->count] = batch->used;
+  batch->len[batch->count] = fb->len;
+  batch->taken[batch->count] = time(NULL);
+  memcpy(batch->buffer + batch->used, fb->buf, fb->len);
+  batch->used += fb->len;
+  batch->count++;
+  lapse.captured++;
+  esp_camera_fb_return(fb);
 
-  Serial.println("- SH: StreamHandler stopped");
-  return res;
+  if (batch->count >= constrain(config.LapseBatch, 1, LAPSE_MAX_BATCH)) {
+    LAPSE_Flush();                                                // Upload stage busy: sent from LAPSE_Check
+  }
 }
 
 /**************************************************************************
- * cam_StopStartHTTPServer
- * - Start the web server for video
+ * LAPSE_InWindow
+ * - Is the time-lapse active window open? (start = end: always open)
+ * - A window needs the local time, so it stays closed until NTP has synced.
  **************************************************************************/
-void cam_StopStartHTTPServer() {
-  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  config.server_port = 80;
+bool LAPSE_InWindow(time_t now) {
+  struct tm local;
 
-Serial.print("-- cam_StopStartHTTPServer: stream is null - "); Serial.println( (stream_httpd == NULL) );
+  if (config.LapseStart == config.LapseEnd) {
+    return true;
+  }
+  if (now < 1600000000) {
+    return false;
+  }
+  localtime_r(&now, &local);
+  int minute = local.tm_hour * 60 + local.tm_min;
+  if (config.LapseStart < config.LapseEnd) {
+    return (minute >= config.LapseStart && minute < config.LapseEnd);
+  }
+  return (minute >= config.LapseStart || minute < config.LapseEnd);   // window over midnight
+}
 
-  if (runWebServer) {
-    Serial.println("- Cam StartServer start");
+/**************************************************************************
+ * LAPSE_Check
+ * - Time-lapse scheduler, called from the loop.
+ * - Captures are aligned to the clock (e.g. every 5 minutes at :00, :05,
+ *   ..) within the active window.
+ * - While a motion session or video stream uses the camera, a capture is
+ *   deferred, and skipped if still busy halfway to the next capture.
+ **************************************************************************/
+void LAPSE_Check() {
+  time_t now = time(NULL);
 
-    httpd_uri_t index_uri = {
-      .uri       = "/",
-      .method    = HTTP_GET,
-      .handler   = cam_StreamHandler,
-      .user_ctx  = NULL
-    };
-    //Serial.printf("Starting web server on port: '%d'\n", config.server_port);
-    if (httpd_start(&stream_httpd, &config) == ESP_OK) {
-      httpd_register_uri_handler(stream_httpd, &index_uri);
+  if (config.LapseInterval <= 0) {
+    LAPSE_Flush();                                                // Disabled: send what is left
+    return;
+  }
+  LapseBatch * batch = &lapse.batches[lapse.filling];
+  if (batch->count >= constrain(config.LapseBatch, 1, LAPSE_MAX_BATCH)) {
+    LAPSE_Flush();                                                // Full batch the upload stage had no room for
+  }
+  if (rtcState.lapseNext == 0 || rtcState.lapseNext > now + config.LapseInterval) {
+    // First run, interval changed or the clock jumped (NTP): find the next slot.
+    rtcState.lapseNext = (now / config.LapseInterval + 1) * config.LapseInterval;
+  }
+  if (now < rtcState.lapseNext) {
+    return;
+  }
+
+  if (!LAPSE_InWindow(now)) {
+    LAPSE_Flush();                                                // Window closed: send the rest of the batch
+  } else if (motion.active || streamClients > 0 || pendingPhotos > 0 || pipeInFlight > 0 || clipRecording) {
+    if (!lapse.deferred) {
+      Serial.println("Loop - Time-lapse capture deferred, camera busy");
+      lapse.deferred = true;
+      lapse.deferrals++;
     }
-  } else {
-    Serial.println("- Cam StartServer stop");
-    if (stream_httpd != NULL) {
-      httpd_stop(stream_httpd);
+    if (now < rtcState.lapseNext + config.LapseInterval / 2) {
+      return;                                                     // Try again on the next loop
     }
+    Serial.println("Loop - Time-lapse capture skipped, camera busy");
+    lapse.skipped++;
+  } else {
+    Serial.println("Loop - Time-lapse capture");
+    LAPSE_Capture();
   }
-  Serial.println("Cam StartServer done");
+  lapse.deferred = false;
+  rtcState.lapseNext = (now / config.LapseInterval + 1) * config.LapseInterval;
 }
 
 /**************************************************************************
- * cam_StopStartHTTPServer
- * - Start the web server for video
+ * NIGHT_Luma
+ * - Average luminance (0-255) of a JPEG frame, from the 1/8-scale decode of
+ *   img_Cells. -1 when the frame can not be decoded.
  **************************************************************************/
-void cam_StartHTTPServer() {
-  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  config.server_port = 80;
-
-Serial.print("-- cam_StartHTTPServer: stream is null - "); Serial.println( (stream_httpd == NULL) );
+static int NIGHT_Luma(const camera_fb_t * fb) {
+  uint8_t cells[64];
+  int total = 0;
 
-  if (stream_httpd == NULL) {
-    Serial.println("- Cam StartServer start");
+  if (fb->format != PIXFORMAT_JPEG || !img_Cells(fb, false, cells)) {
+    return -1;
+  }
+  for (int i = 0; i < 64; i++) {
+    total += cells[i];
+  }
+  return total / 64;
+}
 
-    httpd_uri_t index_uri = {
-      .uri       = "/",
-      .method    = HTTP_GET,
-      .handler   = cam_StreamHandler,
-      .user_ctx  = NULL
-    };
-    //Serial.printf("Starting web server on port: '%d'\n", config.server_port);
-    if (httpd_start(&stream_httpd, &config) == ESP_OK) {
-      httpd_register_uri_handler(stream_httpd, &index_uri);
-    }
+/**************************************************************************
+ * NIGHT_Learn
+ * - Steer the night exposure towards NIGHT_LUMA_TARGET, from the luminance
+ *   of the last night photo. Exposure first, gain only when the exposure is
+ *   at its maximum (and lowered first, for less noise).
+ **************************************************************************/
+static void NIGHT_Learn(int luma) {
+  if (luma < 0 || abs(luma - NIGHT_LUMA_TARGET) * 8 < NIGHT_LUMA_TARGET) {
+    return;                                                         // Close enough
+  }
+  float ratio = constrain((float)NIGHT_LUMA_TARGET / max(luma, 1), 0.5f, 2.0f);
+  int aec = night.aecValue * ratio;
+
+  if (ratio < 1 && night.agcGain > 0) {
+    night.agcGain = max(night.agcGain - 2, 0);
+  } else if (aec > NIGHT_AEC_MAX) {
+    night.aecValue = NIGHT_AEC_MAX;
+    night.agcGain = min(night.agcGain + 2, NIGHT_AGC_MAX);
   } else {
-    Serial.println("- Cam StartServer already running");
+    night.aecValue = max(aec, 1);
   }
-  Serial.println("Cam StartServer done");
 }
 
 /**************************************************************************
- * readConfig
- * - Get the settings on initialisation.
+ * NIGHT_GetFrame
+ * - Night capture: after a trigger in the dark the sensor's AEC/AGC need
+ *   many frames to settle on the flash. Instead the scene luminance is
+ *   estimated from the frame already waiting in the driver (running
+ *   exposure, 1/8-scale decode, no sensor reconfiguration), and when it is
+ *   dark (or "night" is 2):
+ *   - the learned exposure and gain are loaded (AEC/AGC off),
+ *   - the flash LED is switched on and the first frame exposed after that
+ *     is the photo (cam_FreshFrame), the flash goes off right after it,
+ *   - AEC/AGC are restored and the photo luminance steers the next preload.
+ * - Light scenes: a normal photo (cam_GetFrame).
  **************************************************************************/
-static esp_err_t readConfig() {
-  int res = 0;
-  bool readConfigOK = false;
+static camera_fb_t * NIGHT_GetFrame(int64_t triggerTime) {
+  camera_fb_t * fb = esp_camera_fb_get();
 
-  if (SPIFFS.begin(true)) {
-    //Serial.println("ReadConfig: SPIFFS mounted");
-    if ( SPIFFS.exists(CONFIGFILE) ) {
-      File configFile = SPIFFS.open(CONFIGFILE, FILE_READ);
+  if (!fb) {
+    return NULL;
+  }
+  METRIC_Add(metrics.frames[FRAME_PHOTO]);
+  int luma = NIGHT_Luma(fb);
+  if (luma >= 0) {
+    night.sceneLuma = luma;
+  }
+  if (camSettings.night == 1 && (luma < 0 || luma >= NIGHT_LUMA_DARK)) {
+    return cam_GetFrame(triggerTime, fb);
+  }
 
-      if ( configFile ) {
-        // Config file opened ok. Read contents.
-        StaticJsonDocument<256> configDoc;
-        DeserializationError error = deserializeJson(configDoc, configFile);
-        if (error) {
-          Serial.print(F("\t---! Failed to deserialize file. Err: ")); Serial.println(error.c_str());           
-        } else {
-          config.CAM_enabled = configDoc["CAM_enabled"] | true;           // Enable taking photos and upload.
-          config.PIR_enabled = configDoc["PIR_enabled"] | true;           // Enable motion detection.
-          config.PIR_delay = configDoc["PIR_delay"] | 20000;              // Wait 20 seconds before reporting new motion event.
-          config.TempInterval = configDoc["TempInterval"] | 60000;        // Upload temperature once per minute. 
-          config.ReportState = configDoc["ReportState"] | true;           // Upload device state.
-          config.ReportWiFi = configDoc["ReportWiFi"] | false;            // Upload WiFi value. (default: false) 
-          config.StateInterval = configDoc["StateInterval"] | 60000;      // Upload state values once per minute.
+  unsigned long drained = freshStats.drained;
+  sensor_t * s = esp_camera_sensor_get();
+  cam_SetParam(s, CP_AEC, 0);
+  cam_SetParam(s, CP_AGC, 0);
+  cam_SetParam(s, CP_AEC_VALUE, night.aecValue);
+  cam_SetParam(s, CP_AGC_GAIN, night.agcGain);
+  digitalWrite(pinFlashLED, HIGH);
+  int64_t lit = esp_timer_get_time();
 
-          readConfigOK = true;
-          res = 1;
-        }
+  fb = cam_FreshFrame(fb, lit);                                     // The estimate frame is stale: next exposed frame
+  digitalWrite(pinFlashLED, flashState);
+  for (int p : { CP_AEC, CP_AGC, CP_AEC_VALUE, CP_AGC_GAIN }) {
+    cam_SetParam(s, p, camSettings.sensor[p]);
+  }
+  if (!fb) {
+    return NULL;
+  }
 
-      } else {
-        Serial.println("\t---! Failed to open existing file for reading.");
+  night.photos++;
+  night.frames += 2 + freshStats.drained - drained;                 // Estimate frame, drained frames and the photo
+  luma = NIGHT_Luma(fb);
+  if (luma >= 0) {
+    night.photoLuma = luma;
+  }
+  NIGHT_Learn(luma);
+  Serial.printf("\t- Night photo: scene %d, exposure %d, gain %d\n", night.sceneLuma, night.aecValue, night.agcGain);
+  return fb;
+}
+
+/**************************************************************************
+ * photo_Usable
+ * - Trigger to usable frame: the time from the trigger until the photo is
+ *   out of the camera.
+ **************************************************************************/
+static void photo_Usable(UsableLatency * stats, long us) {
+  stats->lastUs = us;
+  stats->maxUs = max(stats->maxUs, us);
+  stats->sumUs += us;
+  stats->photos++;
+}
+
+/**************************************************************************
+ * photo_Capture
+ * - Pipeline capture stage: take a photo (exposed after triggerTime in fresh
+ *   frame mode, see cam_GetFrame; with the flash in night capture, see
+ *   NIGHT_GetFrame).
+ **************************************************************************/
+static camera_fb_t * photo_Capture(int64_t triggerTime)
+{
+  Serial.println("\t- Taking picture...");
+
+  unsigned long nightPhotos = night.photos;
+  // A client streaming at its own quality: the photo quality, from a frame exposed after the change.
+  int64_t qualityAt = cam_SetQuality(1) ? esp_timer_get_time() : 0;
+  camera_fb_t * fb = (camSettings.night > 0) ? NIGHT_GetFrame(triggerTime) : cam_GetFrame(triggerTime);
+  if (fb && qualityAt > 0) {
+    fb = cam_FreshFrame(fb, qualityAt);
+  }
+  cam_SetQuality(-1);
+  if (!fb) {
+    Serial.println("\t- Camera capture failed!");
+    return NULL;
+  }
+  if (triggerTime > 0) {
+    long usable = esp_timer_get_time() - triggerTime;
+    photo_Usable(&usableStats, usable);
+    if (night.photos != nightPhotos) {
+      photo_Usable(&night.usable, usable);
+    }
+  }
+  return fb;
+}
+
+/**************************************************************************
+ * SPOOL_Copy / photo_Release
+ * - Copy a photo for the offline spool (PSRAM, one block: frame header and
+ *   JPEG), so the driver frame can go back right away. NULL: no memory.
+ * - Hand a photo back: a spool copy is freed, a frame returned to the driver.
+ **************************************************************************/
+camera_fb_t * SPOOL_Copy(const camera_fb_t * fb) {
+  camera_fb_t * copy = (camera_fb_t *)HEAP_Alloc(HEAP_CAMERA, sizeof(camera_fb_t) + fb->len, MALLOC_CAP_SPIRAM);
+
+  if (copy) {
+    *copy = *fb;
+    copy->buf = (uint8_t *)(copy + 1);
+    memcpy(copy->buf, fb->buf, fb->len);
+  }
+  return copy;
+}
+
+void photo_Release(camera_fb_t * fb, bool spooled) {
+  if (spooled) {
+    HEAP_Free(fb);
+  } else {
+    esp_camera_fb_return(fb);
+  }
+}
+
+/**************************************************************************
+ * photo_Send
+ * - Pipeline upload stage: uploads the photo to the server, together with
+ *   the capture details (trigger, time, temperature, ..)
+ * - The caller hands the photo back (photo_Release).
+ * - Runs on the upload task: the hash, distance, throughput and crop
+ *   statistics go back in the job (job->upload), the loop applies them.
+ **************************************************************************/
+static esp_err_t photo_Send(PhotoJob * job)
+{
+  camera_fb_t * fb = job->fb;
+  PhotoUpload * up = &job->upload;
+
+  // Skip the upload if the photo is (nearly) the same as the last uploaded one.
+  // A new reference photo is uploaded at least every IMG_DEDUP_REFRESH (photo_Reference).
+  int64_t hashStart = esp_timer_get_time();
+  up->hashed = (config.DedupThreshold > 0) && img_Hash(fb, &up->hash);
+  if (up->hashed) {
+    up->hashUs = esp_timer_get_time() - hashStart;
+    if (up->referenceValid) {
+      job->distance = IMG_HashDistance(up->hash, up->reference);
+      if (IMG_Duplicate(job->distance, config.DedupThreshold)) {
+        Serial.printf("\t- Duplicate photo (distance %d), upload skipped\n", job->distance);
+        return PHOTO_DUPLICATE;
       }
-      // Close the file
-      configFile.close();
-    } else {
-      Serial.println("\t---!  ReadConfig: SPIFFS does not exist");
     }
+  }
+
+  // Crop to the region of interest (software). On failure the full frame is uploaded.
+  uint8_t * photo = fb->buf;
+  size_t photoLen = fb->len;
+  uint8_t * roiPhoto = NULL;
+  if (camSettings.roiMode == 1 && img_CropRoi(fb, &roiPhoto, &photoLen, up)) {
+    photo = roiPhoto;
   } else {
-    Serial.println("\t---!  ReadConfig: SPIFFS mount failed");
+    photoLen = fb->len;
   }
 
-  if ( !readConfigOK ) {
-    // Configuration in SPIFFS not found/loaded. Initialize with defaults and save to new SPIFFS file.
-    config.CAM_enabled = true;          // Enable taking photos and upload.
-    config.PIR_enabled = true;          // Enable motion detection.
-    config.PIR_delay = 20000;           // Wait 20 seconds before reporting new motion event.
-    config.TempInterval = 60000;        // Upload temperature once per minute.
-    config.ReportState =  true;         // Upload device state.
-    config.ReportWiFi = false;          // Upload WiFi value.  (default: false)
-    config.StateInterval = 60000;       // Upload state values once per minute.
+  // Describe the capture, sent along with the photo.
+  StaticJsonDocument<384> meta;
+  char timestamp[24];
+  time_t now = time(NULL) - (esp_timer_get_time() - cam_FrameTime(fb)) / 1000000;   // capture time (spooled photos: earlier)
+  struct tm utc;
+  if (now > 1600000000) {
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&now, &utc));
+    meta["time"] = timestamp;                                   // capture time (UTC), only when synced with NTP
+  }
+  meta["uptime_ms"] = (unsigned long)(cam_FrameTime(fb) / 1000);
+  meta["trigger"] = job->trigger;                               // pir / mqtt
+  if (camSettings.freshFrame) {
+    meta["latency_ms"] = (long)((cam_FrameTime(fb) - freshStats.framePeriod - job->triggerTime) / 1000);   // trigger to exposure start
+  }
+  if (!isnan(lastTemperature)) {
+    meta["temperature"] = lastTemperature;
+  }
+  meta["framesize"] = camSettings.framesize;
+  meta["quality"] = camSettings.quality;
+  meta["width"] = fb->width;
+  meta["height"] = fb->height;
+  meta["roi"] = (photo != fb->buf);
+  if (up->hashed) {
+    char hashHex[17];
+    snprintf(hashHex, sizeof(hashHex), "%08x%08x", (uint32_t)(up->hash >> 32), (uint32_t)up->hash);
+    meta["hash"] = hashHex;
+  }
+  meta["rssi"] = WiFi.RSSI();
+
+  // Now upload to server.
+  int64_t uploadStart = esp_timer_get_time();
+  esp_err_t err = http_UploadPhoto(photo, photoLen, meta);
+  if (err == ESP_OK) {
+    // Upload throughput (used for the target upload time).
+    up->rate = photoLen * 1000000.0 / max((int64_t)1, esp_timer_get_time() - uploadStart);
+  }
 
-    Serial.println("\t- Unable to read config. Defaults set. Saving new config....");
+  if (roiPhoto) {
+    free(roiPhoto);
+  }
+  return err;
+}
 
-    // Save config to SPIFFS.
-    saveConfig();
+/**************************************************************************
+ * MOTION_NoiseFactor
+ * - How much longer than PIR_delay to wait before a PIR retrigger (within a
+ *   motion session) takes another photo. 1 in normal conditions, up to
+ *   MOTION_MAX_SUPPRESS when the PIR pulses faster than MOTION_NOISY_RATE
+ *   (e.g. wind, sun on vegetation).
+ **************************************************************************/
+float MOTION_NoiseFactor(int64_t now) {
+  return constrain(MOTION_PulseRate(now) / MOTION_NOISY_RATE, 1.0f, (float)MOTION_MAX_SUPPRESS);
+}
 
-    res = 1;
+/**************************************************************************
+ * MOTION_Rise
+ * - PIR output went high: start a motion session, or continue the current one.
+ * - Returns true if a photo must be taken.
+ **************************************************************************/
+bool MOTION_Rise(int64_t time) {
+  if (motion.lastRise != 0 && time > motion.lastRise) {
+    float rate = 60000000.0f / (time - motion.lastRise);
+    motion.pulseRate += MOTION_SMOOTHING * (rate - motion.pulseRate);
   }
-  return res;  
+  motion.lastRise = time;
+  motion.pirHigh = true;
+  motion.pulses++;
+
+  if (!motion.active) {
+    // A new motion session: reported unless rate limited.
+    motion.active = true;
+    motion.sessionStart = time;
+    motion.sessionPulses = 0;
+    motion.sessions++;
+    Serial.println("Loop - Motion Detected"); 
+    motion.published = RL_Take(RL_MOTION);
+    if (motion.published) {
+      mqttPublish(topics[PUB_MOTION], "on");
+      StaticJsonDocument<64> doc;
+      doc["event"] = "start";
+      mqttPublishJson(topics[PUB_MOTIONSESSION], doc);
+    } else {
+      RL_Drop(RL_MOTION);
+    }
+  }
+  motion.sessionPulses++;
+
+  // Photo at the start of motion, and again while motion continues, but not
+  // more often than PIR_delay (longer when the PIR is noisy).
+  int64_t holdoff = (int64_t)(config.PIR_delay * MOTION_NoiseFactor(time)) * 1000;
+  if (motion.lastPhoto == 0 || time - motion.lastPhoto >= holdoff) {
+    motion.lastPhoto = time;
+    return true;
+  }
+  motion.suppressed++;
+  return false;
 }
 
 /**************************************************************************
- * WiFi_init
- * - Connect to local SSID
+ * MOTION_Fall
+ * - PIR output went low: track the pulse width.
  **************************************************************************/
-bool WiFi_init()
-{
-  int connAttempts = 0;
-  Serial.print("\r\nConnecting to: "); Serial.println(ssid);
-  WiFi.begin(ssid, password);
-  while (WiFi.status() != WL_CONNECTED ) {
-    delay(500);
-    Serial.print(".");
-    if (connAttempts > 20) return false;
-    connAttempts++;
-  }
-  Serial.println(" OK");
-  return true;
+void MOTION_Fall(int64_t time) {
+  if (motion.pirHigh && time > motion.lastRise) {
+    float width = (time - motion.lastRise) / 1000.0f;
+    motion.pulseWidth = (motion.pulseWidth == 0) ? width : motion.pulseWidth + MOTION_SMOOTHING * (width - motion.pulseWidth);
+  }
+  motion.lastFall = time;
+  motion.pirHigh = false;
 }
 
 /**************************************************************************
- *  MQTT_init
- *  - Connect/reconnect to WiFi
- *  - Subscribe to MQTT topics
-***************************************************************************/
-void MQTT_init() {
+ * MOTION_Check
+ * - End the motion session when the PIR has been low for MOTION_END_DELAY,
+ *   and report it with its duration.
+ **************************************************************************/
+void MOTION_Check() {
+  int64_t now = esp_timer_get_time();
+
+  if (motion.active && !motion.pirHigh && now - motion.lastFall > (int64_t)MOTION_END_DELAY * 1000) {
+    motion.active = false;
+    unsigned long duration = (motion.lastFall - motion.sessionStart) / 1000;
+    Serial.printf("Loop - Motion stopped (%lums, %lu pulses)\n", duration, motion.sessionPulses);
+    if (motion.published) {
+      // Only report the end of sessions whose start was reported (no token needed).
+      mqttPublish(topics[PUB_MOTION], "off");
+      StaticJsonDocument<128> doc;
+      doc["event"] = "stop";
+      doc["duration_ms"] = duration;
+      doc["pulses"] = motion.sessionPulses;
+      mqttPublishJson(topics[PUB_MOTIONSESSION], doc);
+    }
+  }
+}
 
-  // Loop until we're reconnected
-//  while (!client.connected() && i<wifiMaxRetry) {
-  mqttClient.disconnect();
-  if (WiFi.status() == WL_CONNECTED && !mqttClient.connected()) {
-    Serial.print("Attempting MQTT connection... ");
-    // Attempt to connect (cleanSession = false : inform broker to not start new session when reconnect)
-    if (mqttClient.connect("ESP32Cam", MQTT_user, MQTT_pwd,NULL,0,false,NULL,false)) {
-      Serial.print("connected. "); Serial.print(" WiFi="); Serial.println(WiFi.RSSI());
-      // Subscribe
-      mqttClient.subscribe(MQTT_SUB_CAMCOMMAND);
-      mqttClient.subscribe(MQTT_SUB_MOTION);
-      mqttClient.subscribe(MQTT_SUB_CAMSETTING);
-      mqttClient.subscribe(MQTT_SUB_TEMP);
-      mqttClient.subscribe(MQTT_SUB_MONITOR);
-      Serial.println("Subscribed to MQTT");
-    } else {
-      Serial.print("failed! rc="); Serial.print(mqttClient.state());
-      Serial.print(" RSSI="); Serial.print(WiFi.RSSI()); Serial.print(" IP="); Serial.println(WiFi.localIP());
-      // Wait before retrying
-      delay(1000);
+/**************************************************************************
+ * POWER_Wakeup
+ * - Handle a wakeup from (light or deep) sleep.
+ * - PIR wakeup: the ISR missed the rising edge while sleeping, so queue it
+ *   here (and the falling edge if the PIR is already low again).
+ * - Timer wakeup: report temperature and state, as if their interval passed.
+ **************************************************************************/
+void POWER_Wakeup(esp_sleep_wakeup_cause_t cause, int64_t wakeAt) {
+  power.lastActivity = millis();
+  if (cause == ESP_SLEEP_WAKEUP_EXT0) {
+    Serial.println("Power - PIR wakeup");
+    rtcState.wakeups++;
+    power.wakeAt = wakeAt;
+    EVT_Push(&taskEvents, EVT_PIR_RISE, esp_timer_get_time());
+    if (!gpio_get_level((gpio_num_t)pinPIR)) {
+      EVT_Push(&taskEvents, EVT_PIR_FALL, esp_timer_get_time());
     }
+  } else if (cause == ESP_SLEEP_WAKEUP_TIMER) {
+    Serial.println("Power - Timer wakeup");
+    requestTemperature = (config.TempInterval > 1000);
+    requestState = (config.StateInterval > 1000);
+  }
+}
+
+/**************************************************************************
+ * POWER_Resume
+ * - Called at startup. After a wakeup from deep sleep, restore the config,
+ *   camera settings and counters from RTC memory (no SPIFFS reads).
+ * - Returns true if resumed from deep sleep.
+ **************************************************************************/
+bool POWER_Resume() {
+  esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+
+  rtcState.boots++;
+  power.awakeSince = 0;                                             // esp_timer starts at boot
+  power.lastActivity = millis();
+  if (rtcState.magic != RTC_MAGIC || (cause != ESP_SLEEP_WAKEUP_EXT0 && cause != ESP_SLEEP_WAKEUP_TIMER)) {
+    return false;
+  }
+  rtcState.deepUs += POWER_RtcNow() - rtcState.sleepStart;
+  config = rtcState.config;
+  camSettings = rtcState.camSettings;
+  motion.sessions = rtcState.sessions;
+  motion.pulses = rtcState.pulses;
+  photoHash.lastUploaded = rtcState.lastHash;
+  photoHash.valid = rtcState.hashValid;
+  night.aecValue = rtcState.nightAec;
+  night.agcGain = rtcState.nightGain;
+
+  // The camera was held in power down during deep sleep, cam_init() takes the pin back.
+  rtc_gpio_hold_dis((gpio_num_t)PWDN_GPIO_NUM);
+  Serial.printf("Power - Resumed from deep sleep (boot %u)\n", rtcState.boots);
+  return true;
+}
+
+/**************************************************************************
+ * POWER_Check
+ * - Low-power mode: sleep when idle, i.e. no motion session, queued events,
+ *   pending photos or stream clients for config.SleepIdle.
+ * - Wakes on the PIR (ext0, GPIO 13) or the timer when the next temperature
+ *   or state report is due.
+ * - Light sleep returns here (WiFi reconnects in NET_loop, fast with the
+ *   known BSSID/channel). Deep sleep restarts at setup(), see POWER_Resume.
+ **************************************************************************/
+void POWER_Check() {
+  AppEvent event;
+  unsigned long idle = config.SleepIdle + ((net.state == NET_ONLINE) ? 0 : NET_WIFI_TIMEOUT);
+
+  if (config.PowerMode == POWER_ON || millis() - power.lastActivity < idle) {
+    return;
+  }
+  if (motion.active || motion.pirHigh || pendingPhotos > 0 || pipeInFlight > 0 || streamClients > 0 || lapse.deferred || clipRecording ||
+      photoSpool.count > 0 || EVT_Peek(&isrEvents, &event) || EVT_Peek(&taskEvents, &event) || gpio_get_level((gpio_num_t)pinPIR)) {
+    return;
+  }
+  if (config.PowerMode == POWER_DEEP && lapse.batches[lapse.filling].count > 0) {
+    LAPSE_Flush();                                                  // The batch does not survive deep sleep: sleep when it is sent
+    return;
+  }
+
+  // Wake up for the next temperature/state report (interval 0 = disabled).
+  uint64_t timerMs = 0;
+  if (config.TempInterval > 1000) timerMs = config.TempInterval;
+  if (config.StateInterval > 1000 && (timerMs == 0 || config.StateInterval < timerMs)) timerMs = config.StateInterval;
+  if (config.LapseInterval > 0 && rtcState.lapseNext > 0) {
+    // Also wake up for the next time-lapse capture.
+    uint64_t lapseMs = max((time_t)1, rtcState.lapseNext - time(NULL)) * 1000;
+    if (timerMs == 0 || lapseMs < timerMs) timerMs = lapseMs;
   }
-}
 
-/**************************************************************************
- *  MQTT_recon
- *  - Reconnect MQTT client (if WiFi is connected)
-***************************************************************************/
-void MQTT_recon() {
-  while (!mqttClient.connected()) {
-    // Attempt to connect
-    if (!mqttClient.connect("ESP32Cam")) {
-      delay(1000);
-    }
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+  esp_sleep_enable_ext0_wakeup((gpio_num_t)pinPIR, 1);
+  if (timerMs > 0) {
+    esp_sleep_enable_timer_wakeup(timerMs * 1000);
   }
+  power.wakeAt = -1;
+  rtcState.awakeUs += esp_timer_get_time() - power.awakeSince;
+
+  if (config.PowerMode == POWER_DEEP) {
+    rtcState.config = config;
+    rtcState.camSettings = camSettings;
+    rtcState.sessions = motion.sessions;
+    rtcState.pulses = motion.pulses;
+    rtcState.lastHash = photoHash.lastUploaded;
+    rtcState.hashValid = photoHash.valid;
+    rtcState.nightAec = night.aecValue;
+    rtcState.nightGain = night.agcGain;
+    rtcState.magic = RTC_MAGIC;
+
+    Serial.printf("Power - Deep sleep (timer %llums)\n", timerMs);
+    mqttClient.disconnect();
+    WiFi.disconnect();
+    // Stop the camera (DMA, XCLK) and hold it in power down while sleeping: PWDN
+    // (GPIO 32) is an RTC pin, the RTC hold keeps its level through deep sleep.
+    esp_camera_deinit();
+    pinMode(PWDN_GPIO_NUM, OUTPUT);
+    digitalWrite(PWDN_GPIO_NUM, HIGH);
+    rtc_gpio_hold_en((gpio_num_t)PWDN_GPIO_NUM);
+    rtcState.sleepStart = POWER_RtcNow();
+    Serial.flush();
+    esp_deep_sleep_start();                                         // Does not return, wakeup restarts at setup()
+  }
+
+  Serial.printf("Power - Light sleep (timer %llums)\n", timerMs);
+  Serial.flush();
+  int64_t sleepStart = esp_timer_get_time();
+  esp_light_sleep_start();
+  int64_t now = esp_timer_get_time();
+  rtcState.lightUs += now - sleepStart;
+  power.awakeSince = now;
+  // ext0 moved the PIR pin to the RTC domain: hand it back to the GPIO interrupt.
+  rtc_gpio_deinit((gpio_num_t)pinPIR);
+  POWER_Wakeup(esp_sleep_get_wakeup_cause(), now);
 }
 
 /**************************************************************************
- *  MQTT_callback
- *  - Handle received MQTT messages
+ * PIPE_CaptureTask
+ * - Capture stage task: take the photos requested by the loop and hand the
+ *   frames to the upload stage.
+ * - The upload queue is short (frame buffers are scarce), so a frame waits
+ *   at most PIPE_WAIT ms for the upload stage, and is dropped after that.
  **************************************************************************/
-void MQTT_callback (char* topic, byte* message, unsigned int length) {
-  String msgValue;
-  bool configChanged = false;
-
-  Serial.print("MQTT Message arrived on topic: ");
-  Serial.print(topic);
-  Serial.print(". Message: ");
-  for (int i = 0; i < length; i++) {
-    Serial.print((char)message[i]);
-    msgValue += (char)message[i];
-  }
-  Serial.println();
+void PIPE_CaptureTask(void * param) {
+  PhotoJob job;
 
-  // Process the received MQTT topics.. 
+  for (;;) {
+    if (xQueueReceive(pipeCapture.queue, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    int64_t start = esp_timer_get_time();
+    __atomic_store_n(&pipeCapture.busySince, start, __ATOMIC_RELAXED);
+    job.fb = photo_Capture(job.triggerTime);
+    PIPE_Done(&pipeCapture, start);
+    if (job.fb && job.fb->format == PIXFORMAT_JPEG) {
+      job.photoLen = job.fb->len;                                 // For the auto quality, applied by the loop
+      job.frameTime = cam_FrameTime(job.fb);
+    }
 
-// * - "gate/camera/cmnd" 
-// *      -> "photo"              : take and upload a photo
-// *      -> "enable"             : enable camera and allow PIR to trigger taking photos (MQTT trigger still possible when disabled)
-// *      -> "disable"            : disable camera actions (PIR still enabled)
-// *      -> "settings"           : report current cam settings and status                           << NOT IMPLEMENTED
-  if (String(topic) == MQTT_SUB_CAMCOMMAND) 
-  { 
-    if (msgValue == "photo") {
-      Serial.println("\t- MQTT Take and upload photo");
-      actionTakePhoto = true;
-    } else if (msgValue == "video") {                                     // now web server runs all the time. no stop/start needed.
-      //      actionTakeVideo = true;
-      if ( !runWebServer ) {
-        Serial.println("\t- MQTT Video - start");
-        runWebServer = true;
-        cam_StopStartHTTPServer();                                        // Start running the Web Server
-      } else {
-        Serial.println("\t- MQTT Video - stop");
-        runWebServer = false;
-        cam_StopStartHTTPServer();                                        // Start running the Web Server
-      }
-    } else if (msgValue == "enable") {
-      Serial.println("\t- MQTT enable camera");
-      configChanged = (config.CAM_enabled != true);
-      config.CAM_enabled = true;                                          // Enable Camera
-    }  else if (msgValue == "disable") {
-      Serial.println("\t- MQTT disable camera");
-      configChanged = (config.CAM_enabled != false);
-      config.CAM_enabled = false;                                         // Disable Camera
-    } else if (msgValue == "settings") {
-      Serial.println("\t- MQTT return current camera settings");
-      cam_ReportSettings();
+    if (!job.fb) {
+      job.result = ESP_FAIL;
+    } else if (job.spooled) {
+      // Taken offline: a copy goes back to the loop for the spool, the frame to the driver.
+      camera_fb_t * copy = SPOOL_Copy(job.fb);
+      esp_camera_fb_return(job.fb);
+      job.fb = copy;
+      job.result = copy ? PHOTO_SPOOLED : ESP_ERR_NO_MEM;
+      xQueueSend(pipeResults, &job, portMAX_DELAY);
+      continue;
+    } else if (PIPE_Send(&pipeUpload, &job, pdMS_TO_TICKS(PIPE_WAIT))) {
+      continue;
     } else {
-      Serial.print(" UNKNOWN CAMERA action ("); Serial.print(msgValue); Serial.println(")");
+      esp_camera_fb_return(job.fb);
+      job.result = ESP_ERR_TIMEOUT;
     }
+    job.fb = NULL;
+    xQueueSend(pipeResults, &job, portMAX_DELAY);
   }
+}
 
-// * - "gate/camera/setsetting" 
-// *      -> "<setting>:<value>"  : Update the camera settings with the provided value
-  else if (String(topic) == MQTT_SUB_CAMSETTING ) 
-  { 
-    Serial.println("\t- MQTT update camera setting");
-    cam_UpdateSettings(msgValue);
-  }
+/**************************************************************************
+ * PIPE_UploadTask
+ * - Upload stage task: dedup, ROI crop/encode and upload each frame, then
+ *   report the result back to the loop (MQTT is only used from the loop).
+ **************************************************************************/
+void PIPE_UploadTask(void * param) {
+  PhotoJob job;
 
-// * - "gate/motion/cmnd" 
-// *      -> "enable"             : enable PIR motion feedback (default)
-// *      -> "disable"            : disable PIR motion feedback
-// *      -> "delay:<seconds>"    : set new delay/debounce between PIR triggers
-  else if (String(topic) == MQTT_SUB_MOTION ) 
-  { 
-    if (msgValue == "disable") {
-      Serial.println("\t- MQTT disable PIR");
-      configChanged = (config.PIR_enabled != false);
-      config.PIR_enabled = false;                                     // Disable PIR sensor
-    } else if (msgValue == "enable") {
-      Serial.println("\t- MQTT enable PIR");
-      motionDetected = false;                                         // Start clean, don't report on any previous triggers
-      configChanged = (config.PIR_enabled != true);
-      config.PIR_enabled = true;                                      // Enable PIR sensor
-    } else if (msgValue.substring(0,5) == "delay") {
-      Serial.print("\t- MQTT set PIR debounce delay");
-      int valSplit = msgValue.indexOf(":"); 
-      if (valSplit>0 && valSplit<msgValue.length() ) {
-        // Seems like a valid parameter
-        configChanged = (config.PIR_delay != msgValue.substring(valSplit+1).toInt()*1000 );
-        config.PIR_delay = msgValue.substring(valSplit+1).toInt()*1000;
-        Serial.println(" - "); Serial.println(config.PIR_delay);
-      } else {
-        Serial.println(" >>> INVALID !!");
-      }
+  for (;;) {
+    if (xQueueReceive(pipeUpload.queue, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
     }
-    else {
-      Serial.print(" UNKNOWN MOTION action ("); Serial.print(msgValue); Serial.println(")");
+    int64_t start = esp_timer_get_time();
+    __atomic_store_n(&pipeUpload.busySince, start, __ATOMIC_RELAXED);
+    if (job.batch) {
+      job.result = LAPSE_Upload(job.batch);
+      PIPE_Done(&pipeUpload, start);
+      xQueueSend(pipeResults, &job, portMAX_DELAY);
+      continue;
     }
+    job.result = photo_Send(&job);
+    if (!job.spooled || job.result == ESP_OK || job.result == PHOTO_DUPLICATE) {
+      photo_Release(job.fb, job.spooled);
+      job.fb = NULL;
+    }                                                             // Spooled photo not uploaded: back to the loop, maybe offline again
+    PIPE_Done(&pipeUpload, start);
+    xQueueSend(pipeResults, &job, portMAX_DELAY);
   }
+}
 
-// * - "gate/temperature/cmnd" 
-// *      -> "reading"            : report the current temperature value
-// *      -> "interval:<seconds>" : set the interval between temperature updates (0=disabled)
-  else if (String(topic) == MQTT_SUB_TEMP ) 
-  { 
-    if (msgValue == "reading") {
-      Serial.println("\t- MQTT request Temperature value");
-      requestTemperature = true;                                                  // Feed back the Temperature reading on next loop
-    } else if (msgValue.substring(0,8) == "interval") {
-      Serial.print("\t- MQTT set Temperature interval ");
-      int valSplit = msgValue.indexOf(":"); 
-      if (valSplit>0 && valSplit<msgValue.length() ) {
-        // Seems like a valid parameter
-        configChanged = (config.TempInterval != msgValue.substring(valSplit+1).toInt()*1000 );
-        config.TempInterval = msgValue.substring(valSplit+1).toInt()*1000;        // Set the Temperature feedback interval period
-        Serial.print(" NewVal="); Serial.println(config.TempInterval);
-      } else {
-        Serial.println(" >>> INVALID !!");
-      }
-    }
+/**************************************************************************
+ * PIPE_Start
+ * - Create the pipeline queues and the capture and upload tasks, each
+ *   pinned to its own core.
+ **************************************************************************/
+bool PIPE_Start() {
+  pipeCapture.queue = xQueueCreate(PIPE_CAPTURE_QUEUE, sizeof(PhotoJob));
+  pipeUpload.queue = xQueueCreate(PIPE_UPLOAD_QUEUE, sizeof(PhotoJob));
+  pipeResults = xQueueCreate(PIPE_CAPTURE_QUEUE + PIPE_UPLOAD_QUEUE + 2, sizeof(PhotoJob));
+  if (!pipeCapture.queue || !pipeUpload.queue || !pipeResults) {
+    return false;
   }
+  pipeReportedAt = esp_timer_get_time();
+  return xTaskCreatePinnedToCore(PIPE_CaptureTask, "capture", PIPE_CAPTURE_STACK, NULL, 3, &pipeCapture.task, PIPE_CAPTURE_CORE) == pdPASS &&
+         xTaskCreatePinnedToCore(PIPE_UploadTask, "upload", PIPE_UPLOAD_STACK, NULL, 2, &pipeUpload.task, PIPE_UPLOAD_CORE) == pdPASS;
+}
 
-// * - "gate/monitor/cmnd" 
-// *      -> "restart"                  : trigger restart of ESP32
-// *      -> "getstate"                 : report the current state and telemetry values (RSSI, Memory, ..)
-// *      -> "getconfig"                : report the current state and telemetry values (RSSI, Memory, ..)
-// *      -> "interval:<seconds>"       : set the interval between state updates (default=30s) (0=disabled)
-// *      -> "ReportState:<true/false>" : Enable/disable reporting full device state
-// *      -> "Reportwifi:<true/false>"  : Enable/disable reporting wifi strength
-  else if (String(topic) == MQTT_SUB_MONITOR ) 
-  { 
-    if (msgValue == "restart") {
-      Serial.println("\t- MQTT -- RESTART ESP32");
-      BlinkLED(3);                                                        // Visual indication during debugging
-      delay(100);
-      esp_restart();                                                      // RESTART ESP32 !!!!!
-    } else if (msgValue == "getstate") {
-      Serial.println("\t- MQTT request State and Telemetry values");
-      BlinkLED(1);
-      reportState();                                                      // Feedback current telemetry values (once)
-    } else if (msgValue == "getconfig") {
-      Serial.println("\t- MQTT request Configuration values");
-      BlinkLED(1);
-      reportConfig();                                                     // Feedback current configuration (once)
-    } else if (msgValue.substring(0,8) == "interval") {
-      Serial.print("\t- MQTT set State interval ");
-      int valSplit = msgValue.indexOf(":"); 
-      if (valSplit>0 && valSplit < msgValue.length() ) {
-        // Seems like a valid parameter
-        configChanged = (config.StateInterval != msgValue.substring(valSplit+1).toInt()*1000 );
-        config.StateInterval = msgValue.substring(valSplit+1).toInt()*1000;        // Set State feedback interval (in milliseconds!)
-        Serial.print(" NewVal="); Serial.println(config.StateInterval);
-      } else {
-        Serial.println(" >>> INVALID !!");
-      }
-    } else if (msgValue.substring(0,11) == "ReportState") {
-      Serial.print("\t- MQTT set ReportState ");
-
-      int valSplit = msgValue.indexOf(":"); 
-      if (valSplit > 0 && valSplit < msgValue.length() ) {
-        // Seems like a valid parameter
-        if (msgValue.substring(valSplit+1) == "true") {
-          configChanged = (config.ReportState != true );
-          config.ReportState = true;                                                // Enable reporting state
-        } else if (msgValue.substring(valSplit+1) == "false") {
-          configChanged = (config.ReportState != false );
-          config.ReportState = false;                                               // Disable reporting state
-        }
-        Serial.println(config.ReportState);
-      }  
-    } else if (msgValue.substring(0,10) == "ReportWiFi") {
-      Serial.print("\t- MQTT set ReportWiFi ");
+/**************************************************************************
+ * photo_Reference
+ * - Give a job the dedup reference: the hash of the last upload, unless it
+ *   is older than IMG_DEDUP_REFRESH (then the photo becomes the reference).
+ **************************************************************************/
+void photo_Reference(PhotoJob * job) {
+  job->upload.reference = photoHash.lastUploaded;
+  job->upload.referenceValid = photoHash.valid && millis() - photoHash.uploadedAt < IMG_DEDUP_REFRESH;
+}
 
-      int valSplit = msgValue.indexOf(":"); 
-      if (valSplit > 0 && valSplit < msgValue.length() ) {
-        // Seems like a valid parameter
-        if (msgValue.substring(valSplit+1) == "true") {
-          configChanged = (config.ReportWiFi != true );
-          config.ReportWiFi = true;                                                 // Enable reporting WiFi
-        } else if (msgValue.substring(valSplit+1) == "false") {
-          configChanged = (config.ReportWiFi != false );
-          config.ReportWiFi = false;                                                // Disable reporting WiFi
-        } 
-        Serial.println(config.ReportWiFi);
-      }  
+/**************************************************************************
+ * photo_Request
+ * - Request a photo (if the camera is enabled): queued for the capture
+ *   stage, the result is reported by photo_Results.
+ * - Offline the photo is still taken and kept in the spool (PSRAM), to be
+ *   uploaded when the network is back (SPOOL_Drain).
+ **************************************************************************/
+void photo_Request(const char* trigger, int64_t triggerTime) {
+  //if (config.CAM_enabled && !runWebServer) {
+  if (config.CAM_enabled ) {
+    bool offline = !wifiUp;
+    if (offline && (!psramFound() || photoSpool.count >= PIPE_SPOOL_PHOTOS)) {
+      Serial.println("\t- Offline and no room to keep the photo, dropped");
+      photoSpool.dropped++;
+      return;
+    }
+    // Take a photo and upload
+    Serial.println(offline ? "Loop - Take photo (offline, spooled)" : "Loop - Take and upload photo");
+    PhotoJob job = { trigger, triggerTime, NULL, ESP_OK, -1, 0, 0, offline };
+    photo_Reference(&job);
+    if (PIPE_Send(&pipeCapture, &job, 0)) {
+      pipeInFlight++;
+    } else {
+      Serial.println("\t---! Photo pipeline full, request dropped");
     }
-  }
-  if (configChanged) {
-    // The configuration changed. Update the local SPIFFS config file with the new value.
-    saveConfig();
-    reportConfig();     // feedback of new configuration settings
   }
 }
 
 /**************************************************************************
- * isrDetectMovement
- * - interrupt routine called when the PIR detected movement.
+ * SPOOL_Drain
+ * - Back online: hand the photos taken offline to the upload stage, oldest
+ *   first, one at a time (the upload queue is short).
  **************************************************************************/
-static void IRAM_ATTR isrDetectMovement(void * arg) {
-  //Serial.println("MOTION DETECTED!!!");
-  if ( millis()-lastMovementDetected > config.PIR_delay ) {
-    motionDetected = true;
-    lastMovementDetected = millis();
+void SPOOL_Drain() {
+  if (photoSpool.count == 0 || net.state != NET_ONLINE || uxQueueSpacesAvailable(pipeUpload.queue) == 0) {
+    return;
+  }
+  photo_Reference(&photoSpool.jobs[0]);                           // The reference may have changed while offline
+  if (PIPE_Send(&pipeUpload, &photoSpool.jobs[0], 0)) {
+    pipeInFlight++;
+    photoSpool.count--;
+    memmove(&photoSpool.jobs[0], &photoSpool.jobs[1], photoSpool.count * sizeof(PhotoJob));
   }
 }
 
 /**************************************************************************
- * _http_event_handler
- * - manages HTTP events.
+ * photo_Uploaded
+ * - Apply what the upload stage measured (job.upload) to the dedup state,
+ *   the upload throughput and the ROI statistics, from the loop.
  **************************************************************************/
-esp_err_t _http_event_handler(esp_http_client_event_t *evt)
-{
-  switch (evt->event_id) {
-    case HTTP_EVENT_ERROR:
-      Serial.println("HTTP_EVENT_ERROR");
-      break;
-    case HTTP_EVENT_ON_CONNECTED:
-//      Serial.println("HTTP_EVENT_ON_CONNECTED");
-      break;
-    case HTTP_EVENT_HEADER_SENT:
-//      Serial.println("HTTP_EVENT_HEADER_SENT");
-      break;
-    case HTTP_EVENT_ON_HEADER:
-//      Serial.println();
-//      Serial.printf("HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-      break;
-    case HTTP_EVENT_ON_DATA:
-//      Serial.println();
-//      Serial.printf("HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-      if (!esp_http_client_is_chunked_response(evt->client)) {
-        // Write out data
-        printf("%.*s", evt->data_len, (char*)evt->data);
-      }
-      break;
-    case HTTP_EVENT_ON_FINISH:
-//      Serial.println("");
-      Serial.println("HTTP_EVENT_ON_FINISH");
-      break;
-    case HTTP_EVENT_DISCONNECTED:
-      Serial.println("HTTP_EVENT_DISCONNECTED");
-      break;
+void photo_Uploaded(const PhotoJob& job) {
+  const PhotoUpload& up = job.upload;
+
+  if (up.hashed) {
+    photoHash.lastUs = up.hashUs;
+    photoHash.maxUs = max(photoHash.maxUs, photoHash.lastUs);
+  }
+  if (job.distance >= 0) {
+    photoHash.lastDistance = job.distance;
+  }
+  if (job.result == PHOTO_DUPLICATE) {
+    photoHash.skipped++;
+  }
+  if (up.roi != 0) {
+    roiStats.lastMs = up.roiMs;
+    roiStats.maxMs = max(roiStats.maxMs, roiStats.lastMs);
+    roiStats.lastIn = up.roiIn;
+    if (up.roi > 0) {
+      roiStats.photos++;
+      roiStats.lastOut = up.roiOut;
+    } else {
+      roiStats.failures++;
+    }
+  }
+  if (job.result == ESP_OK) {
+    qualityCtl.uploadRate = (qualityCtl.uploadRate == 0) ? up.rate : qualityCtl.uploadRate + CAM_QUALITY_SMOOTHING * (up.rate - qualityCtl.uploadRate);
+    if (up.hashed) {
+      // New reference photo for duplicate detection.
+      photoHash.lastUploaded = up.hash;
+      photoHash.valid = true;
+      photoHash.uploadedAt = millis();
+    }
   }
-  return ESP_OK;
 }
 
 /**************************************************************************
- * take_send_photo
- * - takes a photo
- * - uploads photo to server
+ * photo_Results
+ * - Report the photos finished by the pipeline (MQTT, from the loop only).
  **************************************************************************/
-static esp_err_t take_send_photo()
-{
-  Serial.println("\t- Taking picture...");
-  camera_fb_t * fb = NULL;
-
-  fb = esp_camera_fb_get();
-  if (!fb) {
-    Serial.println("\t- Camera capture failed!");
-    return ESP_FAIL;
+void photo_Results() {
+  PhotoJob job;
+
+  while (pipeResults && xQueueReceive(pipeResults, &job, 0) == pdTRUE) {
+    pipeInFlight--;
+    power.lastActivity = millis();
+    if (job.batch) {
+      LAPSE_Done(job.batch, job.result);
+      continue;
+    }
+    photo_Uploaded(job);
+    cam_AutoQuality(job);                                         // Quality of the next photos, if a target size is set
+    if (job.spooled && job.fb) {
+      // Taken offline, or its upload failed: keep it while the network is down.
+      if (job.result != PHOTO_SPOOLED && net.state == NET_ONLINE) {
+        Serial.println("\t---! Spooled photo upload failed, dropped");
+      } else if (photoSpool.count < PIPE_SPOOL_PHOTOS) {
+        if (job.result == PHOTO_SPOOLED) photoSpool.spooled++;
+        job.photoLen = 0;                                         // Auto quality: already counted
+        photoSpool.jobs[photoSpool.count++] = job;
+        continue;
+      }
+      photo_Release(job.fb, true);
+      photoSpool.dropped++;
+      continue;
+    }
+    if (job.spooled && job.result == ESP_ERR_NO_MEM) {
+      photoSpool.dropped++;                                       // No PSRAM left for the copy
+    }
+    if ( job.result == ESP_OK ) {
+      mqttPublish(topics[PUB_CAMERA], "photo");
+      if (power.wakeAt >= 0 && strcmp(job.trigger, "pir") == 0) {
+        // First motion photo after a PIR wakeup.
+        rtcState.wakePhotoLast = (esp_timer_get_time() - power.wakeAt) / 1000;
+        rtcState.wakePhotoMax = max(rtcState.wakePhotoMax, rtcState.wakePhotoLast);
+        rtcState.wakePhotoSum += rtcState.wakePhotoLast;
+        rtcState.wakePhotos++;
+        power.wakeAt = -1;
+        Serial.printf("\t- Wake to photo: %ums\n", rtcState.wakePhotoLast);
+      }
+    } else if ( job.result == PHOTO_DUPLICATE ) {
+      mqttPublish(topics[PUB_CAMERA], (String("skipped:") + String(job.distance)).c_str());
+    }
   }
+}
 
-  // Photo taken successfully. Now upload to server.
-  esp_http_client_handle_t http_client;
-  
-  esp_http_client_config_t config_client = {0};
-  config_client.url = upload_url;
-  config_client.event_handler = _http_event_handler;
-  config_client.method = HTTP_METHOD_POST;
-
-  http_client = esp_http_client_init(&config_client);
-
-  esp_http_client_set_post_field(http_client, (const char *)fb->buf, fb->len);
-
-  esp_http_client_set_header(http_client, "Content-Type", "image/jpg");
-
-  esp_err_t err = esp_http_client_perform(http_client);
-//  if (err == ESP_OK) {
-//    Serial.print("esp_http_client_get_status_code: ");
-//    Serial.println(esp_http_client_get_status_code(http_client));
-//  }
-
-  esp_http_client_cleanup(http_client);
-
-  esp_camera_fb_return(fb);
+/**************************************************************************
+ *  MQTT_callback
+ *  - Received MQTT messages, with the heap used by the handling (message
+ *    Strings, ..) accounted to the MQTT subsystem.
+ **************************************************************************/
+void MQTT_callback (char* topic, byte* message, unsigned int length) {
+  size_t heapBefore = HEAP_Begin();
 
-  return err;
+  METRIC_Add(metrics.mqttIn);
+  HEAP_Track(HEAP_MQTT, length + 1);                // Message String
+  MQTT_HandleMessage(topic, message, length);
+  HEAP_Track(HEAP_MQTT, -(int32_t)(length + 1));
+  HEAP_End(HEAP_MQTT, heapBefore);
 }
 
 /**************************************************************************
@@ -1195,34 +5608,35 @@ void setup()
 
   WRITE_PERI_REG(RTC_CNTL_BROWN_OUT_REG, 0); // disable brownout detector
 
-  if ( WiFi_init() ) { // Connected to WiFi
-    Serial.print("WiFi connected.\n - RSSI: "); Serial.print(WiFi.RSSI()); Serial.print(" Local IP: "); Serial.println(WiFi.localIP() ); 
-  } else {
-    Serial.println("WiFi connection failed! \nRestarting in 10s...");
-    delay(10000);
-    ESP.restart();
-  }
+  // After a deep sleep wakeup the configuration is restored from RTC memory.
+  bool resumed = POWER_Resume();
+
+  // WiFi and MQTT connect in the background (NET_loop), so setup and the PIR don't wait for the network.
+  WiFi_init();
   mqttClient.setServer(MQTT_server, 1883); 
   mqttClient.setCallback(MQTT_callback);         // local function to call when MQTT msg received
-  MQTT_init();
-  if ( mqttClient.connected() ) {
-    // Report the startup event for monitoring of crashes and restarts.
-    reportState();
-  }
+  mqttClient.setSocketTimeout(NET_MQTT_TIMEOUT);
+  NET_loop();
+
+  if ( !resumed ) {
+    // Read general configuration from SPIFFS config file.
+    if ( !readConfig() ) {
+      Serial.println("Reading config file failed!");
+      delay(10000);
+      //ESP.restart();
+    }
 
-  // Read general configuration from SPIFFS config file.
-  if ( !readConfig() ) {
-    Serial.println("Reading config file failed!");
-    delay(10000);
-    //ESP.restart();
+    // Read camera settings from SPIFFS config file.
+    if ( !cam_ReadSettings() ) {
+      Serial.println("Reading cam settings file failed!");
+      //delay(10000);
+      //ESP.restart();
+    }
   }
+  // Topics and client ID, before the first MQTT connect (WiFi is still connecting).
+  MQTT_BuildTopics();
 
-  // Read camera settings from SPIFFS config file.
-  if ( !cam_ReadSettings() ) {
-    Serial.println("Reading cam settings file failed!");
-    //delay(10000);
-    //ESP.restart();
-  }
+  qualityLock = xSemaphoreCreateMutex();
 
   if ( cam_init() != ESP_OK ) {
     // Something went wrong while setting up the camera. Restart and try again.
@@ -1230,25 +5644,45 @@ void setup()
     ESP.restart();
   }
 
+  // Photo pipeline: capture and upload tasks on separate cores.
+  if ( !PIPE_Start() ) {
+    Serial.println("Photo pipeline start failed!");
+    delay(20000);
+    ESP.restart();
+  }
+#if CLIP_RECORDER
+  CLIP_Start();                                     // Clips to the SD card (runs without one, no clips)
+#endif
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  if ( !WS_Start() ) {
+    Serial.println("WebSocket stream start failed!");
+  }
+#endif
+
   pinMode(pinFlashLED, OUTPUT);
   digitalWrite(pinFlashLED, flashState);
   pinMode(pinBoardLED, OUTPUT);
   
-  // PIR Motion Sensor and interrupts (rising edge).
+  // PIR Motion Sensor and interrupts (both edges, for motion start/stop).
   res = gpio_isr_handler_add(GPIO_NUM_13, &isrDetectMovement, (void *) 13);  
   if (res != ESP_OK) {
     Serial.printf("PIR - interrupt handler add failed (err=0x%x) \r\n", res); 
   }
-  res = gpio_set_intr_type(GPIO_NUM_13, GPIO_INTR_POSEDGE);
+  res = gpio_set_intr_type(GPIO_NUM_13, GPIO_INTR_ANYEDGE);
   if (res != ESP_OK) {
     Serial.printf("PIR - set interrupt type failed (err=0x%x) \r\n", res);
   }
+  if (resumed) {
+    // Queue the PIR trigger that woke us (wake-to-photo measured from the start of the app).
+    POWER_Wakeup(esp_sleep_get_wakeup_cause(), 0);
+  }
 
   // Set up the OneWire bus with the Temperature sensor
   sensorTemp.begin();
 
   //runWebServer = true;
   cam_StartHTTPServer();
+  METRICS_Start();
 
   // Show board detail
   esp_chip_info_t espInfo;
@@ -1259,7 +5693,7 @@ void setup()
   Serial.print("\t- IDF version: "); Serial.println( esp_get_idf_version() );
 
   // Blink the LED once (note "opposite" notation, LOW = on for onboard LED)
-  BlinkLED(2);
+  if (!resumed) BlinkLED(2);
 
   Serial.println("Setup done.");
 
@@ -1272,55 +5706,120 @@ void loop() {
   static long lastTmpReport = 0;
   static long lastStateReport = 0;
 
-  if (motionDetected) {
-    // Motion was detected.
-    if (config.PIR_enabled) {
-      Serial.println("Loop - Motion Detected"); 
-      mqttClient.publish(MQTT_PUB_MOTION, "on");
-      actionTakePhoto = true;
-    }
-    motionDetected = false;
-  }
+  PROF_Begin();
+
+  // Handle the queued PIR and photo events, in the order they happened.
+  // (PIR edges are also kept while the camera is busy, so no motion is missed.)
+  AppEvent event;
+  while (EVT_Next(&event)) {
+    const char* trigger = "mqtt";
 
-  if (actionTakePhoto) {
-    //if (config.CAM_enabled && !runWebServer) {
-    if (config.CAM_enabled ) {
-      // Take a photo and upload
-      Serial.println("Loop - Take and upload photo");
-      if ( take_send_photo() == ESP_OK ) {
-        mqttClient.publish(MQTT_PUB_CAMERA, "photo");
+    if (event.type == EVT_PIR_RISE || event.type == EVT_PIR_FALL) {
+      // PIR edge: motion session tracking.
+      if (!config.PIR_enabled || event.time < motionEnabledAt) {
+        continue;
+      }
+      if (event.type == EVT_PIR_FALL) {
+        MOTION_Fall(event.time);
+        continue;
+      }
+      bool takePhoto = MOTION_Rise(event.time);
+#if CLIP_RECORDER
+      if (config.CAM_enabled) {
+        CLIP_Trigger(config.ClipSeconds * 1000);                // Clip of at least ClipSeconds from this PIR trigger
+      }
+#endif
+      if (!takePhoto) {
+        continue;
+      }
+      if (!RL_Take(RL_PIR_PHOTO)) {
+        RL_Drop(RL_PIR_PHOTO);                                  // A late motion photo is of no use, don't defer
+        continue;
+      }
+      trigger = "pir";
+    } else if (event.type == EVT_PHOTO) {
+      if (!RL_Take(RL_MANUAL_PHOTO)) {
+        // Rate limited: defer the request (up to a limit).
+        if (pendingPhotos < RL_MAX_DEFERRED) {
+          pendingPhotos++;
+          buckets[RL_MANUAL_PHOTO].deferred++;
+        } else {
+          RL_Drop(RL_MANUAL_PHOTO);
+        }
+        continue;
       }
     }
-    actionTakePhoto = false;
-  } 
 
-  if ( ((millis()-lastTmpReport>config.TempInterval) && (config.TempInterval>1000)) || requestTemperature ) {
+    power.lastActivity = millis();
+    photo_Request(trigger, event.time);
+  }
+  PROF_End(PS_EVENTS);
+  photo_Results();
+  SPOOL_Drain();
+  MOTION_Check();
+#if CLIP_RECORDER
+  if (motion.active) {
+    CLIP_Extend(CLIP_POST_ROLL);                                // Record until the motion is over
+  }
+  CLIP_Results();
+#endif
+
+  // Deferred photo requests, only after all motion events were handled.
+  if (pendingPhotos > 0 && RL_Take(RL_MANUAL_PHOTO)) {
+    pendingPhotos--;
+    photo_Request("mqtt", esp_timer_get_time());
+  }
+  PROF_End(PS_PHOTOS);
+
+  if ( ((millis()-lastTmpReport>config.TempInterval) && (config.TempInterval>1000)) || (requestTemperature && mqttClient.connected()) ) {
     // Get and upload the temperature. (interval 0 = disabled).
+    bool publishTemp = RL_Take(RL_TELEMETRY);
+    if (!publishTemp) RL_Drop(RL_TELEMETRY);
     sensorTemp.requestTemperatures();
     float curTemp = sensorTemp.getTempCByIndex(0);
     Serial.print("Temperature: "); Serial.println(curTemp);
     if (curTemp != -127) {
       // This is a valid reading, upload it to the server.
-      mqttClient.publish(MQTT_PUB_TEMP, String(curTemp).c_str() );
+      lastTemperature = curTemp;
+      if (publishTemp) mqttPublish(topics[PUB_TEMP], String(curTemp).c_str() );
     }
     requestTemperature = false;
     lastTmpReport = millis();
   }
+  PROF_End(PS_TEMPERATURE);
 
   // Feedback ESP32 State and/or WiFi parameters (interval 0 = disabled) 
-  if ( ((millis()-lastStateReport > config.StateInterval) && (config.StateInterval>1000)) ) {
-    if (config.ReportState) reportState();
-    if (config.ReportWiFi) reportWiFi();
+  if ( ((millis()-lastStateReport > config.StateInterval) && (config.StateInterval>1000)) || (requestState && mqttClient.connected()) ) {
+    if (RL_Take(RL_TELEMETRY)) {
+      if (config.ReportState) reportState();
+      if (config.ReportWiFi) reportWiFi();
+    } else {
+      RL_Drop(RL_TELEMETRY);
+    }
+    requestState = false;
     lastStateReport = millis();
   }
+  PROF_End(PS_STATE);
+
+  // Scheduled time-lapse captures.
+  LAPSE_Check();
+  PROF_End(PS_LAPSE);
+
+  // Low-power mode: sleep when idle (returns after light sleep).
+  POWER_Check();
+  PROF_End(PS_POWER);
 
   delay(100);
 
-  // Keep MQTT connection alive.
-  if (WiFi.status() == WL_CONNECTED && !mqttClient.connected()) {
-    MQTT_init();
-  }
-  mqttClient.loop();
+  // Keep WiFi and MQTT connections alive (non-blocking).
+  PROF_Begin();
+  NET_loop();
+  PROF_End(PS_NET);
+  mqttClient.loop();                                                // Handles the MQTT commands (SPIFFS writes, reports)
+  PROF_End(PS_MQTT);
+
+  // Stall detector: report loop sections and photo jobs over the threshold.
+  PROFILE_Check();
 
 }
 
@@ -0,0 +1,136 @@
+/**************************************************************************
+ * 
+ * Host test of the AVI writer (src/AviWriter.h): records clips into memory
+ * the way CLIP_Open/CLIP_WriteFrame/CLIP_Close record them on the SD card
+ * (placeholder header, frames, idx1, header patched at the end) and checks
+ * the file: 224 byte header, RIFF and movi list lengths, and idx1 entries
+ * that point at the frame chunks, counted from the 'movi' id.
+ * 
+ *   g++ -std=c++11 -O2 test/avi_writer_test.cpp -o avi_writer_test && ./avi_writer_test
+ * 
+ **************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "../src/AviWriter.h"
+
+static int errors = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL line %d: %s\n", __LINE__, #cond); errors++; } } while (0)
+
+static uint32_t get32(const std::vector<uint8_t>& f, size_t at) {
+  return f[at] | f[at + 1] << 8 | f[at + 2] << 16 | (uint32_t)f[at + 3] << 24;
+}
+
+static bool isId(const std::vector<uint8_t>& f, size_t at, const char * id) {
+  return at + 4 <= f.size() && memcmp(&f[at], id, 4) == 0;
+}
+
+// Synthetic JPEG of len bytes, its bytes tell the frame apart.
+static std::vector<uint8_t> makeFrame(int frame, uint32_t len) {
+  std::vector<uint8_t> jpeg(len);
+  for (uint32_t i = 0; i < len; i++) {
+    jpeg[i] = frame * 31 + i;
+  }
+  return jpeg;
+}
+
+// A clip of the given frame sizes, written like the recorder does.
+static std::vector<uint8_t> record(const std::vector<uint32_t>& sizes, AviStream * info, uint32_t durationMs) {
+  std::vector<uint8_t> file;
+  std::vector<uint32_t> index(2 * sizes.size() + 2);
+  uint8_t header[AVI_HEADER_SIZE];
+  uint32_t moviSize = 0;
+
+  memset(info, 0, sizeof(*info));
+  AVI_Header(header, *info, 10, 0, 0);                            // CLIP_Open: placeholder
+  file.insert(file.end(), header, header + sizeof(header));
+
+  for (size_t i = 0; i < sizes.size(); i++) {                     // CLIP_WriteFrame
+    uint8_t head[8];
+    std::vector<uint8_t> jpeg = makeFrame(i, sizes[i]);
+    AVI_Put32(AVI_PutId(head, "00dc"), sizes[i]);
+    file.insert(file.end(), head, head + sizeof(head));
+    file.insert(file.end(), jpeg.begin(), jpeg.end());
+    if (sizes[i] & 1) {
+      file.push_back(0);
+    }
+    if (info->frames == 0) {
+      info->width = 640;
+      info->height = 480;
+    }
+    AVI_AddFrame(info, index.data(), &moviSize, sizes[i]);
+  }
+  info->durationMs = durationMs;
+
+  uint8_t entry[16];                                              // CLIP_Close: index, then the real header
+  AVI_Put32(AVI_PutId(entry, "idx1"), 16 * info->frames);
+  file.insert(file.end(), entry, entry + 8);
+  for (uint32_t i = 0; i < info->frames; i++) {
+    AVI_IndexEntry(entry, index[2 * i], index[2 * i + 1]);
+    file.insert(file.end(), entry, entry + sizeof(entry));
+  }
+  CHECK(AVI_Header(header, *info, 10, moviSize, AVI_IndexSize(info->frames)) == AVI_HEADER_SIZE);
+  memcpy(&file[0], header, sizeof(header));
+  CHECK(file.size() == AVI_HEADER_SIZE + moviSize + AVI_IndexSize(info->frames));
+  return file;
+}
+
+static void checkClip(const std::vector<uint32_t>& sizes, uint32_t durationMs) {
+  AviStream info;
+  std::vector<uint8_t> f = record(sizes, &info, durationMs);
+
+  // RIFF 'AVI ', hdrl list, then the movi list right after the 224 byte header.
+  CHECK(isId(f, 0, "RIFF") && isId(f, 8, "AVI "));
+  CHECK(get32(f, 4) == f.size() - 8);
+  CHECK(isId(f, 12, "LIST") && isId(f, 20, "hdrl"));
+  size_t movi = 12 + 8 + get32(f, 16);                            // After the hdrl list
+  CHECK(movi == AVI_HEADER_SIZE - 12);
+  CHECK(isId(f, movi, "LIST") && isId(f, movi + 8, "movi"));
+  CHECK(movi + 8 == AVI_MOVI_ID);
+  size_t idx1 = movi + 8 + get32(f, movi + 4);                    // movi list length: 'movi' id and the chunks
+  CHECK(isId(f, idx1, "idx1"));
+  CHECK(get32(f, idx1 + 4) == 16 * sizes.size());
+  CHECK(idx1 + 8 + 16 * sizes.size() == f.size());
+
+  // Main and stream headers.
+  CHECK(isId(f, 24, "avih") && get32(f, 28) == 56);
+  CHECK(get32(f, 32 + 16) == sizes.size());                       // Total frames
+  CHECK(get32(f, 32 + 32) == (sizes.empty() ? 0 : 640) && get32(f, 32 + 36) == (sizes.empty() ? 0 : 480));
+  if (sizes.size() > 1) {
+    CHECK(get32(f, 32) == (uint64_t)durationMs * 1000 / (sizes.size() - 1));   // us per frame, measured
+  } else {
+    CHECK(get32(f, 32) == 100000);                                // 10 fps until there are two frames
+  }
+  CHECK(isId(f, 88, "LIST") && isId(f, 96, "strl") && isId(f, 100, "strh"));
+  CHECK(isId(f, 108, "vids") && isId(f, 112, "MJPG"));
+
+  // Every idx1 entry points at its frame chunk, offset counted from the 'movi' id.
+  int wrong = 0;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    size_t entry = idx1 + 8 + 16 * i;
+    uint32_t offset = get32(f, entry + 8), size = get32(f, entry + 12);
+    size_t chunk = AVI_MOVI_ID + offset;
+    std::vector<uint8_t> jpeg = makeFrame(i, sizes[i]);
+    if (!isId(f, entry, "00dc") || get32(f, entry + 4) != 0x10 || size != sizes[i] ||
+        !isId(f, chunk, "00dc") || get32(f, chunk + 4) != size || chunk % 2 != 0 ||
+        memcmp(&f[chunk + 8], jpeg.data(), size) != 0) {
+      wrong++;
+    }
+  }
+  CHECK(wrong == 0);
+}
+
+int main() {
+  checkClip({ 12000, 12345, 11999, 13002, 12001 }, 400);         // Odd sizes: padded chunks
+  checkClip({ 7 }, 0);
+  checkClip({}, 0);                                               // No frames: empty movi list and index
+  std::vector<uint32_t> many;
+  for (int i = 0; i < 250; i++) {
+    many.push_back(20000 + (i * 7919) % 5000);
+  }
+  checkClip(many, 24900);
+  printf("%d errors\n", errors);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+/**************************************************************************
+ * 
+ * Host test of the event ring (src/EventRing.h): one producer thread and
+ * one consumer thread, checks that every event arrives once and in order.
+ * 
+ *   g++ -std=c++11 -O2 -pthread test/event_ring_test.cpp -o event_ring_test && ./event_ring_test
+ * 
+ **************************************************************************/
+
+#include <stdio.h>
+#include <thread>
+#include "../src/EventRing.h"
+
+static const int64_t EVENTS = 2000000;
+
+EventRing ring = {};
+
+int main() {
+  int64_t pushed = 0;
+
+  // Producer: numbered events, retried while the ring is full (the ISR drops them instead).
+  std::thread producer([&pushed]() {
+    for (int64_t i = 0; i < EVENTS; i++) {
+      while (!EVT_Push(&ring, (EventType)(i % 3), i)) {
+        std::this_thread::yield();
+      }
+      pushed++;
+    }
+  });
+
+  int64_t expected = 0;
+  int errors = 0;
+  AppEvent event;
+
+  while (expected < EVENTS) {
+    if (!EVT_Peek(&ring, &event)) {
+      std::this_thread::yield();
+      continue;
+    }
+    if (event.time != expected || event.type != (EventType)(expected % 3)) {
+      if (errors++ < 10) {
+        printf("event %lld: got %lld type %d\n", (long long)expected, (long long)event.time, event.type);
+      }
+      expected = event.time;                        // Resync, so one error is not reported for every event after it
+    }
+    EVT_Pop(&ring);
+    expected++;
+  }
+  producer.join();
+
+  if (EVT_Peek(&ring, &event)) {
+    printf("event %lld after the last one\n", (long long)event.time);
+    errors++;
+  }
+  if (pushed != EVENTS) {
+    printf("pushed %lld of %lld\n", (long long)pushed, (long long)EVENTS);
+    errors++;
+  }
+  printf("%lld events, %u full (retried), high water %u, %d errors\n",
+         (long long)EVENTS, ring.overflows, ring.highWater, errors);
+  return errors ? 1 : 0;
+}
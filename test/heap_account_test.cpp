@@ -0,0 +1,104 @@
+/**************************************************************************
+ * 
+ * Host test of the heap accounting (src/HeapAccount.h): bytes and
+ * allocations per tag, and the peak under concurrent allocations. Each
+ * thread holds its blocks until all threads have allocated, so the peak
+ * must be exactly the sum of all blocks.
+ * 
+ *   g++ -std=c++11 -O2 -pthread test/heap_account_test.cpp -o heap_account_test && ./heap_account_test
+ * 
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "../src/HeapAccount.h"
+
+static int errors = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL line %d: %s\n", __LINE__, #cond); errors++; } } while (0)
+
+static void * alloc(HeapAccount * accounts, HeapTag tag, size_t size) {
+  return HEAP_Tag(accounts, malloc(sizeof(HeapBlock) + size), tag, size);
+}
+
+static void release(HeapAccount * accounts, void * ptr) {
+  free(HEAP_Untag(accounts, ptr));
+}
+
+static void testTags() {
+  HeapAccount accounts[HEAP_TAGS] = {};
+
+  void * mqtt = alloc(accounts, HEAP_MQTT, 100);
+  void * json = alloc(accounts, HEAP_JSON, 40);
+  void * json2 = alloc(accounts, HEAP_JSON, 60);
+  CHECK(accounts[HEAP_MQTT].current == 100 && accounts[HEAP_MQTT].allocs == 1);
+  CHECK(accounts[HEAP_JSON].current == 100 && accounts[HEAP_JSON].allocs == 2);
+  CHECK(accounts[HEAP_HTTP].current == 0 && accounts[HEAP_HTTP].allocs == 0);
+
+  release(accounts, json);                                        // The header brings the tag back
+  CHECK(accounts[HEAP_JSON].current == 60 && accounts[HEAP_JSON].frees == 1);
+  CHECK(accounts[HEAP_JSON].peak == 100);
+  release(accounts, json2);
+  release(accounts, mqtt);
+  CHECK(accounts[HEAP_JSON].current == 0 && accounts[HEAP_JSON].peak == 100);
+  CHECK(accounts[HEAP_MQTT].current == 0 && accounts[HEAP_MQTT].frees == 1);
+
+  void * camera = alloc(accounts, HEAP_CAMERA, 0);                // Empty blocks count as allocations
+  CHECK(accounts[HEAP_CAMERA].allocs == 1 && accounts[HEAP_CAMERA].current == 0);
+  release(accounts, camera);
+  CHECK(accounts[HEAP_CAMERA].frees == 1);
+}
+
+static void testConcurrentPeak() {
+  const int threads = 8, blocks = 64, rounds = 200;
+  HeapAccount accounts[HEAP_TAGS] = {};
+  int wrong = 0;
+
+  for (int round = 0; round < rounds; round++) {
+    std::atomic<int> allocated(0);
+    std::vector<std::thread> workers;
+    accounts[HEAP_STREAM].peak = 0;
+    for (int t = 0; t < threads; t++) {
+      workers.emplace_back([&, t] {
+        void * held[blocks];
+        for (int i = 0; i < blocks; i++) {
+          held[i] = alloc(accounts, HEAP_STREAM, 1 + (t + i) % 3);
+          release(accounts, alloc(accounts, HEAP_HTTP, 8));       // Traffic on another tag
+        }
+        allocated++;
+        while (allocated.load() < threads) {
+          std::this_thread::yield();
+        }
+        for (int i = 0; i < blocks; i++) {
+          release(accounts, held[i]);
+        }
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    int expected = 0;
+    for (int t = 0; t < threads; t++) {
+      for (int i = 0; i < blocks; i++) {
+        expected += 1 + (t + i) % 3;
+      }
+    }
+    if (accounts[HEAP_STREAM].peak != expected || accounts[HEAP_STREAM].current != 0) {
+      wrong++;
+    }
+  }
+  CHECK(wrong == 0);
+  CHECK(accounts[HEAP_STREAM].allocs == (uint32_t)(threads * blocks * rounds));
+  CHECK(accounts[HEAP_STREAM].frees == accounts[HEAP_STREAM].allocs);
+  CHECK(accounts[HEAP_HTTP].current == 0 && accounts[HEAP_HTTP].peak <= 8 * threads);
+}
+
+int main() {
+  testTags();
+  testConcurrentPeak();
+  printf("%d errors\n", errors);
+  return errors ? 1 : 0;
+}
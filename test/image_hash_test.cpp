@@ -0,0 +1,135 @@
+/**************************************************************************
+ * 
+ * Host test and benchmark of the hash kernels (src/ImageHash.h): grid
+ * accumulation, average hash, Hamming distance and the dedup threshold.
+ * The benchmark runs the kernels on synthetic 1/8-scale frames.
+ * 
+ *   g++ -std=c++11 -O2 test/image_hash_test.cpp -o image_hash_test && ./image_hash_test
+ * 
+ **************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "../src/ImageHash.h"
+
+static int errors = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL line %d: %s\n", __LINE__, #cond); errors++; } } while (0)
+
+// Synthetic decoded frame (BGR888): a horizontal gradient plus an optional bright square.
+static void makeFrame(std::vector<uint8_t>& bgr, int w, int h, int squareX, int squareY) {
+  bgr.resize(w * h * 3);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8_t v = x * 200 / w;
+      if (squareX >= 0 && x >= squareX && x < squareX + w / 8 && y >= squareY && y < squareY + h / 8) {
+        v = 255;
+      }
+      uint8_t * p = &bgr[(y * w + x) * 3];
+      p[0] = p[1] = p[2] = v;
+    }
+  }
+}
+
+// Feed a frame to the grid in decoder-sized blocks (16 rows at a time, like the JPEG decoder's MCU rows).
+static uint64_t hashFrame(const std::vector<uint8_t>& bgr, int w, int h, uint8_t cells[64]) {
+  ImgCellGrid grid;
+  memset(&grid, 0, sizeof(grid));
+  for (int y = 0; y < h; y += 16) {
+    int rows = (y + 16 <= h) ? 16 : h - y;
+    IMG_GridAdd(&grid, 0, 0, w, h, 0, y, w, rows, &bgr[y * w * 3]);
+  }
+  IMG_GridCells(&grid, cells);
+  return IMG_HashCells(cells);
+}
+
+static void testHash() {
+  std::vector<uint8_t> frame;
+  uint8_t cells[64], other[64];
+  int w = 200, h = 150;                                           // UXGA at 1/8 scale
+
+  makeFrame(frame, w, h, -1, 0);
+  uint64_t plain = hashFrame(frame, w, h, cells);
+  CHECK(cells[0] < cells[7]);                                     // Gradient: left dark, right bright
+  CHECK(plain == hashFrame(frame, w, h, other));                  // Deterministic
+  CHECK(IMG_HashDistance(plain, plain) == 0);
+  CHECK(!IMG_CellsChanged(cells, other, 0));
+
+  // A gradient hashes to the right half of each row of cells.
+  for (int i = 0; i < 64; i++) {
+    CHECK(((plain >> i) & 1) == ((i % 8) >= 4));
+  }
+
+  // A bright square in one dark cell flips that cell only.
+  makeFrame(frame, w, h, 0, 0);
+  uint64_t square = hashFrame(frame, w, h, other);
+  CHECK(IMG_HashDistance(plain, square) == 1);
+  CHECK(IMG_CellsChanged(other, cells, 10));
+  CHECK(!IMG_CellsChanged(other, cells, 255));
+
+  CHECK(IMG_HashDistance(0, ~0ULL) == 64);
+  CHECK(IMG_HashDistance(0x5, 0x6) == 2);
+
+  // Window: only the pixels inside count, split into 8x8 cells of the window.
+  ImgCellGrid grid;
+  memset(&grid, 0, sizeof(grid));
+  makeFrame(frame, w, h, -1, 0);
+  IMG_GridAdd(&grid, 40, 30, 80, 64, 0, 0, w, h, frame.data());
+  int pixels = 0;
+  for (int i = 0; i < 64; i++) {
+    CHECK(grid.count[i] == 10 * 8);                               // 80x64 window: 10x8 pixels per cell
+    pixels += grid.count[i];
+  }
+  CHECK(pixels == 80 * 64);
+}
+
+static void testThreshold() {
+  CHECK(!IMG_Duplicate(0, 0));                                    // Threshold 0: dedup disabled
+  CHECK(IMG_Duplicate(0, 1));
+  CHECK(!IMG_Duplicate(1, 1));                                    // Below the threshold only
+  CHECK(IMG_Duplicate(5, 6));
+  CHECK(!IMG_Duplicate(6, 6));
+  CHECK(IMG_Duplicate(63, 64));
+  CHECK(!IMG_Duplicate(64, 64));
+}
+
+static void benchmark() {
+  static const struct { const char * name; int w, h; } sizes[] = {
+    { "VGA  1/8", 80, 60 }, { "SVGA 1/8", 100, 75 }, { "XGA  1/8", 128, 96 }, { "UXGA 1/8", 200, 150 }
+  };
+  std::vector<uint8_t> frame;
+  uint8_t cells[64];
+  volatile uint64_t sink = 0;
+
+  printf("%-10s %12s\n", "frame", "grid+hash");
+  for (auto& size : sizes) {
+    makeFrame(frame, size.w, size.h, size.w / 3, size.h / 3);
+    int runs = 2000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++) {
+      sink = sink + hashFrame(frame, size.w, size.h, cells);
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / runs;
+    printf("%-10s %9.2f us\n", size.name, us);
+  }
+
+  int runs = 10000000;
+  uint64_t a = 0x0123456789abcdefULL;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++) {
+    sink = sink + IMG_HashDistance(a, sink);
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / runs;
+  printf("%-10s %9.2f ns\n", "distance", ns);
+}
+
+int main() {
+  testHash();
+  testThreshold();
+  benchmark();
+  printf("%d errors\n", errors);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+/**************************************************************************
+ * 
+ * Host test and benchmark of the region of interest kernels
+ * (src/ImageRoi.h): ROI rectangle, OV2640 sensor window and the crop copy
+ * the JPEG decoder callback runs for each block. The benchmark crops
+ * synthetic decoded frames block by block, like img_CropRoi does.
+ * 
+ *   g++ -std=c++11 -O2 test/image_roi_test.cpp -o image_roi_test && ./image_roi_test
+ * 
+ **************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "../src/ImageRoi.h"
+
+static int errors = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL line %d: %s\n", __LINE__, #cond); errors++; } } while (0)
+
+// Synthetic decoded frame (BGR888): every pixel encodes its position.
+static void makeFrame(std::vector<uint8_t>& bgr, int w, int h) {
+  bgr.resize(w * h * 3);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8_t * p = &bgr[(y * w + x) * 3];
+      p[0] = x & 0xff;                                            // B
+      p[1] = y & 0xff;                                            // G
+      p[2] = (x + y) & 0xff;                                      // R
+    }
+  }
+}
+
+// Crop a frame the way the decoder hands it out: blocks of 16x16 pixels (MCUs), each packed w*h*3.
+static void cropFrame(const std::vector<uint8_t>& bgr, int w, int h, const ImgRect& rect, uint8_t * rgb) {
+  uint8_t block[16 * 16 * 3];
+  for (int y = 0; y < h; y += 16) {
+    int bh = (y + 16 <= h) ? 16 : h - y;
+    for (int x = 0; x < w; x += 16) {
+      int bw = (x + 16 <= w) ? 16 : w - x;
+      for (int row = 0; row < bh; row++) {
+        memcpy(block + row * bw * 3, &bgr[((y + row) * w + x) * 3], bw * 3);
+      }
+      IMG_RoiCopy(&rect, rgb, x, y, bw, bh, block);
+    }
+  }
+}
+
+static void testRect() {
+  ImgRect rect;
+
+  CHECK(IMG_RoiRect(800, 600, 0, 0, 100, 100, &rect));           // Whole frame
+  CHECK(rect.x == 0 && rect.y == 0 && rect.w == 800 && rect.h == 600);
+
+  CHECK(IMG_RoiRect(800, 600, 25, 50, 50, 25, &rect));
+  CHECK(rect.x == 200 && rect.y == 300 && rect.w == 400 && rect.h == 150);
+
+  CHECK(IMG_RoiRect(800, 600, 75, 80, 50, 50, &rect));           // Clipped to the frame
+  CHECK(rect.x == 600 && rect.y == 480 && rect.w == 200 && rect.h == 120);
+
+  CHECK(!IMG_RoiRect(400, 300, 99, 0, 100, 100, &rect));         // 8 pixels minimum
+  CHECK(!IMG_RoiRect(100, 75, 0, 0, 5, 100, &rect));
+  CHECK(IMG_RoiRect(100, 75, 0, 0, 8, 100, &rect));
+}
+
+static void testWindow() {
+  ImgWindow win;
+
+  IMG_RoiWindow(0, 0, 100, 100, 0, &win);                         // Whole sensor
+  CHECK(win.offsetX == 0 && win.offsetY == 0 && win.totalX == 1600 && win.totalY == 1200);
+  CHECK(win.outputX == 1600 && win.outputY == 1200);
+
+  IMG_RoiWindow(25, 25, 50, 50, 1, &win);
+  CHECK(win.offsetX == 400 && win.offsetY == 296);                // Multiples of 8
+  CHECK(win.totalX == 800 && win.totalY == 600);
+  CHECK(win.outputX == 400 && win.outputY == 296);
+
+  IMG_RoiWindow(10, 10, 1, 1, 0, &win);                           // At least 64x64
+  CHECK(win.totalX == 64 && win.totalY == 64);
+
+  IMG_RoiWindow(90, 90, 50, 50, 3, &win);                         // Inside the sensor
+  CHECK(win.offsetX + win.totalX <= 1600 && win.offsetY + win.totalY <= 1200);
+  CHECK(win.outputX % 8 == 0 && win.outputY % 8 == 0);
+}
+
+static void testCopy() {
+  std::vector<uint8_t> frame;
+  int w = 200, h = 150;
+  ImgRect rect;
+
+  makeFrame(frame, w, h);
+  CHECK(IMG_RoiRect(w, h, 13, 21, 40, 50, &rect));                // Not aligned to the blocks
+  std::vector<uint8_t> rgb(rect.w * rect.h * 3, 0xee);
+  cropFrame(frame, w, h, rect, rgb.data());
+
+  int wrong = 0;
+  for (int y = 0; y < rect.h; y++) {
+    for (int x = 0; x < rect.w; x++) {
+      const uint8_t * p = &rgb[(y * rect.w + x) * 3];
+      int fx = rect.x + x, fy = rect.y + y;
+      if (p[0] != ((fx + fy) & 0xff) || p[1] != (fy & 0xff) || p[2] != (fx & 0xff)) {
+        wrong++;                                                  // RGB = frame BGR swapped
+      }
+    }
+  }
+  CHECK(wrong == 0);
+
+  // Blocks outside the ROI leave the buffer alone.
+  std::vector<uint8_t> before = rgb;
+  IMG_RoiCopy(&rect, rgb.data(), 0, 0, 16, 16, frame.data());
+  IMG_RoiCopy(&rect, rgb.data(), rect.x + rect.w, rect.y, 16, 16, frame.data());
+  CHECK(rgb == before);
+}
+
+static void benchmark() {
+  static const struct { const char * name; int w, h; } sizes[] = {
+    { "VGA", 640, 480 }, { "SVGA", 800, 600 }, { "XGA", 1024, 768 }, { "UXGA", 1600, 1200 }
+  };
+  std::vector<uint8_t> frame, rgb;
+  ImgRect rect;
+
+  printf("%-6s %10s %12s\n", "frame", "roi", "crop");
+  for (auto& size : sizes) {
+    makeFrame(frame, size.w, size.h);
+    IMG_RoiRect(size.w, size.h, 25, 25, 50, 50, &rect);
+    rgb.resize(rect.w * rect.h * 3);
+    int runs = 50;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++) {
+      cropFrame(frame, size.w, size.h, rect, rgb.data());
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / runs;
+    printf("%-6s %5ux%-4u %9.1f us\n", size.name, rect.w, rect.h, us);
+  }
+
+  int runs = 1000000;
+  volatile int sink = 0;
+  ImgWindow win;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++) {
+    IMG_RoiRect(1600, 1200, i % 90, i % 80, 50, 50, &rect);
+    IMG_RoiWindow(i % 90, i % 80, 50, 50, i & 3, &win);
+    sink = sink + rect.w + win.outputX;
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / runs;
+  printf("%-6s %10s %9.2f ns\n", "region", "rect+win", ns);
+}
+
+int main() {
+  testRect();
+  testWindow();
+  testCopy();
+  benchmark();
+  printf("%d errors\n", errors);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,227 @@
+/**************************************************************************
+ * 
+ * Host test and benchmark of the report wire formats (src/WireFormat.h):
+ * short key table, the compact MessagePack round trip, and the time to
+ * serialize the state, config and camera settings reports as JSON,
+ * MessagePack and MessagePack with short keys into a payload buffer, as
+ * WIRE_Benchmark does on the device. The reports are filled with the
+ * device's keys and typical values.
+ * Needs ArduinoJson 6 (the copy PlatformIO installs in .pio/libdeps works):
+ * 
+ *   g++ -std=c++11 -O2 -I<ArduinoJson>/src test/wire_format_test.cpp -o wire_format_test && ./wire_format_test
+ * 
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <ArduinoJson.h>
+#include "../src/WireFormat.h"
+
+static int errors = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL line %d: %s\n", __LINE__, #cond); errors++; } } while (0)
+
+static const size_t PAYLOAD_SIZE = 4096;                          // MQTT_MAX_PAYLOAD
+
+// State report (fillState): all sections enabled.
+static void fillState(JsonDocument& doc) {
+  static const char * const counters[] = {
+    "WiFi Reconnects", "MQTT Reconnects", "Last Downtime (s)", "Total Downtime (s)", "Offline Photos Spooled",
+    "Offline Photos Dropped", "Offline Photos Waiting", "MQTT Publish Failures", "MQTT Oversize", "Motion Sessions",
+    "PIR Pulses", "PIR Retriggers Suppressed", "Events Dropped", "Events Max Queued", "Rate Limit Deferred",
+    "Photos Pending", "Boots", "PIR Wakeups", "Wake To Photo Last (ms)", "Wake To Photo Avg (ms)", "Wake To Photo Max (ms)",
+    "Time-lapse Frames", "Time-lapse Uploads", "Time-lapse Deferred", "Time-lapse Skipped", "Time-lapse Failed",
+    "Trigger To Exposure Last (ms)", "Trigger To Exposure Avg (ms)", "Trigger To Exposure Max (ms)", "Stale Frames Drained",
+    "Frame Period (ms)", "Trigger To Usable Last (ms)", "Trigger To Usable Avg (ms)", "Trigger To Usable Max (ms)",
+    "Night Photos", "Night Scene Luma", "Night Photo Luma", "Night Exposure", "Night Gain", "Night To Usable Avg (ms)",
+    "Stream Idle", "Stream Frames Saved", "Stream Saved (kB/h)", "Stream Check (us)", "JPEG Quality", "Last Photo (bytes)",
+    "Duplicates Skipped", "Hash Distance", "Hash Last (us)", "Hash Max (us)", "ROI Photos", "ROI Failures",
+    "ROI Last (ms)", "ROI Max (ms)"
+  };
+  static const char * const stages[] = { "capture", "upload", "stream" };
+  static const char * const classes[] = { "motion", "pirphoto", "photo", "telemetry" };
+
+  doc["IP Address"] = "192.168.1.57";
+  doc["RSSI (dBm)"] = -67;
+  doc["wifi"] = 66;
+  doc["Core Temperature (°C)"] = 53;
+  doc["Uptime"] = "3d14:07:52";
+  doc["Start Reason"] = "Deep Sleep Wakeup";
+  doc["Free Heap Memory"] = 143212;
+  doc["Min Free Heap"] = 98344;
+  for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+    doc[counters[i]] = 1000 + 37 * i;
+  }
+  doc["PIR Pulse Rate (/min)"] = 1.75;
+  doc["PIR Pulse Width (ms)"] = 2480;
+  doc["Awake (%)"] = 12.5;
+  doc["Est Current (mA)"] = 31.2;
+  doc["Night Frames Per Photo"] = 2.3;
+  doc["ROI Last In/Out (bytes)"] = "48213/17022";
+  JsonObject rateDropped = doc.createNestedObject("Rate Limit Dropped");
+  for (const char * name : classes) {
+    rateDropped[name] = 3;
+  }
+  JsonObject pipe = doc.createNestedObject("Pipeline");
+  for (const char * name : stages) {
+    JsonObject stat = pipe.createNestedObject(name);
+    stat["busy %"] = 14;
+    stat["per min"] = 2.4;
+    stat["avg ms"] = 870;
+    stat["max ms"] = 2210;
+    stat["queued"] = 0;
+    stat["queue max"] = 2;
+    stat["dropped"] = 0;
+  }
+}
+
+// Config report (fillConfig).
+static void fillConfig(JsonDocument& doc) {
+  static const char * const fields[] = {
+    "CAM_enabled", "PIR_enabled", "PIR_delay", "ReportState", "ReportWiFi", "TempInterval", "StateInterval",
+    "DedupThreshold", "PowerMode", "SleepIdle", "LapseInterval", "LapseStart", "LapseEnd", "LapseBatch", "WireFormat",
+    "ClipSeconds", "ClipFps", "StallThreshold"
+  };
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    doc[fields[i]] = (int)(i * 250);
+  }
+  doc["TopicPrefix"] = "gate";
+  doc["ClientId"] = "ESP32CAM-A4CF12F00D1E";
+}
+
+// Camera settings report (cam_FillSettings).
+static void fillSettings(JsonDocument& doc) {
+  static const char * const params[] = {
+    "framesize", "quality", "aec", "aec2", "ae_level", "agc", "gainceiling", "awb", "awb_gain", "wb_mode",
+    "aec_value", "agc_gain", "brightness", "contrast", "saturation", "sharpness", "denoise",
+    "special_effect", "bpc", "wpc", "raw_gma", "lenc", "hmirror", "vflip", "dcw", "colorbar",
+    "target_size", "target_time", "roi_mode", "roi_x", "roi_y", "roi_w", "roi_h", "roi_scale",
+    "grab_mode", "fb_location", "fresh", "StreamIdle", "night"
+  };
+  doc["sensor"] = "OV2640";
+  for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+    doc[params[i]] = (int)(i % 7);
+  }
+  doc["profile"] = "day";
+}
+
+// Long keys back from the short ones (what a receiver does with the "wirekeys" table).
+static void expand(JsonObjectConst src, JsonObject dst) {
+  for (JsonPairConst member : src) {
+    const char * key = member.key().c_str();
+    int index = atoi(key);
+    if (key[0] >= '0' && key[0] <= '9' && index < WIRE_KEYS) {
+      key = wireKeys[index];
+    }
+    if (member.value().is<JsonObjectConst>()) {
+      expand(member.value().as<JsonObjectConst>(), dst.createNestedObject(key));
+    } else {
+      dst[key] = member.value();
+    }
+  }
+}
+
+// Every key of a report is in the table (else it goes out long).
+static bool allShort(JsonObjectConst obj) {
+  for (JsonPairConst member : obj) {
+    if (WIRE_Key(member.key().c_str()) == member.key().c_str()) {
+      printf("  not in wireKeys: %s\n", member.key().c_str());
+      return false;
+    }
+    if (member.value().is<JsonObjectConst>() && !allShort(member.value().as<JsonObjectConst>())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void testKeys() {
+  CHECK(strcmp(WIRE_Key("IP Address"), "0") == 0);
+  CHECK(strcmp(WIRE_Key(wireKeys[WIRE_KEYS - 1]), std::to_string(WIRE_KEYS - 1).c_str()) == 0);
+  CHECK(strcmp(WIRE_Key("unknown key"), "unknown key") == 0);     // Not in the table: kept
+  for (int i = 0; i < WIRE_KEYS; i++) {
+    for (int j = i + 1; j < WIRE_KEYS; j++) {
+      CHECK(strcmp(wireKeys[i], wireKeys[j]) != 0);               // Unique, or decoding is ambiguous
+    }
+  }
+}
+
+static void testRoundTrip(const char * name, void (*fill)(JsonDocument&)) {
+  DynamicJsonDocument doc(8192), compact(8192), decoded(8192), restored(8192);
+  static char json[PAYLOAD_SIZE], again[PAYLOAD_SIZE], packed[PAYLOAD_SIZE];
+
+  fill(doc);
+  CHECK(!doc.overflowed());
+  CHECK(allShort(doc.as<JsonObjectConst>()));
+  size_t jsonLen = serializeJson(doc, json, sizeof(json));
+  size_t msgPackLen = measureMsgPack(doc);
+  WIRE_Compact(doc.as<JsonObjectConst>(), compact.to<JsonObject>());
+  size_t compactLen = serializeMsgPack(compact, packed, sizeof(packed));
+  CHECK(compactLen < msgPackLen && msgPackLen < jsonLen);
+
+  CHECK(!deserializeMsgPack(decoded, packed, compactLen));
+  expand(decoded.as<JsonObjectConst>(), restored.to<JsonObject>());
+  serializeJson(restored, again, sizeof(again));
+  if (strcmp(json, again) != 0) {
+    printf("  %s: round trip differs\n", name);
+    errors++;
+  }
+}
+
+static void benchmark() {
+  static const struct { const char * name; void (*fill)(JsonDocument&); } reports[] = {
+    { "state", fillState }, { "config", fillConfig }, { "settings", fillSettings }
+  };
+  static char payload[PAYLOAD_SIZE];
+  const int runs = 20000;
+
+  printf("%-9s %16s %16s %16s\n", "report", "json", "msgpack", "compact");
+  for (auto& report : reports) {
+    DynamicJsonDocument doc(8192), compact(8192);
+    size_t len[3] = {};
+    double us[3];
+
+    report.fill(doc);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++) {
+      len[0] = serializeJson(doc, payload, sizeof(payload));
+    }
+    auto end = std::chrono::steady_clock::now();
+    us[0] = std::chrono::duration<double, std::micro>(end - start).count() / runs;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++) {
+      len[1] = serializeMsgPack(doc, payload, sizeof(payload));
+    }
+    end = std::chrono::steady_clock::now();
+    us[1] = std::chrono::duration<double, std::micro>(end - start).count() / runs;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++) {                              // Key translation included, like on the device
+      compact.clear();
+      WIRE_Compact(doc.as<JsonObjectConst>(), compact.to<JsonObject>());
+      len[2] = serializeMsgPack(compact, payload, sizeof(payload));
+    }
+    end = std::chrono::steady_clock::now();
+    us[2] = std::chrono::duration<double, std::micro>(end - start).count() / runs;
+
+    printf("%-9s", report.name);
+    for (int f = 0; f < 3; f++) {
+      printf(" %5uB %7.2f us", (unsigned)len[f], us[f]);
+    }
+    printf("\n");
+  }
+}
+
+int main() {
+  testKeys();
+  testRoundTrip("state", fillState);
+  testRoundTrip("config", fillConfig);
+  testRoundTrip("settings", fillSettings);
+  benchmark();
+  printf("%d errors\n", errors);
+  return errors ? 1 : 0;
+}